@@ -220,6 +220,11 @@ static inline int atomic_casptr_relaxed(void *volatile *a, void **cmp, void *set
                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
 }
 
+static inline void *atomic_xchgptr(void *volatile *a, void *v)
+{
+    return __atomic_exchange_n(a, v, __ATOMIC_SEQ_CST);
+}
+
 static inline int32_t atomic_add32(int32_t volatile *a, int32_t v)
 {
     return __atomic_fetch_add(a, v, __ATOMIC_SEQ_CST);
@@ -250,6 +255,11 @@ static inline uint64_t atomic_add64_relaxed(uint64_t volatile *a, uint64_t v)
     return __atomic_fetch_add(a, v, __ATOMIC_RELAXED);
 }
 
+static inline uint64_t atomic_or64_relaxed(uint64_t volatile *a, uint64_t v)
+{
+    return __atomic_fetch_or(a, v, __ATOMIC_RELAXED);
+}
+
 static inline void memory_fence()
 {
     __atomic_thread_fence(__ATOMIC_SEQ_CST);
@@ -0,0 +1,106 @@
+#pragma once
+#include <stddef.h>
+#include <new>
+#include "lf/compiler.hh"
+
+namespace lf
+{
+
+/*
+    容量固定、存储内联的vector，不做任何堆分配。
+    只用于容量有确定上界的场景，超出容量是调用者的bug。
+    存储不初始化，元素在push_back/emplace_back时才构造，构造TCursor这样的对象不用清零整个数组。
+*/
+template <typename T, size_t N>
+class InlineVector
+{
+  public:
+    typedef T value_type;
+    typedef T *iterator;
+    typedef const T *const_iterator;
+
+    InlineVector() : size_(0) {}
+    InlineVector(const InlineVector &other) : size_(0)
+    {
+        for (size_t i = 0; i < other.size_; ++i)
+            push_back(other.data()[i]);
+    }
+    InlineVector &operator=(const InlineVector &other)
+    {
+        if (this != &other)
+        {
+            clear();
+            for (size_t i = 0; i < other.size_; ++i)
+                push_back(other.data()[i]);
+        }
+        return *this;
+    }
+    ~InlineVector() { clear(); }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    static size_t capacity() { return N; }
+
+    iterator begin() { return data(); }
+    iterator end() { return data() + size_; }
+    const_iterator begin() const { return data(); }
+    const_iterator end() const { return data() + size_; }
+
+    T &operator[](size_t i)
+    {
+        lf_precondition(i < size_);
+        return data()[i];
+    }
+    const T &operator[](size_t i) const
+    {
+        lf_precondition(i < size_);
+        return data()[i];
+    }
+
+    T &back()
+    {
+        lf_precondition(size_ > 0);
+        return data()[size_ - 1];
+    }
+    const T &back() const
+    {
+        lf_precondition(size_ > 0);
+        return data()[size_ - 1];
+    }
+
+    void push_back(const T &x)
+    {
+        lf_precondition(size_ < N);
+        new (data() + size_) T(x);
+        ++size_;
+    }
+
+    template <typename... Args>
+    void emplace_back(Args &&... args)
+    {
+        lf_precondition(size_ < N);
+        new (data() + size_) T(static_cast<Args &&>(args)...);
+        ++size_;
+    }
+
+    void pop_back()
+    {
+        lf_precondition(size_ > 0);
+        data()[--size_].~T();
+    }
+
+    void clear()
+    {
+        while (size_)
+            data()[--size_].~T();
+    }
+
+  private:
+    size_t size_;
+    alignas(T) unsigned char buf_[sizeof(T) * N];
+
+    T *data() { return reinterpret_cast<T *>(buf_); }
+    const T *data() const { return reinterpret_cast<const T *>(buf_); }
+};
+
+} // namespace lf
@@ -1,10 +1,50 @@
 #pragma once
 #include "lf/status.hh"
+#include "lf/limbo.hh"
+#include <stdint.h>
 
 namespace lf {
+
+    class ThreadInfo;
     
-    Status init_lf_library(size_t work_thread_no);
+    // g_all_threads的前work_thread_no个槽位固定分配给工作线程(下标即线程号)，
+    // 总容量是max(work_thread_no, max_thread_no), 其余槽位通过register_thread动态使用
+    Status init_lf_library(size_t work_thread_no, size_t max_thread_no = 0);
+
+    struct LfOptions
+    {
+        size_t work_thread_no;
+        size_t max_thread_no;
+        ReclaimMode reclaim_mode; // 见limbo.hh中的reclaim_interval
+
+        LfOptions()
+            : work_thread_no(1), max_thread_no(0), reclaim_mode(reclaim_epoch)
+        {
+        }
+    };
+
+    Status init_lf_library(const LfOptions &options);
+
+    // 占用一个空闲槽位，返回它的ThreadInfo(下标是index(), 也用作init_mcas_thread_ctx的线程号)，
+    // 容量用完时返回nullptr。注销前不能有活跃的LimboHandle, 还没释放的limbo交给其他线程
+    ThreadInfo *register_thread();
+    void unregister_thread(ThreadInfo *ti);
 
     void deinit_lf_library();
 
+    // 后台线程每interval_us微秒推进一次global_epoch, 打开后new_handle不再自己推进。
+    // 适合handle很多、但每个线程很长时间才打开一个handle的场景
+    Status start_epoch_ticker(uint32_t interval_us = 1000);
+    void stop_epoch_ticker();
+
+    // 打开后台回收：工作线程写满的LimboGroup交给后台线程释放，MrcuCallback也在那里执行。
+    // ti专门给回收线程使用(需要在g_all_threads中)，不能同时被其他线程使用。
+    // stop时工作线程最好已经停止，之后还没有释放完的内存挂到ti上，由ti的hard_free/destroy释放
+    Status start_background_reclaimer(ThreadInfo *ti, uint32_t interval_us = 100);
+    void stop_background_reclaimer();
+
+    // limbo总量超过watermark_bytes时打印最老的handle并置limbo_pressure, 0表示不检查;
+    // repin_epoch_age不为0时打开re-pin策略(LimboHandle::should_repin)
+    void set_limbo_policy(uint64_t watermark_bytes, uint64_t repin_epoch_age = 0);
+
 } // end namespace;
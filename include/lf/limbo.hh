@@ -1,10 +1,13 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdio.h>
+#include <malloc.h>
 #include <mutex>
 #include <assert.h>
 #include <vector>
 #include "lf/compiler.hh"
+#include "lf/mt_counters.hh"
 
 /*
 1. 需要维护两个全局的epoch， latest_epoch, min_active_epoch
@@ -21,6 +24,8 @@ limbo_thread对象维护自己的active_epoch, limbo_group链表。
 所以在设计上做个妥协，每个事务在生命期内只能绑定在一个线程上执行。
 由每个线程自己维护事务sorted链表，并在thread本地维护min_active_epoch.
 全局min_active_epoch由遍历每个线程获取，这个值不必是实时的，不需要使用屏障。
+5. 确实需要跨线程的事务用可迁移的handle(new_migratable_handle), 它不进线程的链表，
+而是计入全局按epoch分桶的计数(g_epoch_buckets), 见下面的说明。
 */
 
 namespace lf
@@ -29,7 +34,107 @@ namespace lf
 typedef uint64_t Epoch;
 typedef int64_t SignedEpoch;
 
-extern volatile Epoch global_epoch; // global epoch, updated regularly
+/*
+global_epoch从1开始，只会增加。new_handle只读它，不做原子加，避免所有线程争用同一个cache line。
+推进它的有：
+1. 每个线程每epoch_advance_interval次new_handle尝试用CAS加1(没有打开ticker时)，
+   同一时刻注意到的多个线程只有一个成功；
+2. hard_free发现最老的待释放内存还停在当前epoch时；
+3. start_epoch_ticker打开的后台线程，定期加1；
+4. 需要等待grace period的地方(fork, rebuild_filter)直接原子加1。
+handle的epoch可以重复，释放条件仍然是: 释放时的epoch < 所有活跃handle的epoch。
+*/
+extern volatile Epoch global_epoch;
+extern volatile bool epoch_ticker_on;
+
+/*
+后台回收模式(start_background_reclaimer): 工作线程的LimboGroup写满后整个交给回收线程，
+工作线程的hard_free什么都不做，只往limbo追加，释放和MrcuCallback都在回收线程上执行。
+交出的group放在一个无锁栈上，回收线程一次取走整个栈(exchange)，所以没有ABA问题；
+释放完的group用同样的方式还给工作线程复用。
+每个工作线程最多留下一个没写满的group等到下一次交出或者destroy时释放。
+*/
+extern volatile bool background_reclaim_on;
+
+/*
+limbo记账：每个ThreadInfo记录经它进入limbo的对象数/字节数，减去经它释放的，
+所有线程的和就是还在limbo中的总量(group交给其他线程释放时，单个线程的值可能是负数)。
+limbo_watermark_bytes不为0时，每写满一个LimboGroup检查一次总量，超过时置limbo_pressure,
+并打印一次limbo_report, 找出拖住回收的handle。
+repin_epoch_age不为0时打开re-pin策略：长时间持有handle的读者在安全点检查should_repin,
+由repin把handle换到当前epoch, 让它之前的limbo可以释放。
+*/
+extern volatile uint64_t limbo_watermark_bytes;
+extern volatile uint64_t repin_epoch_age;
+extern volatile bool limbo_pressure;
+
+/*
+回收方式，只在init_lf_library时选择，之后不能改变。
+1. reclaim_epoch: 上面的epoch回收，任何一个活跃的handle都会挡住它之后进入limbo的所有内存。
+2. reclaim_interval: 区间回收(interval-based reclamation)。ThreadInfo::alloc分配的块前面多16字节，
+   记录分配时的epoch(出生epoch)，进入limbo时的epoch是它的退休epoch。
+   区间handle(new_interval_handle)的保护范围是[打开时的epoch, hi], hi在每次protect读指针时
+   推进到当前epoch, 所以它只挡住出生不晚于hi、退休不早于打开时epoch的对象，
+   停住的读者挡住的内存是有限的。普通handle和可迁移handle的hi是无穷大，与epoch回收相同。
+   区间handle读共享指针必须经过protect; epoch回收时protect只是普通的读。
+   ThreadInfo::alloc分配的块不能用direct_free释放，要用dealloc或者free_block。
+   反过来dealloc也只接受ThreadInfo::alloc/alloc_block的块(MrcuCallback和DeferBatch除外),
+   区间回收时会读块头，debug构建下用块头里的magic检查。
+*/
+enum ReclaimMode
+{
+  reclaim_epoch = 0,
+  reclaim_interval = 1
+};
+
+extern ReclaimMode reclaim_mode;
+
+const Epoch unbounded_era = ~Epoch(0);
+
+// 一个线程的保护范围：它所有handle的[最小的打开epoch, 最大的hi]
+struct EraReservation
+{
+  Epoch lo;
+  Epoch hi;
+};
+
+/*
+可迁移的handle在一个线程上打开，可以换到其他线程继续使用并在那里关闭(比如协程在别的工作线程上恢复)。
+它的epoch不记在任何线程的min_epoch_里，而是计入g_epoch_buckets[epoch % epoch_bucket_count]:
+每个桶一个64位字，高44位是epoch的低44位，低20位是打开的handle数，打开和关闭各一次原子操作。
+桶里还有更早的epoch的handle时，新handle直接按那个更早的epoch计数(只会更保守)，
+所以每个桶只需要记一个epoch。但是只在落后不超过epoch_bucket_count时才这样加入，
+否则handle首尾相接不断加入的桶会永远停在最早的epoch上; 这时依次试后面的桶(桶里存着epoch,
+桶号不必与epoch对应), 所有桶都太旧时等其中一个排空。所以计入的epoch最多落后epoch_bucket_count。
+min_active_epoch同时取所有计数非0的桶中最小的epoch。
+活跃的handle不可能落后global_epoch 2^44个epoch, 所以按当前global_epoch就能还原完整的epoch。
+*/
+enum
+{
+  epoch_bucket_count = 64,
+  epoch_bucket_count_bits = 20
+};
+
+struct EpochBucket
+{
+  volatile uint64_t word_;
+  char pad_[64 - sizeof(uint64_t)];
+};
+
+extern EpochBucket g_epoch_buckets[epoch_bucket_count];
+
+// 按epoch(或者桶里不早于epoch - epoch_bucket_count的epoch)计数，返回实际计入的epoch, *bucket是桶号
+Epoch pin_epoch_bucket(Epoch epoch, int32_t *bucket);
+// 返回这个桶是否变空
+bool unpin_epoch_bucket(int32_t bucket);
+// 计数非0的桶中最小的epoch, 没有的话返回1 << 63
+Epoch min_bucket_epoch();
+
+// 只有global_epoch仍然是epoch时才推进，返回是否由本次调用推进
+inline bool try_advance_epoch(Epoch epoch)
+{
+  return atomic_cas64(&global_epoch, &epoch, epoch + 1);
+}
 
 class ThreadInfo;
 class LimboHandle;
@@ -38,6 +143,7 @@ enum MemTag : uint16_t
 {
   MemTagNone = 0x0000,
   MemTagPoolMask = 0x00FF,
+  MemTagDeferBatch = 0xFFFE,
   MemTagRcuCallback = 0xFFFF
 };
 
@@ -89,6 +195,10 @@ struct LimboGroup
   }
 
   inline uint32_t clean_until(ThreadInfo &ti, Epoch epoch_bound, uint32_t count);
+
+  // 区间回收：释放退休epoch小于bound、且不和任何reservation重叠的对象，
+  // 其余的向前压紧，返回释放的个数
+  inline size_t clean_intervals(ThreadInfo &ti, const EraReservation *rs, size_t nrs, Epoch bound);
 };
 
 class LimboHandle
@@ -102,6 +212,8 @@ private:
   LimboHandle *next_;
   ThreadInfo *ti_;
   Epoch my_epoch_;
+  Epoch hi_era_;   // 区间handle已经protect到的epoch, 其他为unbounded_era
+  int32_t bucket_; // 可迁移的handle所在的桶，其他为-1
   void *ptrbuf_[dealloc_cache_size];
   MemTag ptrtags_[dealloc_cache_size];
   int ptrbuf_size_;
@@ -111,18 +223,46 @@ private:
         next_(this),
         ti_(nullptr),
         my_epoch_(0),
+        hi_era_(unbounded_era),
+        bucket_(-1),
         ptrbuf_size_(0)
   {
   }
 
   inline ~LimboHandle();
 
+  // 把缓存的待释放指针交给ThreadInfo。handle会被复用，不能用显式调用析构函数代替：
+  // 编译器认为析构之后对象已经结束生命期，会删掉析构函数里对ptrbuf_size_的写
+  inline void flush();
+
 public:
 
+  bool migratable() const
+  {
+    return bucket_ >= 0;
+  }
+
   inline void *alloc(size_t size, MemTag tag = MemTagNone);
 
   inline void dealloc(void *p, MemTag tag = MemTagNone);
 
+  Epoch epoch() const
+  {
+    return my_epoch_;
+  }
+
+  // 读*src中的共享指针。区间handle在epoch变化后先推进hi再重读，保证读到的对象出生不晚于hi
+  template <typename T>
+  T *protect(T *const volatile *src)
+  {
+    return static_cast<T *>(protect_ptr(reinterpret_cast<void *const volatile *>(src)));
+  }
+  inline void *protect_ptr(void *const volatile *src);
+
+  // 在安全点(不再持有从树中读到的指针)调用，返回true时应该用ThreadInfo::repin换到新的epoch:
+  // handle已经落后repin_epoch_age个epoch, 或者limbo超过了水位而它不在当前epoch
+  inline bool should_repin() const;
+
   friend class ThreadInfo;
 };
 
@@ -132,6 +272,32 @@ struct MrcuCallback
   virtual void operator()(ThreadInfo *ti) = 0;
 };
 
+// ThreadInfo::defer登记的延迟执行的函数，ti是执行它的线程
+typedef void (*DeferFn)(void *arg, ThreadInfo *ti);
+
+/*
+一批延迟执行的(fn, arg)。每个线程攒着当前的一批，写满或者global_epoch已经越过第一项时，
+在hard_free中作为一个MemTagDeferBatch项进入limbo, epoch取进入limbo时的epoch(不早于其中任何一项登记时的epoch)，
+grace period之后按登记顺序依次执行，执行完的batch回到执行线程的free_batches_中复用。
+相比每项一个MrcuCallback, 省掉了每项的分配和limbo项，执行时也没有虚函数调用。
+*/
+struct DeferBatch
+{
+  enum
+  {
+    capacity = 62 // 整个batch不超过1024字节
+  };
+  struct Entry
+  {
+    DeferFn fn_;
+    void *arg_;
+  };
+  uint32_t size_;
+  Epoch epoch_;      // 第一项登记时的epoch
+  DeferBatch *next_; // 在free_batches_中时使用
+  Entry e_[capacity];
+};
+
 
 /*
 要保证内存安全，上下文中必须持有合适的LimboHandle
@@ -147,15 +313,29 @@ private:
   LimboGroup *group_head_;
   LimboGroup *group_tail_;
   Epoch max_epoch_;
+  uint32_t handles_since_advance_;
+  bool in_reclaim_;               // 正在区间回收，释放时触发的refill_group不再进入
+  uint32_t groups_since_reclaim_; // 上次区间回收之后新写满的group数
+  uint32_t groups_after_reclaim_; // 上次区间回收之后剩下的group数
+  std::vector<EraReservation> reservations_;
+  DeferBatch *defer_batch_;  // 正在攒的一批，还没有进入limbo
+  DeferBatch *free_batches_; // 执行完的batch, 最多缓存defer_batch_max_free个
+  uint32_t free_batch_cnt_;
 
   enum
   {
-    pool_max_nlines = 20
+    epoch_advance_interval = 64,
+    defer_batch_max_free = 16,
+    pool_max_nlines = 20,
+    pool_max_count = 256 // 每个尺寸最多缓存的块数
   };
   void *pool_[pool_max_nlines];
+  uint32_t pool_cnt_[pool_max_nlines];
 
 public:
   volatile Epoch min_epoch_;
+  volatile Epoch hi_era_;   // 所有handle中最大的hi, 与min_epoch_一起构成本线程的EraReservation
+  volatile int32_t in_use_; // 槽位是否被占用，见register_thread
 
   ThreadInfo();
   ~ThreadInfo();
@@ -163,13 +343,120 @@ public:
   // 用户需要确保此时没有活跃的LimboHandle
   void destroy();
 
-  LimboHandle *new_handle();
+  LimboHandle *new_handle()
+  {
+    return open_handle(false);
+  }
+  // 读共享指针都经过protect的handle, 见reclaim_interval。epoch回收时与new_handle相同
+  LimboHandle *new_interval_handle()
+  {
+    return open_handle(true);
+  }
+  // 可以在任何线程上delete_handle可迁移的handle, 缓存的待释放指针交给关闭它的线程
   void delete_handle(LimboHandle *handle);
 
+  // 可迁移的handle, 见g_epoch_buckets。换到另一个线程之后要先在那个线程上resume_handle,
+  // 才能再通过它alloc/dealloc(使用当前线程的内存池和limbo)
+  LimboHandle *new_migratable_handle();
+  void resume_handle(LimboHandle *handle)
+  {
+    assert(handle->migratable());
+    handle->ti_ = this;
+  }
+
+  // 把本线程的handle(或者已经resume到本线程的可迁移handle)换到当前epoch,
+  // 调用者之前从树中读到的指针之后都不能再用
+  void repin(LimboHandle *handle);
+
+  // 经本线程进入limbo的减去经本线程释放的，见limbo_watermark_bytes
+  int64_t limbo_objects() const
+  {
+    return atomic_load_relaxed(const_cast<volatile int64_t *>(&limbo_objects_));
+  }
+  int64_t limbo_bytes() const
+  {
+    return atomic_load_relaxed(const_cast<volatile int64_t *>(&limbo_bytes_));
+  }
+
+  // 在g_all_threads中的下标
+  int32_t index() const
+  {
+    return index_;
+  }
+  void set_index(int32_t index)
+  {
+    index_ = index;
+  }
+
+  // 只由本线程修改，LF_MT_COUNTERS关闭时一直是0
+  MtCounters &mt_counters()
+  {
+    return mt_counters_;
+  }
+
+  // 内存池按64字节的行数分级，返回size对应的tag, 太大的返回MemTagNone
+  static MemTag pool_tag(size_t size)
+  {
+    size_t nl = (size + 63) / 64;
+    return nl <= pool_max_nlines ? MemTag(nl) : MemTagNone;
+  }
+
+  // 区间回收时块前面的块头：出生epoch和block_magic, 占16字节
+  static const uint64_t block_magic = 0x6c696d626f626c6bULL;
+  static size_t block_header_size()
+  {
+    return reclaim_mode == reclaim_interval ? 16 : 0;
+  }
+  static void *block_raw(void *p)
+  {
+    return static_cast<char *>(p) - block_header_size();
+  }
+  // MrcuCallback, DeferBatch和epoch回收时按0算，即不比任何handle晚
+  static Epoch block_birth(void *p, MemTag tag)
+  {
+    if (tag == MemTagRcuCallback || tag == MemTagDeferBatch || !block_header_size())
+      return 0;
+    return *static_cast<Epoch *>(block_raw(p));
+  }
+  // dealloc/free_block只接受alloc/alloc_block分配的块, 区间回收时用块头的magic检查
+  static bool block_tagged(void *p)
+  {
+    return !block_header_size() || static_cast<uint64_t *>(block_raw(p))[1] == block_magic;
+  }
+  // 不走内存池分配一个带块头的块，用free_block或dealloc释放
+  static void *alloc_block(size_t size)
+  {
+    size_t hdr = block_header_size();
+    void *raw = calloc(1, size + hdr);
+    return raw ? stamp_block(raw) : nullptr;
+  }
+
+  // 带pool_tag的分配优先复用本线程内存池中的块，这样的块不清零
   void *alloc(size_t size, MemTag tag = MemTagNone)
   {
-    (void)tag;
-    return calloc(1, size);
+    int nl = tag & MemTagPoolMask;
+    if (tag == MemTagRcuCallback || nl == 0)
+      return alloc_block(size);
+    lf_precondition(size <= size_t(nl) * 64);
+    void *raw = pool_[nl - 1];
+    if (raw)
+    {
+      pool_[nl - 1] = *reinterpret_cast<void **>(raw);
+      --pool_cnt_[nl - 1];
+    }
+    else
+    {
+      raw = calloc(1, size_t(nl) * 64 + block_header_size());
+    }
+    return stamp_block(raw);
+  }
+  // 不经过limbo直接释放alloc分配的块
+  static void free_block(void *p)
+  {
+    if (!p)
+      return;
+    assert(block_tagged(p));
+    ::free(block_raw(p));
   }
   void dealloc(void *p, MemTag tag = MemTagNone)
   {
@@ -189,9 +476,52 @@ public:
     record_rcu(cb, MemTagRcuCallback);
   }
 
+  // grace period之后在某个线程上执行fn(arg, ti), 见DeferBatch。
+  // 同一个线程登记的按登记顺序执行；arg的内存由fn负责，可以用release还给执行线程的内存池
+  void defer(DeferFn fn, void *arg)
+  {
+    DeferBatch *b = defer_batch_;
+    if (!b)
+      b = defer_batch_ = new_defer_batch();
+    if (b->size_ == 0)
+      b->epoch_ = atomic_load_relaxed(&global_epoch);
+    b->e_[b->size_].fn_ = fn;
+    b->e_[b->size_].arg_ = arg;
+    if (++b->size_ == DeferBatch::capacity)
+      seal_defer_batch();
+  }
+
+  // 不经过limbo立即释放alloc(size, tag)分配的块，池化的块回到本线程的内存池。
+  // 只能用于已经没有其他线程能访问的块，比如defer的fn释放自己的arg
+  void release(void *p, MemTag tag)
+  {
+    if (!p)
+      return;
+    int nl = tag & MemTagPoolMask;
+    if (nl == 0 || tag == MemTagRcuCallback || tag == MemTagDeferBatch ||
+        pool_cnt_[nl - 1] >= pool_max_count)
+    {
+      free_block(p);
+      return;
+    }
+    void *raw = block_raw(p);
+    *reinterpret_cast<void **>(raw) = pool_[nl - 1];
+    pool_[nl - 1] = raw;
+    ++pool_cnt_[nl - 1];
+  }
+
   // 谨慎使用hard_free,因为它跳过了LimboHandle的时间戳保护
   // 只在 handle析构 和 ThreadInfo析构时会触发
-  void hard_free();
+  // 后台回收模式下只有force为true时才在本线程释放
+  void hard_free(bool force = false);
+
+  // 线程注销前调用(没有活跃的LimboHandle): 把还没释放的limbo交给其他线程，
+  // 内存池还给系统，槽位留给下一个注册的线程
+  void retire();
+
+  // 回收线程调用：释放交出来的group中已经可以释放的部分，返回还没有释放完的group数。
+  // final为true时把没有释放完的group接到本线程的limbo上，之后由本线程释放
+  size_t reclaim_retired_groups(bool final = false);
 
   static void* direct_alloc(size_t size, MemTag tag = MemTagNone)
   {
@@ -207,25 +537,58 @@ public:
 
 private:
   void link(LimboHandle *prev, LimboHandle *cur, LimboHandle *next);
+  LimboHandle *take_empty_handle();
+  LimboHandle *open_handle(bool interval);
+  Epoch next_handle_epoch();
+  void raise_hi_era(Epoch hi);
+  void update_hi_era();
+  void reclaim_intervals();
+  void check_limbo_watermark();
+
+  // 写块头，返回给调用者的地址; 内存池复用的块也要重写出生epoch
+  static void *stamp_block(void *raw)
+  {
+    size_t hdr = block_header_size();
+    if (!hdr)
+      return raw;
+    static_cast<Epoch *>(raw)[0] = atomic_load_relaxed(&global_epoch);
+    static_cast<uint64_t *>(raw)[1] = block_magic;
+    return static_cast<char *>(raw) + hdr;
+  }
+
+  // 内存池的块按行数计，其他按malloc_usable_size, MrcuCallback和DeferBatch只计个数
+  static size_t limbo_size(void *p, MemTag tag)
+  {
+    if (tag == MemTagRcuCallback || tag == MemTagDeferBatch)
+      return 0;
+    int nl = tag & MemTagPoolMask;
+    return nl ? size_t(nl) * 64 : malloc_usable_size(block_raw(p));
+  }
+
+  // 只由本线程修改
+  void account_limbo(void *p, MemTag tag, int64_t sign)
+  {
+    atomic_store_relaxed(&limbo_objects_, limbo_objects_ + sign);
+    atomic_store_relaxed(&limbo_bytes_, limbo_bytes_ + sign * int64_t(limbo_size(p, tag)));
+  }
   void refill_group();
+  LimboGroup *new_group();
+  void adopt_orphans();
+  DeferBatch *new_defer_batch();
+  void seal_defer_batch();
+  void run_defer_batch(DeferBatch *b);
+  void free_defer_batches();
 
   void free_rcu(void *p, MemTag tag)
   {
-    if ((tag & MemTagPoolMask) == 0)
-    {
-      if (p)
-        ::free(p);
-    }
+    if (p)
+      account_limbo(p, tag, -1);
+    if (tag == MemTagDeferBatch)
+      run_defer_batch(static_cast<DeferBatch *>(p));
     else if (tag == MemTagRcuCallback)
-    {
       (*static_cast<MrcuCallback*>(p))(this);
-    }
-    else 
-    {
-      int nl = tag & MemTagPoolMask;
-      *reinterpret_cast<void **>(p) = pool_[nl - 1];
-      pool_[nl - 1] = p;
-    }
+    else
+      release(p, tag);
   }
 
   void record_rcu(void *p, MemTag tag)
@@ -240,23 +603,97 @@ private:
   {
     if (!p)
       return;
+    assert(tag == MemTagRcuCallback || tag == MemTagDeferBatch || block_tagged(p));
     if (group_tail_->tail_ + 2 > group_tail_->capacity)
     {
       refill_group();
     }
     group_tail_->push_back(p, epoch, tag);
+    account_limbo(p, tag, 1);
   }
 
+private:
+  friend class LimboHandle;
+  volatile int64_t limbo_objects_;
+  volatile int64_t limbo_bytes_;
+  MtCounters mt_counters_;
+
   friend struct LimboGroup;
 };
 
 extern std::vector<ThreadInfo> *g_all_threads;
 
+/*
+g_all_threads的容量在init_lf_library时确定，之后线程可以动态注册/注销(register_thread)。
+注册取最低的空闲槽位，g_thread_slots_hwm是用过的最高槽位+1, 只增不减，
+遍历所有线程(min_active_epoch, help_if_needed)只看它之下的槽位，
+所以槽位复用之后，扫描的范围只与并发线程数的峰值有关。
+g_thread_slots_hwm为0表示没有经过init_lf_library(直接构造g_all_threads), 扫描整个数组。
+*/
+extern volatile uint32_t g_thread_slots_hwm;
+
+inline size_t thread_scan_limit()
+{
+  size_t hwm = atomic_load_relaxed(&g_thread_slots_hwm);
+  return hwm ? hwm : g_all_threads->size();
+}
+
+// 所有线程计数器的和，不是原子的快照，用两次快照的差看一段时间内的情况
+inline MtCounters mt_counters_snapshot()
+{
+  MtCounters sum;
+  assert(g_all_threads);
+  for (size_t i = 0; i < g_all_threads->size(); i++)
+    sum += (*g_all_threads)[i].mt_counters();
+  return sum;
+}
+
+/*
+hard_free不直接遍历所有线程，而是读缓存的回收边界reclaim_frontier:
+它是某个时刻min(global_epoch, min_active_epoch()), 先读global_epoch再遍历，
+所以之后新打开的handle的epoch都不小于它，缓存的值只会偏保守。
+最多每reclaim_frontier_interval_us微秒由一个线程重新计算一次，
+打开epoch ticker时由ticker线程每次推进epoch后重新计算。
+需要精确等待grace period的地方(fork, rebuild_filter)仍然直接用min_active_epoch()。
+*/
+enum
+{
+  reclaim_frontier_interval_us = 50
+};
+extern volatile Epoch reclaim_frontier_epoch;
+extern volatile uint64_t reclaim_frontier_micros;
+
+// 立即重新计算，返回新的边界
+Epoch refresh_reclaim_frontier();
+
+// 缓存过期时由抢到重算权的线程重新计算，其他线程直接用旧值
+Epoch reclaim_frontier();
+
+// 某一时刻limbo的总量和最老的活跃handle, 各个线程的值不是同一时刻读到的
+struct LimboReport
+{
+  int64_t objects;
+  int64_t bytes;
+  Epoch global_epoch;
+  Epoch oldest_epoch;    // 没有活跃handle时为0
+  int32_t oldest_thread; // 持有最老handle的线程下标，是可迁移的handle时为-1
+
+  Epoch epoch_age() const
+  {
+    return oldest_epoch ? global_epoch - oldest_epoch : 0;
+  }
+
+  void print(FILE *f = 0) const;
+};
+
+LimboReport limbo_report();
+
 inline Epoch min_active_epoch()
 {
   Epoch ae = 1UL << 63;
   assert(g_all_threads);
-  for (size_t i = 0; i < g_all_threads->size(); i++)
+  size_t n = thread_scan_limit();
+  for (size_t i = 0; i < n; i++)
   {
     ThreadInfo &ti = (*g_all_threads)[i];
     Epoch ti_min_epoch = atomic_load_relaxed(&(ti.min_epoch_));
@@ -265,10 +702,16 @@ inline Epoch min_active_epoch()
       ae = ti_min_epoch;
     }
   }
-  return ae;
+  Epoch be = min_bucket_epoch();
+  return be < ae ? be : ae;
 }
 
   inline LimboHandle::~LimboHandle()
+  {
+    flush();
+  }
+
+  inline void LimboHandle::flush()
   {
     if (ptrbuf_size_ != 0)
     {
@@ -277,6 +720,31 @@ inline Epoch min_active_epoch()
     }
   }
 
+  inline void *LimboHandle::protect_ptr(void *const volatile *src)
+  {
+    void *p = atomic_loadptr(const_cast<void *volatile *>(src));
+    if (hi_era_ == unbounded_era)
+      return p;
+    while (true)
+    {
+      Epoch epoch = atomic_load_relaxed(&global_epoch);
+      if (epoch == hi_era_)
+        return p;
+      hi_era_ = epoch;
+      ti_->raise_hi_era(epoch);
+      p = atomic_loadptr(const_cast<void *volatile *>(src));
+    }
+  }
+
+  inline bool LimboHandle::should_repin() const
+  {
+    uint64_t age = atomic_load_relaxed(&repin_epoch_age);
+    if (!age)
+      return false;
+    Epoch now = atomic_load_relaxed(&global_epoch);
+    return now - my_epoch_ >= age || (limbo_pressure && my_epoch_ < now);
+  }
+
   inline void *LimboHandle::alloc(size_t size, MemTag tag)
   {
     return ti_->alloc(size, tag);
@@ -6,6 +6,16 @@
 #include "masstree/mt_remove.hh"
 #include "masstree/mt_print.hh"
 #include "masstree/mt_scan.hh"
+#include "masstree/mt_aggregate.hh"
+#include "masstree/mt_frozen.hh"
+#include "masstree/mt_fork.hh"
+#include "masstree/mt_combine.hh"
+#include "masstree/mt_filter.hh"
+#include "masstree/mt_stats.hh"
+#include "masstree/mt_hotindex.hh"
+#include "masstree/mt_async.hh"
+#include "masstree/mt_tombstone.hh"
+#include "masstree/mt_sharded.hh"
 
 namespace lf
 {
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+    Masstree乐观并发路径上的计数器，编译时用-DLF_MT_COUNTERS=1打开，
+    关闭时LF_MT_COUNT什么都不做。
+    计数器放在每个线程的ThreadInfo里(不论是否打开，ThreadInfo的布局都一样)，
+    find_unlocked/find_locked/scan入口把当前线程的计数器记到线程局部变量中，
+    NodeVersion等拿不到ThreadInfo的地方通过它计数。
+*/
+#ifndef LF_MT_COUNTERS
+#define LF_MT_COUNTERS 0
+#endif
+
+namespace lf
+{
+
+#define LF_MT_COUNTER_FIELDS(X)                                             \
+    X(find_unlocked_retry)   /* find_unlocked: Leaf已删除，从layer根重来 */ \
+    X(find_unlocked_forward) /* find_unlocked: 版本校验失败，沿next前进 */  \
+    X(find_locked_retry)     /* find_locked: 从layer根重来 */               \
+    X(find_locked_forward)   /* find_locked: 加锁后校验失败，沿next前进 */  \
+    X(reach_leaf_retry)      /* reach_leaf: InterNode分裂，从根重来 */      \
+    X(internode_retry)       /* reach_leaf: InterNode变化，重读这个节点 */  \
+    X(lock_spins)            /* NodeVersion::lock自旋次数 */                \
+    X(stable_spins)          /* NodeVersion::stable等待脏位的自旋次数 */    \
+    X(advance_hops)          /* advance_to_key沿next走过的Leaf数 */         \
+    X(leaf_splits)                                                          \
+    X(internode_splits)                                                     \
+    X(new_layers)                                                           \
+    X(gc_layer_attempts)                                                    \
+    X(gc_layer_removed)                                                     \
+    X(hot_index_hits)                                                       \
+    X(hot_index_misses)                                                     \
+    X(scan_retry)            /* scan/aggregate: Leaf已删除，从layer根重来 */ \
+    X(scan_changed)          /* scan/aggregate: 版本校验失败，重新定位 */   \
+    X(scan_skipped)          /* scan: 跳过重复交出的key或墓碑 */
+
+struct MtCounters
+{
+#define LF_MT_COUNTER_DECLARE(name) uint64_t name;
+    LF_MT_COUNTER_FIELDS(LF_MT_COUNTER_DECLARE)
+#undef LF_MT_COUNTER_DECLARE
+
+    MtCounters()
+    {
+        memset(this, 0, sizeof(*this));
+    }
+
+    MtCounters &operator+=(const MtCounters &x)
+    {
+#define LF_MT_COUNTER_ADD(name) name += x.name;
+        LF_MT_COUNTER_FIELDS(LF_MT_COUNTER_ADD)
+#undef LF_MT_COUNTER_ADD
+        return *this;
+    }
+
+    // 两次快照的差
+    MtCounters operator-(const MtCounters &x) const
+    {
+        MtCounters d;
+#define LF_MT_COUNTER_SUB(name) d.name = name - x.name;
+        LF_MT_COUNTER_FIELDS(LF_MT_COUNTER_SUB)
+#undef LF_MT_COUNTER_SUB
+        return d;
+    }
+
+    void print(FILE *f = 0) const
+    {
+        f = f ? f : stdout;
+#define LF_MT_COUNTER_PRINT(name) fprintf(f, "%s %llu\n", #name, (unsigned long long)name);
+        LF_MT_COUNTER_FIELDS(LF_MT_COUNTER_PRINT)
+#undef LF_MT_COUNTER_PRINT
+    }
+};
+
+#if LF_MT_COUNTERS
+inline MtCounters *&mt_counters_tls()
+{
+    static __thread MtCounters *counters = nullptr;
+    return counters;
+}
+
+#define LF_MT_COUNT(name)                          \
+    do                                             \
+    {                                              \
+        ::lf::MtCounters *c_ = ::lf::mt_counters_tls(); \
+        if (c_)                                    \
+            ++c_->name;                            \
+    } while (0)
+#define LF_MT_COUNTERS_BIND(ti) (::lf::mt_counters_tls() = &(ti)->mt_counters())
+#else
+#define LF_MT_COUNT(name) \
+    do                    \
+    {                     \
+    } while (0)
+#define LF_MT_COUNTERS_BIND(ti) ((void)0)
+#endif
+
+} // namespace lf
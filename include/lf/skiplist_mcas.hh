@@ -449,11 +449,12 @@ SkipListMCas<Comparator>::~SkipListMCas()
   Node *cur = head_->next(0);
   while (cur != nullptr)
   {
+    Node *next = cur->next(0);
     free_node(nullptr, cur);
-    cur = head_->next(0);
+    cur = next;
   }
   // free head_
-  free_node(head_);
+  free_node(nullptr, head_);
   head_ = nullptr;
 }
 
@@ -487,7 +488,7 @@ SkipListMCas<Comparator>::allocate_node(LimboHandle *limbo_hdl, size_t key_size,
   }
   else
   {
-    raw = (char *)ThreadInfo::direct_alloc(1, prefix + sizeof(Node) + key_size);
+    raw = (char *)ThreadInfo::alloc_block(prefix + sizeof(Node) + key_size);
   }
   if (unlikely(raw == nullptr))
   {
@@ -514,7 +515,8 @@ void SkipListMCas<Comparator>::free_node(LimboHandle *hdl, Node *n)
     }
     else
     {
-      ThreadInfo::direct_free(raw);
+      // 节点都带着ThreadInfo::alloc的块头，不能直接free
+      ThreadInfo::free_block(raw);
     }
   }
 }
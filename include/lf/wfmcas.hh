@@ -23,13 +23,65 @@ struct CasRow
         : address(addr), expected_value(ev), new_value(nv), mch(nullptr) {}
 };
 
+/*
+定长的MCAS描述符，从MCasThreadCtx的池中分配，交给mcas之后就归mcas所有。
+不能放在栈上：helper会把其中的CasRow暴露给其他线程，要等grace period之后才能复用。
+mcas先按地址排序、拒绝重复的地址，再用普通的load预检所有的expected值，
+有一个已经不同就直接返回mcas_doomed, 不放置helper也不做任何CAS。
+*/
+struct MCasDescriptor
+{
+    enum
+    {
+        max_rows = 4 // 池里的描述符按FIFO复用，做得大了冷的cache line多；更多的行用vector接口
+    };
+    uint32_t size_;
+    CasRow rows_[max_rows + 1]; // 最后留一行作为结束标记
+    // mcas内部回收时使用
+    MCasDescriptor *next;
+    Epoch retire_epoch;
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    // 满了返回false
+    bool add(intptr_t *address, intptr_t expected_value, intptr_t new_value)
+    {
+        if (size_ == max_rows)
+            return false;
+        rows_[size_++] = CasRow(address, expected_value, new_value);
+        return true;
+    }
+};
+
+enum MCasResult
+{
+    mcas_succeeded,
+    mcas_failed,           // 放置helper之后失败：值已经变了或者输给了其他操作
+    mcas_doomed,           // 预检时已经有值与expected不同，没有做任何CAS
+    mcas_duplicate_address // 同一个地址出现了多次
+};
+
 extern Status init_wfmcas(size_t work_thread_no);
 
+// 释放各个线程缓存的MCasHelper, 之后不能再有mcas/mcas_read
+extern void deinit_wfmcas();
+
 extern MCasThreadCtx *init_mcas_thread_ctx(size_t thd_id);
 
 bool mcas(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
           std::vector<CasRow> &desc);
 
+MCasDescriptor *new_mcas_descriptor(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl);
+
+// 不执行mcas时用它还回内存池
+void free_mcas_descriptor(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl, MCasDescriptor *desc);
+
+// 执行之后desc不能再用，与new_mcas_descriptor在同一个handle内
+MCasResult mcas(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl, MCasDescriptor *desc);
+
 intptr_t mcas_read(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
                    intptr_t *address);
 
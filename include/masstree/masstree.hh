@@ -2,6 +2,7 @@
 
 #include "lf/limbo.hh"
 #include "lf/slice.hh"
+#include "masstree/nodeversion.hh"
 
 namespace lf
 {
@@ -10,6 +11,12 @@ typedef char Row;
 class NodeBase;
 class LeafValue;
 class KeyUnparsePrintableString;
+class FrozenTable;
+class TableSnapshot;
+class ChangeFeed;
+class NegativeFilter;
+class HotLeafIndex;
+class Leaf;
 
 enum
 {
@@ -21,13 +28,84 @@ struct NodeParams
   typedef KeyUnparsePrintableString key_unparse_type;
 };
 
+// 区间聚合结果，只统计LeafValue::value()
+struct ScanAggregate
+{
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+
+  ScanAggregate()
+      : count(0), sum(0), min(~uint64_t(0)), max(0)
+  {
+  }
+
+  void merge(const ScanAggregate &x)
+  {
+    count += x.count;
+    sum += x.sum;
+    if (x.min < min)
+      min = x.min;
+    if (x.max > max)
+      max = x.max;
+  }
+};
+
+// 树的形状和内存占用, 字节数都是分配的大小
+struct TableStats
+{
+  enum
+  {
+    max_layer_depth = LF_MAXKEYLEN / 8 + 1,
+    fill_buckets = 16 // Leaf中key的个数 [0, 15]
+  };
+
+  bool sampled;       // 是否是抽样估计的结果
+  uint32_t samples;
+  uint64_t layers;    // layer的个数，包括最上层
+  uint64_t leaves;
+  uint64_t internodes;
+  uint64_t keys;      // 不含layer指针
+  uint32_t max_depth; // 最深的layer, 最上层是0
+  uint64_t layers_at_depth[max_layer_depth];
+  uint32_t height_at_depth[max_layer_depth]; // 这一深度上layer的最大树高
+  uint64_t fill[fill_buckets];
+  uint64_t leaf_bytes;      // 包括Leaf内部的ksuf
+  uint64_t internode_bytes;
+  uint64_t iksuf_bytes;     // Leaf内部ksuf的容量，已经算在leaf_bytes里
+  uint64_t iksuf_used;
+  uint64_t ksuf_bytes;      // 外部ksuf的容量
+  uint64_t ksuf_used;
+  uint64_t ksufs;           // 外部ksuf的块数
+
+  TableStats()
+  {
+    memset(this, 0, sizeof(*this));
+  }
+
+  uint64_t total_bytes() const
+  {
+    return leaf_bytes + internode_bytes + ksuf_bytes;
+  }
+
+  // 合并另一个表(比如另一个shard)的统计
+  TableStats &operator+=(const TableStats &x);
+
+  void print(FILE *f = 0) const;
+};
+
 class BasicTable
 {
 public:
   BasicTable();
 
   void initialize(ThreadInfo *ti);
+  // 释放树和挂在表上的过滤器、热点索引; fork出的快照要在这之前release
   void destroy(ThreadInfo *ti);
+  // 表已经静止(没有并发访问，limbo中也没有还没执行的、引用这个表的回调)时使用，
+  // 用nthreads个线程直接释放所有节点，不经过limbo; trim为真时把空闲内存还给系统
+  void destroy_parallel(int nthreads, bool trim = false);
 
   inline NodeBase *root() const;
   inline NodeBase *fix_root();
@@ -49,10 +127,223 @@ public:
             F &scanner,
             ThreadInfo *ti) const;
 
+  // 统计[firstkey, endkey)区间的count/sum/min/max, endkey为空表示不设上界
+  ScanAggregate aggregate(Slice firstkey, Slice endkey, ThreadInfo *ti) const;
+
+  // 遍历整棵树，结果不是快照；调用者需要持有LimboHandle
+  TableStats stats(ThreadInfo *ti) const;
+  // 随机从根下降samples次估计stats, 代价与samples * 树高成正比
+  TableStats sample_stats(int samples, ThreadInfo *ti, uint32_t seed = 301) const;
+
+  // 把当前内容转成只读的FrozenTable, 期间表可以继续修改，但结果只是scan的结果
+  void freeze(FrozenTable &frozen, ThreadInfo *ti) const;
+
+  // 创建一个逻辑上冻结的快照, 同一时刻只允许一个, 失败返回nullptr
+  // fork之前打开的LimboHandle(包括调用线程自己的)全部关闭之后快照才ready, 才能读;
+  // 所以调用线程要先关闭自己的handle再fork, 读快照时再打开新的handle
+  TableSnapshot *fork(ThreadInfo *ti);
+
+  TableSnapshot *snapshot() const
+  {
+    return fork_;
+  }
+
+  // 挂上/摘下变更流，摘下之后要等一个grace period才能销毁feed
+  void set_change_feed(ChangeFeed *feed)
+  {
+    cdc_ = feed;
+  }
+  ChangeFeed *change_feed() const
+  {
+    return cdc_;
+  }
+
+  // 负向查询过滤器, get在下降之前先查过滤器，不存在的key大多不用访问树
+  // rebuild_filter按当前内容重建(清掉删除留下的位), 也用于第一次挂上过滤器
+  // 这两个函数同一时刻只能有一个线程调用，并且调用线程不能持有LimboHandle
+  void rebuild_filter(size_t expected_keys, ThreadInfo *ti, int bits_per_key = 10);
+  void remove_filter(ThreadInfo *ti);
+  NegativeFilter *filter() const
+  {
+    return filter_;
+  }
+  NegativeFilter *building_filter() const
+  {
+    return building_filter_;
+  }
+
+  // 点查的hash旁路索引, nslots会向上取整为2的幂; 同一时刻只能有一个线程调用这两个函数
+  void enable_hot_index(size_t nslots, ThreadInfo *ti);
+  void disable_hot_index(ThreadInfo *ti);
+  HotLeafIndex *hot_index() const
+  {
+    return hot_;
+  }
+  // 表中的Leaf从树上摘下之后用它交给limbo, 启用了HotLeafIndex时增加leaf_gen_
+  inline void retire_leaf(Leaf *leaf, ThreadInfo *ti);
+
+  // 懒删除：打开后finish(-1)只给key打墓碑，读者把墓碑当作不存在，
+  // 物理删除由reclaim_tombstones在后台批量完成; 关闭之前留下的墓碑仍然要回收
+  void set_lazy_delete(bool on)
+  {
+    lazy_delete_ = on;
+  }
+  bool lazy_delete() const
+  {
+    return lazy_delete_;
+  }
+  // 物理删除墓碑，每批最多batch个key, 每批单独持有LimboHandle; 返回删除的个数
+  // 调用线程不能持有LimboHandle; 没有墓碑时直接返回，不扫描
+  size_t reclaim_tombstones(ThreadInfo *ti, size_t batch = 256);
+  // 还没有物理删除的墓碑个数
+  uint64_t tombstones() const
+  {
+    return tombstones_;
+  }
+
   template <typename P>
   void print(FILE *f = 0) const;
 
 private:
   NodeBase *root_;
+  TableSnapshot *volatile fork_;
+  ChangeFeed *volatile cdc_;
+  NegativeFilter *volatile filter_;
+  NegativeFilter *volatile building_filter_; // 重建中，只写不读
+  HotLeafIndex *volatile hot_;
+  volatile uint64_t leaf_gen_; // 见HotLeafIndex
+  volatile uint64_t tombstones_; // TCursor::finish在Leaf锁内打上/清掉墓碑时增减
+  bool lazy_delete_;
+
+  friend class TableSnapshot;
+  friend class TCursor;
+};
+
+/*
+    TableSnapshot: BasicTable::fork()返回的快照，与活动的表共享所有节点。
+    fork之后，每个key第一次被修改前，由写者在持有Leaf锁时把修改前的状态
+    记录到before_(fork时存在的key和旧值)或born_(fork时不存在的key)。
+    读快照时先读活动的表，再用这两张表覆盖，额外内存只与fork之后的写入量有关。
+    release之后，这两张表和快照本身在一个grace period之后回收。
+*/
+class TableSnapshot : public MrcuCallback
+{
+public:
+  // fork之前打开的LimboHandle全部关闭之后，快照才可以读
+  bool ready() const;
+
+  // get/scan要求ready(), 不会等待: 等待可能永远等不到，比如调用线程自己还持有fork之前的handle
+  bool get(Slice key, LeafValue &value, ThreadInfo *ti) const;
+
+  // 语义与BasicTable::scan相同, visit_value的key为Slice
+  template <typename F>
+  int scan(Slice firstkey, bool emit_firstkey,
+           F &scanner, ThreadInfo *ti) const;
+
+  void release(ThreadInfo *ti);
+
+  // 由写者在持有key所在Leaf的锁、修改对读者可见之前调用, value为nullptr表示key不存在
+  void capture(Slice key, const LeafValue *value, ThreadInfo *ti);
+
+private:
+  BasicTable *table_;
+  Epoch fork_epoch_;
+  BasicTable before_;
+  BasicTable born_;
+  volatile uint64_t captures_; // capture每写入一个key加一, 见SnapshotScanner
+
+  explicit TableSnapshot(BasicTable *table)
+      : table_(table), fork_epoch_(0), captures_(0)
+  {
+  }
+
+  void operator()(ThreadInfo *ti);
+
+  friend class BasicTable;
+  template <typename F>
+  friend struct SnapshotScanner;
+};
+
+/*
+    NegativeFilter: 分块的Bloom filter, 每个key的k个位都落在同一个64字节的块里，
+    查询只访问一个cache line。只会有假阳性，不会有假阴性。
+    位只增不减，删除留下的位由BasicTable::rebuild_filter清理。
+*/
+class NegativeFilter
+{
+public:
+  enum
+  {
+    block_bits = 512
+  };
+
+  static NegativeFilter *make(size_t expected_keys, int bits_per_key, ThreadInfo *ti);
+
+  void add(Slice key);
+  bool may_contain(Slice key) const;
+
+  size_t nblocks() const
+  {
+    return nblocks_;
+  }
+
+private:
+  uint64_t nblocks_;
+  int k_;
+  uint64_t volatile *bits_; // 64字节对齐
+
+  NegativeFilter() {}
+};
+
+/*
+    HotLeafIndex: 点查的hash旁路索引，直接映射，key的hash -> (Leaf*, slot, version)。
+    get先查这里，命中时只校验一个Leaf, 不从根下降；校验不过就回到find_unlocked,
+    下降成功后顺便更新对应的槽。只是缓存：槽可以随时被覆盖或者失效，不影响正确性。
+    hot_不为空时表的retire_leaf增加leaf_gen_, 记录时的代数对不上的槽不再解引用。
+    retire_leaf先摘下Leaf再读hot_, get先读hot_再下降，读到空的hot_而没有增加代数的回收者
+    摘下的Leaf不会被之后启用的索引记录下来; 旧索引的读者打开handle在先，这样的Leaf还不会释放。
+    下层layer中的Leaf只比较得了shift之后的部分，所以槽里保存key的前shift个字节，
+    命中时整个key都比较过，不依赖hash; 只记录shift不超过max_prefix的key。
+*/
+class HotLeafIndex
+{
+public:
+  static HotLeafIndex *make(size_t nslots, ThreadInfo *ti);
+
+  // 命中返回true并设置value; 返回false时需要走树
+  // gen是打开handle之后读到的表的leaf_gen_
+  bool lookup(Slice key, uint32_t h, uint64_t gen, LeafValue &value) const;
+  // gen是下降之前读到的表的leaf_gen_
+  void record(Slice key, uint32_t h, Leaf *n, int slot, NodeVersion v, int shift, uint64_t gen);
+
+  static uint32_t hash_key(Slice key);
+
+  size_t nslots() const
+  {
+    return mask_ + 1;
+  }
+
+  enum
+  {
+    max_prefix = 24 // 槽里最多保存的key前缀，对应前三层layer
+  };
+
+private:
+  struct Slot
+  {
+    volatile int32_t seq_; // 奇数表示正在写
+    uint32_t hash_;
+    Leaf *leaf_;
+    NodeVersion version_;
+    uint64_t gen_;
+    uint16_t shift_; // key在第几个layer中找到的，单位是字节
+    uint8_t p_;
+    char prefix_[max_prefix]; // key的前shift_个字节
+  };
+
+  uint64_t mask_;
+  Slot *slots_;
+
+  HotLeafIndex() {}
 };
 } // namespace lf
@@ -0,0 +1,266 @@
+#pragma once
+
+#include "masstree/mt_struct.hh"
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define LF_AGGREGATE_AVX2 1
+#else
+#define LF_AGGREGATE_AVX2 0
+#endif
+
+namespace lf
+{
+
+/*
+    对连续的value做count/sum/min/max归约。
+    调用者保证v[0, n)已经是校验过版本的快照。
+    AVX2版本用target属性单独编译，不需要-mavx2; aggregate_values在运行时按CPU选择。
+*/
+inline void aggregate_values_scalar(const uint64_t *v, int n, ScanAggregate &agg)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        uint64_t x = v[i];
+        agg.sum += x;
+        if (x < agg.min)
+            agg.min = x;
+        if (x > agg.max)
+            agg.max = x;
+    }
+    agg.count += n;
+}
+
+#if LF_AGGREGATE_AVX2
+__attribute__((target("avx2"))) inline void aggregate_values_avx2(const uint64_t *v, int n, ScanAggregate &agg)
+{
+    int i = 0;
+    if (n >= 4)
+    {
+        // AVX2没有无符号64位比较，异或符号位后用有符号比较
+        const __m256i bias = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+        __m256i vsum = _mm256_setzero_si256();
+        __m256i vmin = _mm256_set1_epi64x((long long)0x7FFFFFFFFFFFFFFFULL);
+        __m256i vmax = bias;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(v + i));
+            vsum = _mm256_add_epi64(vsum, x);
+            x = _mm256_xor_si256(x, bias);
+            vmin = _mm256_blendv_epi8(vmin, x, _mm256_cmpgt_epi64(vmin, x));
+            vmax = _mm256_blendv_epi8(vmax, x, _mm256_cmpgt_epi64(x, vmax));
+        }
+        uint64_t s[4], mn[4], mx[4];
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(s), vsum);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(mn), _mm256_xor_si256(vmin, bias));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(mx), _mm256_xor_si256(vmax, bias));
+        for (int j = 0; j < 4; ++j)
+        {
+            agg.sum += s[j];
+            if (mn[j] < agg.min)
+                agg.min = mn[j];
+            if (mx[j] > agg.max)
+                agg.max = mx[j];
+        }
+        agg.count += i;
+    }
+    aggregate_values_scalar(v + i, n - i, agg);
+}
+
+inline bool aggregate_has_avx2()
+{
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+}
+#endif
+
+inline void aggregate_values(const uint64_t *v, int n, ScanAggregate &agg)
+{
+#if LF_AGGREGATE_AVX2
+    if (n >= 4 && aggregate_has_avx2())
+    {
+        aggregate_values_avx2(v, n, agg);
+        return;
+    }
+#endif
+    aggregate_values_scalar(v, n, agg);
+}
+
+/*
+    区间聚合：逐个Leaf做归约，每个Leaf只做一次版本校验。
+    与scan一样，结果不是一个快照，只保证每个key最多被统计一次。
+*/
+class RangeAggregator
+{
+  public:
+    explicit RangeAggregator(ScanAggregate &agg)
+        : agg_(agg)
+    {
+    }
+
+    // lo/hi 为当前layer内的边界，nullptr表示无界
+    void aggregate_layer(NodeBase *root, const MtKey *lo, const MtKey *hi);
+
+  private:
+    ScanAggregate &agg_;
+
+    static bool above_lower(const Leaf *n, int p, int keylenx, const MtKey &lo)
+    {
+        int cmp = lo.compare(n->ikey0_[p], keylenx);
+        if (cmp == 0 && n->keylenx_has_ksuf(keylenx))
+            cmp = lo.suffix().compare(n->ksuf(p, keylenx));
+        return cmp <= 0;
+    }
+
+    static bool below_upper(const Leaf *n, int p, int keylenx, const MtKey &hi)
+    {
+        int cmp = hi.compare(n->ikey0_[p], keylenx);
+        if (cmp == 0 && n->keylenx_has_ksuf(keylenx))
+            cmp = hi.suffix().compare(n->ksuf(p, keylenx));
+        return cmp > 0;
+    }
+
+    // 整个Leaf都在区间内，并且没有layer和墓碑, 可以跳过逐个key的比较
+    static bool leaf_covered(const Leaf *n, Leaf::permuter_type perm,
+                             const MtKey *lo, const MtKey *hi)
+    {
+        int sz = perm.size();
+        for (int i = 0; i < sz; ++i)
+        {
+            if (n->keylenx_is_layer(n->keylenx_[perm[i]]))
+                return false;
+        }
+        int first = perm[0], last = perm[sz - 1];
+        return (!lo || above_lower(n, first, n->keylenx_[first], *lo)) &&
+               (!hi || below_upper(n, last, n->keylenx_[last], *hi));
+    }
+};
+
+void RangeAggregator::aggregate_layer(NodeBase *root, const MtKey *lo, const MtKey *hi)
+{
+    uint64_t vals[Leaf::width];
+    NodeBase *layers[Leaf::width];
+    uint64_t layer_ikeys[Leaf::width];
+    MtKey cursor = lo ? *lo : MtKey(uint64_t(0), 0);
+    NodeVersion v;
+
+    Leaf *n = root->reach_leaf(cursor, v);
+    while (true)
+    {
+        int nv, nl;
+        uint16_t tomb;
+        bool stop;
+        Leaf *next;
+        Leaf::permuter_type perm;
+
+    retry_node:
+        if (v.deleted())
+        {
+            LF_MT_COUNT(scan_retry);
+            n = root->reach_leaf(cursor, v);
+            goto retry_node;
+        }
+        perm = n->permutation();
+        next = n->safe_next();
+        tomb = n->tomb_;
+        nv = nl = 0;
+        stop = false;
+
+        if (perm.size() == Leaf::width && !tomb && leaf_covered(n, perm, lo, hi))
+        {
+            // 满节点且全部命中：15个槽位全部有效，归约与顺序无关，直接读lv_
+            memcpy(vals, n->lv_, sizeof(vals));
+            nv = Leaf::width;
+        }
+        else
+        {
+            for (int i = 0; i < perm.size(); ++i)
+            {
+                int p = perm[i];
+                int keylenx = n->keylenx_[p];
+                LeafValue lv = n->lv_[p];
+                if (n->keylenx_is_layer(keylenx))
+                {
+                    layers[nl] = lv.layer();
+                    layer_ikeys[nl] = n->ikey0_[p];
+                    ++nl;
+                }
+                else if (lo && !above_lower(n, p, keylenx, *lo))
+                {
+                    continue;
+                }
+                else if (hi && !below_upper(n, p, keylenx, *hi))
+                {
+                    stop = true;
+                    break;
+                }
+                else if (tomb & (1U << p))
+                {
+                    continue;
+                }
+                else
+                {
+                    vals[nv++] = lv.value();
+                }
+            }
+        }
+
+        if (n->has_changed(v))
+        {
+            LF_MT_COUNT(scan_changed);
+            n = n->advance_to_key(cursor, v);
+            goto retry_node;
+        }
+
+        aggregate_values(vals, nv, agg_);
+
+        for (int i = 0; i < nl; ++i)
+        {
+            uint64_t ikey = layer_ikeys[i];
+            MtKey sublo, subhi;
+            const MtKey *plo = nullptr, *phi = nullptr;
+            if (lo && lo->ikey() > ikey)
+                continue;
+            if (hi && hi->ikey() < ikey)
+                continue;
+            if (lo && lo->ikey() == ikey && lo->has_suffix())
+            {
+                sublo = *lo;
+                sublo.shift();
+                plo = &sublo;
+            }
+            if (hi && hi->ikey() == ikey)
+            {
+                if (!hi->has_suffix())
+                    continue;
+                subhi = *hi;
+                subhi.shift();
+                phi = &subhi;
+            }
+            aggregate_layer(layers[i], plo, phi);
+        }
+
+        if (stop || !next)
+            break;
+        if (hi && hi->compare(next->ikey_bound(), 0) <= 0)
+            break;
+
+        // 同一ikey的key不会分散在两个Leaf里, (ikey_bound, 0)不大于next中的任何key
+        cursor = MtKey(next->ikey_bound(), 0);
+        lo = &cursor;
+        n = next;
+        v = n->stable();
+    }
+}
+
+ScanAggregate BasicTable::aggregate(Slice firstkey, Slice endkey, ThreadInfo *ti) const
+{
+    LF_MT_COUNTERS_BIND(ti);
+    ScanAggregate agg;
+    MtKey lo(firstkey);
+    MtKey hi(endkey);
+    RangeAggregator ra(agg);
+    ra.aggregate_layer(root_, &lo, endkey.empty() ? nullptr : &hi);
+    return agg;
+}
+
+} // namespace lf
@@ -0,0 +1,404 @@
+#pragma once
+
+#include "masstree/mt_insert.hh"
+#include "masstree/mt_scan.hh"
+
+namespace lf
+{
+
+// 一个节点占几个cache line, 取Leaf和InterNode中大的那个
+inline void prefetch_node(const NodeBase *n)
+{
+    const char *p = reinterpret_cast<const char *>(n);
+    const size_t sz = sizeof(Leaf) > sizeof(InterNode) ? sizeof(Leaf) : sizeof(InterNode);
+    for (size_t off = 0; off < sz; off += 64)
+        __builtin_prefetch(p + off);
+}
+
+/*
+    AsyncDescent: 可以分步执行的reach_leaf。
+    每一步最多访问一个还没有访问过的节点：先prefetch下一个节点，然后返回，
+    等调度器轮一圈回来时它已经在cache里了。版本校验与reach_leaf相同。
+*/
+class AsyncDescent
+{
+  public:
+    void start(const NodeBase *root)
+    {
+        root_ = root;
+        state_ = st_root;
+        prefetch_node(root);
+    }
+
+    // 到达Leaf时返回true, 之后leaf()/version()有效
+    bool step(const MtKey &ka)
+    {
+        if (state_ == st_root)
+        {
+            n_ = root_;
+            while (1)
+            {
+                v_ = n_->stable();
+                if (v_.is_root())
+                    break;
+                n_ = n_->maybe_parent();
+            }
+            if (v_.isleaf())
+                return true;
+            pick_child(ka);
+            return false;
+        }
+
+        const InterNode *in = static_cast<const InterNode *>(n_);
+        NodeVersion cv = child_->stable();
+        if (likely(!in->has_changed(v_)))
+        {
+            n_ = child_;
+            v_ = cv;
+            if (v_.isleaf())
+                return true;
+            pick_child(ka);
+            return false;
+        }
+
+        NodeVersion oldv = v_;
+        v_ = in->stable();
+        if (oldv.has_split(v_) && in->stable_last_key_compare(ka, v_) > 0)
+        {
+            LF_MT_COUNT(reach_leaf_retry);
+            state_ = st_root;
+            return false;
+        }
+        LF_MT_COUNT(internode_retry);
+        pick_child(ka);
+        return false;
+    }
+
+    Leaf *leaf() const
+    {
+        return const_cast<Leaf *>(static_cast<const Leaf *>(n_));
+    }
+
+    NodeVersion version() const
+    {
+        return v_;
+    }
+
+  private:
+    enum
+    {
+        st_root,
+        st_child
+    };
+
+    const NodeBase *root_;
+    const NodeBase *n_;
+    const NodeBase *child_;
+    NodeVersion v_;
+    int state_;
+
+    void pick_child(const MtKey &ka)
+    {
+        const InterNode *in = static_cast<const InterNode *>(n_);
+        int kp = InterNode::bound_type::upper(ka, *in);
+        child_ = in->child_[kp];
+        if (!child_)
+        {
+            LF_MT_COUNT(reach_leaf_retry);
+            state_ = st_root;
+            return;
+        }
+        prefetch_node(child_);
+        state_ = st_child;
+    }
+};
+
+/*
+    MtExecutor: 在一个工作线程内交错执行多个互不相关的get/put/短scan。
+    每个在途操作每轮只前进一个节点，访问之前先prefetch, 所以一个操作的cache miss
+    被其他操作的计算掩盖。操作按轮转调度，提交时在途操作已满就先推进到有空位。
+    1. get完全按find_unlocked的步骤分步执行。
+    2. put和scan先分步下降到目标Leaf(跟随layer), 把路径带进cache,
+       然后用TCursor::find_insert/BasicTable::scan在同一轮内同步完成。
+    key的内存要在done回调之前保持有效。不是线程安全的，每个工作线程一个。
+    有在途操作时持有一个LimboHandle, 全部完成后释放。操作源源不断时在途操作可能一直不为0,
+    所以handle接收了max_handle_ops个操作或者落后global_epoch超过max_handle_epochs之后
+    不再接收新的操作，先把在途的执行完、关闭handle, 再打开新的，一个执行器挡住的limbo是有限的。
+*/
+class MtExecutor
+{
+  public:
+    enum
+    {
+        max_inflight = 32,
+        max_handle_ops = 1024,
+        max_handle_epochs = 4
+    };
+
+    // get: found和value; put: 之前是否存在和旧值; scan: 是否访问了key和访问的个数
+    typedef void (*done_fn)(void *arg, bool found, uint64_t value);
+    // 返回false停止scan
+    typedef bool (*visit_fn)(void *arg, Slice key, uint64_t value);
+
+    MtExecutor(BasicTable &table, ThreadInfo *ti, int inflight = 8);
+    ~MtExecutor();
+
+    void get(Slice key, done_fn done, void *arg);
+    void put(Slice key, uint64_t value, done_fn done, void *arg);
+    // 从firstkey(包括)开始最多访问limit个key
+    void scan(Slice firstkey, int limit, visit_fn visit, done_fn done, void *arg);
+
+    // 每个在途操作推进一步，返回还在途的个数
+    size_t poll();
+    void drain();
+
+    size_t inflight() const
+    {
+        return nactive_;
+    }
+
+  private:
+    enum OpKind
+    {
+        op_none,
+        op_get,
+        op_put,
+        op_scan
+    };
+
+    struct Op
+    {
+        OpKind kind_;
+        Slice key_;
+        MtKey ka_;
+        const NodeBase *root_;
+        AsyncDescent d_;
+        uint64_t value_;
+        bool found_;
+        int limit_;
+        visit_fn visit_;
+        done_fn done_;
+        void *arg_;
+    };
+
+    struct ScanAdaptor
+    {
+        visit_fn visit_;
+        void *arg_;
+        int limit_;
+        int n_;
+
+        void visit_leaf(const ScanStackElt &, const MtKey &, ThreadInfo *)
+        {
+        }
+
+        bool visit_value(Slice key, LeafValue &val, ThreadInfo *)
+        {
+            ++n_;
+            return visit_(arg_, key, val.value()) && n_ < limit_;
+        }
+    };
+
+    BasicTable &table_;
+    ThreadInfo *ti_;
+    LimboHandle *handle_;
+    size_t handle_ops_; // handle_打开之后接收的操作数
+    size_t width_;
+    size_t nactive_;
+    size_t next_;
+    Op ops_[max_inflight];
+
+    MtExecutor(const MtExecutor &);
+    MtExecutor &operator=(const MtExecutor &);
+
+    Op &submit(OpKind kind, Slice key, done_fn done, void *arg);
+    // 执行一步，完成时返回true
+    bool step(Op &op);
+    bool step_leaf(Op &op);
+    void complete(Op &op);
+};
+
+MtExecutor::MtExecutor(BasicTable &table, ThreadInfo *ti, int inflight)
+    : table_(table), ti_(ti), handle_(nullptr), handle_ops_(0),
+      width_(std::max(1, std::min(inflight, int(max_inflight)))),
+      nactive_(0), next_(0)
+{
+    for (size_t i = 0; i < max_inflight; ++i)
+        ops_[i].kind_ = op_none;
+}
+
+MtExecutor::~MtExecutor()
+{
+    drain();
+}
+
+MtExecutor::Op &MtExecutor::submit(OpKind kind, Slice key, done_fn done, void *arg)
+{
+    while (nactive_ >= width_)
+        poll();
+    if (handle_ && (handle_ops_ >= max_handle_ops ||
+                    atomic_load_relaxed(&global_epoch) - handle_->epoch() > max_handle_epochs))
+        drain();
+    if (!handle_)
+    {
+        handle_ = ti_->new_handle();
+        handle_ops_ = 0;
+    }
+    ++handle_ops_;
+
+    size_t i = 0;
+    while (ops_[i].kind_ != op_none)
+        ++i;
+    Op &op = ops_[i];
+    op.kind_ = kind;
+    op.key_ = key;
+    op.ka_ = MtKey(key);
+    op.root_ = table_.root();
+    op.done_ = done;
+    op.arg_ = arg;
+    op.d_.start(op.root_);
+    ++nactive_;
+    return op;
+}
+
+void MtExecutor::get(Slice key, done_fn done, void *arg)
+{
+    NegativeFilter *filter = table_.filter();
+    if (filter && !filter->may_contain(key))
+    {
+        done(arg, false, 0);
+        return;
+    }
+    submit(op_get, key, done, arg);
+}
+
+void MtExecutor::put(Slice key, uint64_t value, done_fn done, void *arg)
+{
+    Op &op = submit(op_put, key, done, arg);
+    op.value_ = value;
+}
+
+void MtExecutor::scan(Slice firstkey, int limit, visit_fn visit, done_fn done, void *arg)
+{
+    Op &op = submit(op_scan, firstkey, done, arg);
+    op.limit_ = limit;
+    op.visit_ = visit;
+}
+
+size_t MtExecutor::poll()
+{
+    for (size_t k = 0; k < width_ && nactive_; ++k)
+    {
+        Op &op = ops_[next_];
+        next_ = next_ + 1 < width_ ? next_ + 1 : 0;
+        if (op.kind_ != op_none && step(op))
+            complete(op);
+    }
+    if (!nactive_ && handle_)
+    {
+        ti_->delete_handle(handle_);
+        handle_ = nullptr;
+    }
+    return nactive_;
+}
+
+void MtExecutor::drain()
+{
+    while (poll())
+        ;
+}
+
+bool MtExecutor::step(Op &op)
+{
+    if (!op.d_.step(op.ka_))
+        return false;
+    return step_leaf(op);
+}
+
+// 与find_unlocked在Leaf上的部分相同；遇到layer时换一个根继续分步下降
+bool MtExecutor::step_leaf(Op &op)
+{
+    Leaf *n = op.d_.leaf();
+    NodeVersion v = op.d_.version();
+    KeyIndexedPosition kx;
+    LeafValue lv;
+    int match;
+
+forward:
+    if (v.deleted())
+    {
+        op.d_.start(op.root_);
+        return false;
+    }
+    kx = Leaf::bound_type::lower(op.ka_, *n);
+    if (kx.p >= 0)
+    {
+        bool tomb = n->is_tombstone(kx.p);
+        compiler_barrier();
+        lv = n->lv_[kx.p];
+        match = n->ksuf_matches(kx.p, op.ka_);
+        if (match > 0 && tomb)
+            match = 0;
+    }
+    else
+    {
+        match = 0;
+    }
+    if (n->has_changed(v))
+    {
+        n = n->advance_to_key(op.ka_, v);
+        goto forward;
+    }
+
+    if (match < 0)
+    {
+        op.ka_.shift_by(-match);
+        op.root_ = lv.layer();
+        op.d_.start(op.root_);
+        return false;
+    }
+    if (op.kind_ == op_get)
+    {
+        op.found_ = match != 0;
+        op.value_ = match ? lv.value() : 0;
+    }
+    return true;
+}
+
+void MtExecutor::complete(Op &op)
+{
+    bool found = false;
+    uint64_t value = 0;
+    switch (op.kind_)
+    {
+    case op_get:
+        found = op.found_;
+        value = op.value_;
+        break;
+    case op_put:
+    {
+        TCursor lp(table_, op.key_);
+        found = lp.find_insert(ti_);
+        value = found ? lp.value().value() : 0;
+        lp.value() = op.value_;
+        lp.finish(1, ti_);
+        break;
+    }
+    case op_scan:
+    {
+        ScanAdaptor sa = {op.visit_, op.arg_, op.limit_, 0};
+        if (op.limit_ > 0)
+            table_.scan(op.key_, true, sa, ti_);
+        found = sa.n_ > 0;
+        value = uint64_t(sa.n_);
+        break;
+    }
+    default:
+        break;
+    }
+    op.kind_ = op_none;
+    --nactive_;
+    op.done_(op.arg_, found, value);
+}
+
+} // namespace lf
@@ -0,0 +1,276 @@
+#pragma once
+
+#include "lf/compiler.hh"
+#include "lf/limbo.hh"
+#include "lf/slice.hh"
+#include <string.h>
+
+namespace lf
+{
+
+enum ChangeOp : uint8_t
+{
+    ChangeOpPut = 1,
+    ChangeOpRemove = 2,
+    ChangeOpPad = 3 // 环尾部放不下一条记录时的填充
+};
+
+struct ChangeRecord
+{
+    uint64_t lsn;
+    Epoch epoch; // 按lsn不减，见ChangeFeed::poll
+    uint64_t value; // ChangeOpRemove时为0
+    ChangeOp op;
+    Slice key; // 只在visitor调用期间有效
+};
+
+/*
+    ChangeFeed: BasicTable的变更流(CDC)。
+    1. 每个工作线程一个单生产者/单消费者的字节环，记录变长，8字节对齐。
+    2. 反压在加锁之前：TCursor::find_locked锁Leaf之前先调用reserve，环满时
+       在这里自旋等待读者。只有本线程会推进自己环的head_，所以reserve之后
+       环里的空间只会变多，Leaf锁内的append不会再等待。
+       注意：不能在持有Leaf锁时等待环，否则读者线程如果也要写同一个Leaf
+       (比如先写再poll)，写者等读者、读者等锁，就会死锁。
+       代别的线程写入的(FlatCombiner)也不能等自己的环，记录写进发布者事先reserve过的环，
+       见TCursor::set_feed_owner。
+    3. 写者在TCursor::finish中、Leaf解锁之前追加记录：取全局连续的lsn，写入并发布。
+       空间已经预留好，取到的lsn一定会很快发布，读者不会长时间等待空洞。
+    4. 读者(只能有一个)按lsn归并所有的环，遇到还没有发布的lsn就停下。
+       同一个key的记录在Leaf锁内取lsn，所以lsn顺序就是提交顺序。
+       写者取lsn之后才读global_epoch，两个写者竞争时lsn大的可能读到较小的epoch，
+       读者交出记录时把epoch抬到已经交出的最大值，保证按lsn顺序epoch不减。
+    环的个数取nthreads和g_all_threads->size()中较大的一个，ThreadInfo::index()
+    不能超过它；每个环的数据区在对应线程第一次写入时才分配，
+    所以内存上限为写过的线程数 * ring_bytes。
+*/
+class ChangeFeed
+{
+  public:
+    enum
+    {
+        min_ring_bytes = 4096
+    };
+
+    // ring_bytes会向上取整为2的幂; nthreads是环个数的下限
+    ChangeFeed(size_t nthreads, size_t ring_bytes = 1 << 20);
+    ~ChangeFeed();
+
+    // 等到ti的环里放得下一条keylen长的记录, 不能在持有Leaf锁时调用
+    void reserve(ThreadInfo *ti, size_t keylen);
+
+    // 调用前应该先reserve, 否则环满时会在Leaf锁内等待
+    void append(ThreadInfo *ti, ChangeOp op, Slice key, uint64_t value);
+
+    // 按lsn顺序把已经发布的记录交给visitor(const ChangeRecord &), 返回处理的条数
+    template <typename F>
+    size_t poll(F &visitor, size_t max_records = ~size_t(0));
+
+    // 下一条要读的lsn
+    uint64_t read_lsn() const
+    {
+        return read_lsn_;
+    }
+
+    // 写者因为环满而等待的次数
+    uint64_t stalls() const
+    {
+        return stalls_;
+    }
+
+  private:
+    // op放在最前面，环尾部只剩8字节时也能写下填充标记
+    struct RecordHeader
+    {
+        uint8_t op;
+        uint8_t pad_;
+        uint16_t keylen;
+        uint32_t pad2_;
+        uint64_t lsn;
+        Epoch epoch;
+        uint64_t value;
+    };
+
+    struct Ring
+    {
+        volatile uint64_t head_; // 生产者写入位置
+        uint64_t cached_tail_;   // 生产者缓存的tail_
+        char pad0_[48];
+        volatile uint64_t tail_; // 消费者读取位置
+        char pad1_[56];
+        char *data_;
+        char pad2_[56];
+    };
+
+    Ring *rings_;
+    size_t nrings_;
+    uint64_t mask_;
+    volatile uint64_t next_lsn_;
+    uint64_t read_lsn_;
+    Epoch last_epoch_; // 已经交出的最大epoch
+    volatile uint64_t stalls_;
+
+    ChangeFeed(const ChangeFeed &);
+    ChangeFeed &operator=(const ChangeFeed &);
+
+    static size_t record_size(size_t keylen)
+    {
+        return (sizeof(RecordHeader) + keylen + 7) & ~size_t(7);
+    }
+
+    // 跳过填充记录，返回ring中下一条未读记录, 没有则返回nullptr
+    const RecordHeader *peek(Ring &r);
+
+    // ti对应的环, 第一次使用时分配数据区
+    Ring &ring(ThreadInfo *ti);
+
+    // 在r当前位置写一条sz字节的记录需要的空间(包括尾部填充)
+    size_t need_bytes(const Ring &r, size_t sz) const
+    {
+        uint64_t off = r.head_ & mask_;
+        return (off + sz > mask_ + 1) ? (mask_ + 1 - off) + sz : sz;
+    }
+
+    // 等到r里有need字节空闲
+    void wait_room(Ring &r, size_t need);
+};
+
+ChangeFeed::ChangeFeed(size_t nthreads, size_t ring_bytes)
+    : nrings_(nthreads), next_lsn_(0), read_lsn_(0), last_epoch_(0), stalls_(0)
+{
+    if (g_all_threads && g_all_threads->size() > nrings_)
+        nrings_ = g_all_threads->size();
+    size_t sz = min_ring_bytes;
+    while (sz < ring_bytes)
+        sz <<= 1;
+    mask_ = sz - 1;
+    // direct_alloc清零, data_为nullptr
+    rings_ = static_cast<Ring *>(ThreadInfo::direct_alloc(sizeof(Ring) * nrings_));
+}
+
+ChangeFeed::~ChangeFeed()
+{
+    for (size_t i = 0; i < nrings_; ++i)
+        ThreadInfo::direct_free(rings_[i].data_);
+    ThreadInfo::direct_free(rings_);
+}
+
+ChangeFeed::Ring &ChangeFeed::ring(ThreadInfo *ti)
+{
+    lf_precondition(size_t(ti->index()) < nrings_);
+    Ring &r = rings_[ti->index()];
+    // 读者只在head_ != tail_时访问data_, head_以release发布, 所以这里不需要同步
+    if (unlikely(r.data_ == nullptr))
+        r.data_ = static_cast<char *>(ThreadInfo::direct_alloc(mask_ + 1));
+    return r;
+}
+
+void ChangeFeed::wait_room(Ring &r, size_t need)
+{
+    uint64_t head = r.head_;
+    if (head + need - r.cached_tail_ > mask_ + 1)
+    {
+        r.cached_tail_ = atomic_load_acquire(&r.tail_);
+        if (head + need - r.cached_tail_ > mask_ + 1)
+        {
+            atomic_add64_relaxed(&stalls_, 1);
+            do
+            {
+                spin_hint();
+                r.cached_tail_ = atomic_load_acquire(&r.tail_);
+            } while (head + need - r.cached_tail_ > mask_ + 1);
+        }
+    }
+}
+
+void ChangeFeed::reserve(ThreadInfo *ti, size_t keylen)
+{
+    Ring &r = ring(ti);
+    wait_room(r, need_bytes(r, record_size(keylen)));
+}
+
+void ChangeFeed::append(ThreadInfo *ti, ChangeOp op, Slice key, uint64_t value)
+{
+    Ring &r = ring(ti);
+    size_t sz = record_size(key.size());
+    uint64_t head = r.head_;
+    uint64_t off = head & mask_;
+    // 环尾部放不下时，先用填充记录占满尾部
+    size_t need = need_bytes(r, sz);
+    // 已经reserve过时不会等待
+    wait_room(r, need);
+
+    if (need != sz)
+    {
+        RecordHeader *pad = reinterpret_cast<RecordHeader *>(r.data_ + off);
+        pad->op = ChangeOpPad;
+        head += mask_ + 1 - off;
+        off = 0;
+    }
+
+    RecordHeader *h = reinterpret_cast<RecordHeader *>(r.data_ + off);
+    h->lsn = atomic_add64(&next_lsn_, 1);
+    h->epoch = atomic_load_relaxed(&global_epoch);
+    h->value = value;
+    h->keylen = uint16_t(key.size());
+    h->op = op;
+    memcpy(h + 1, key.data(), key.size());
+    atomic_store_release(&r.head_, head + sz);
+}
+
+const ChangeFeed::RecordHeader *ChangeFeed::peek(Ring &r)
+{
+    uint64_t tail = r.tail_;
+    uint64_t head = atomic_load_acquire(&r.head_);
+    while (tail != head)
+    {
+        const RecordHeader *h = reinterpret_cast<const RecordHeader *>(r.data_ + (tail & mask_));
+        if (h->op != ChangeOpPad)
+            return h;
+        tail += mask_ + 1 - (tail & mask_);
+        atomic_store_release(&r.tail_, tail);
+    }
+    return nullptr;
+}
+
+template <typename F>
+size_t ChangeFeed::poll(F &visitor, size_t max_records)
+{
+    size_t n = 0;
+    while (n < max_records)
+    {
+        // 找到read_lsn_所在的环，然后连续读这个环，直到lsn不再连续
+        Ring *r = nullptr;
+        const RecordHeader *h = nullptr;
+        for (size_t i = 0; i < nrings_; ++i)
+        {
+            h = peek(rings_[i]);
+            if (h && h->lsn == read_lsn_)
+            {
+                r = &rings_[i];
+                break;
+            }
+        }
+        if (!r)
+            break;
+
+        do
+        {
+            ChangeRecord rec;
+            rec.lsn = h->lsn;
+            if (h->epoch > last_epoch_)
+                last_epoch_ = h->epoch;
+            rec.epoch = last_epoch_;
+            rec.value = h->value;
+            rec.op = ChangeOp(h->op);
+            rec.key = Slice(reinterpret_cast<const char *>(h + 1), h->keylen);
+            visitor(rec);
+            ++read_lsn_;
+            ++n;
+            atomic_store_release(&r->tail_, r->tail_ + record_size(h->keylen));
+        } while (n < max_records && (h = peek(*r)) && h->lsn == read_lsn_);
+    }
+    return n;
+}
+
+} // namespace lf
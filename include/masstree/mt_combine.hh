@@ -0,0 +1,187 @@
+#pragma once
+
+#include "masstree/mt_insert.hh"
+#include <algorithm>
+#include <thread>
+
+namespace lf
+{
+
+/*
+    FlatCombiner: 热点写入的flat combining。
+    每个线程在自己的发布槽里登记一个put，然后尝试拿combiner锁；
+    拿到锁的线程把所有已登记的操作按key排序后依次执行，再逐个通知完成。
+    没拿到锁的线程只在自己的槽上自旋，不再争抢Leaf的NodeVersion锁。
+    同一个Leaf上的写入因此变成一个线程内的批量工作，Leaf锁和缓存行不再来回传递。
+    与普通的TCursor写入可以混用，快照和变更流照常生效。
+    变更流: 发布者在登记之前先在自己的环里reserve, 持锁线程把记录写进发布者的环
+    (TCursor::set_feed_owner)。持锁线程因此不会在别人的写入上等待自己的环，
+    变更流的读者自己也通过put写入时不会死锁。
+
+    等待者自旋max_spins次之后让出CPU：线程数超过核数时，一直自旋的等待者会
+    占掉持锁线程的时间片。不让出时unit-mt-test的hot_keys_test(8线程写16个key,
+    单核)测得合并204k puts/s、普通写入588k puts/s；让出之后三次测得合并
+    1.08M~1.58M puts/s、普通写入0.74M~0.94M puts/s。单核上每批几乎只有一个操作，
+    所以这里的收益来自等待者不再和持锁线程抢CPU；多核上同时写同一组Leaf时，
+    批量执行还能省下Leaf锁和缓存行在核之间的传递。
+*/
+class FlatCombiner
+{
+  public:
+    enum
+    {
+        max_passes = 4,  // 一次持锁最多扫描发布槽的轮数
+        max_spins = 1024 // 等待者自旋这么多次后让出CPU
+    };
+
+    FlatCombiner(BasicTable &table, size_t nthreads);
+    ~FlatCombiner();
+
+    // 等价于find_insert, 赋值, finish(1); 返回key之前是否不存在
+    // 调用者需要持有LimboHandle
+    bool put(Slice key, uint64_t value, ThreadInfo *ti);
+
+    // 执行过的批次数和操作数，只在没有并发写入时准确
+    uint64_t batches() const
+    {
+        return batches_;
+    }
+    uint64_t combined() const
+    {
+        return combined_;
+    }
+
+  private:
+    enum
+    {
+        slot_empty = 0,
+        slot_pending = 1,
+        slot_done = 2
+    };
+
+    struct Slot
+    {
+        volatile int32_t state_;
+        int32_t inserted_;
+        ThreadInfo *ti_; // 发布者, 变更流的记录写进它的环
+        Slice key_;
+        uint64_t value_;
+        char pad_[32];
+    };
+
+    struct SlotKeyLess
+    {
+        const Slot *slots_;
+        bool operator()(uint32_t a, uint32_t b) const
+        {
+            return slots_[a].key_.compare(slots_[b].key_) < 0;
+        }
+    };
+
+    BasicTable &table_;
+    Slot *slots_;
+    uint32_t *batch_; // 只有持锁线程使用
+    size_t nslots_;
+    volatile int32_t lock_;
+    uint64_t batches_;
+    uint64_t combined_;
+
+    FlatCombiner(const FlatCombiner &);
+    FlatCombiner &operator=(const FlatCombiner &);
+
+    bool try_lock()
+    {
+        int32_t expected = 0;
+        return lock_ == 0 && atomic_cas32(&lock_, &expected, 1);
+    }
+
+    void unlock()
+    {
+        atomic_store_release(&lock_, 0);
+    }
+
+    void combine(ThreadInfo *ti);
+};
+
+FlatCombiner::FlatCombiner(BasicTable &table, size_t nthreads)
+    : table_(table), nslots_(nthreads), lock_(0), batches_(0), combined_(0)
+{
+    slots_ = static_cast<Slot *>(ThreadInfo::direct_alloc(sizeof(Slot) * nslots_));
+    batch_ = static_cast<uint32_t *>(ThreadInfo::direct_alloc(sizeof(uint32_t) * nslots_));
+}
+
+FlatCombiner::~FlatCombiner()
+{
+    ThreadInfo::direct_free(slots_);
+    ThreadInfo::direct_free(batch_);
+}
+
+bool FlatCombiner::put(Slice key, uint64_t value, ThreadInfo *ti)
+{
+    lf_precondition(size_t(ti->index()) < nslots_);
+    Slot &s = slots_[ti->index()];
+    // 环满时在这里等待，这时还没有登记，也没有持有任何锁
+    ChangeFeed *cdc = table_.change_feed();
+    if (cdc)
+        cdc->reserve(ti, key.size());
+    s.ti_ = ti;
+    s.key_ = key;
+    s.value_ = value;
+    atomic_store_release(&s.state_, int32_t(slot_pending));
+
+    int spins = 0;
+    while (atomic_load_acquire(&s.state_) != slot_done)
+    {
+        if (try_lock())
+        {
+            combine(ti);
+            unlock();
+        }
+        else if (++spins < max_spins)
+        {
+            spin_hint();
+        }
+        else
+        {
+            // 持锁线程可能被换下了CPU
+            std::this_thread::yield();
+            spins = 0;
+        }
+    }
+    s.state_ = slot_empty;
+    return s.inserted_ != 0;
+}
+
+void FlatCombiner::combine(ThreadInfo *ti)
+{
+    for (int pass = 0; pass < max_passes; ++pass)
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < nslots_; ++i)
+        {
+            if (atomic_load_acquire(&slots_[i].state_) == slot_pending)
+                batch_[n++] = uint32_t(i);
+        }
+        if (!n)
+            break;
+
+        // 按key排序，相邻的操作落在同一个Leaf上
+        SlotKeyLess less = {slots_};
+        std::sort(batch_, batch_ + n, less);
+        for (size_t j = 0; j < n; ++j)
+        {
+            Slot &s = slots_[batch_[j]];
+            TCursor lp(table_, s.key_);
+            lp.set_feed_owner(s.ti_);
+            bool found = lp.find_insert(ti);
+            lp.value() = s.value_;
+            lp.finish(1, ti);
+            s.inserted_ = !found;
+            atomic_store_release(&s.state_, int32_t(slot_done));
+        }
+        ++batches_;
+        combined_ += n;
+    }
+}
+
+} // namespace lf
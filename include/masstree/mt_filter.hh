@@ -0,0 +1,110 @@
+#pragma once
+
+#include "masstree/mt_scan.hh"
+#include "lf/hash.hh"
+
+namespace lf
+{
+
+NegativeFilter *NegativeFilter::make(size_t expected_keys, int bits_per_key, ThreadInfo *ti)
+{
+    size_t nblocks = (expected_keys * bits_per_key + block_bits - 1) / block_bits;
+    if (nblocks == 0)
+        nblocks = 1;
+    // k = bits_per_key * ln2
+    int k = int(bits_per_key * 69 / 100);
+    k = std::max(1, std::min(k, 16));
+
+    size_t sz = sizeof(NegativeFilter) + 64 + nblocks * (block_bits / 8);
+    char *data = static_cast<char *>(ti->alloc(sz));
+    NegativeFilter *f = new (data) NegativeFilter();
+    f->nblocks_ = nblocks;
+    f->k_ = k;
+    uintptr_t bits = (reinterpret_cast<uintptr_t>(data + sizeof(NegativeFilter)) + 63) & ~uintptr_t(63);
+    f->bits_ = reinterpret_cast<uint64_t volatile *>(bits);
+    return f;
+}
+
+void NegativeFilter::add(Slice key)
+{
+    uint32_t h = hash(key.data(), key.size(), 0xbc9f1d34);
+    uint64_t volatile *block = bits_ + ((uint64_t(h) * nblocks_) >> 32) * (block_bits / 64);
+    uint32_t g = h * 0x9e3779b9U;
+    uint32_t delta = (g >> 17) | (g << 15);
+    for (int i = 0; i < k_; ++i)
+    {
+        uint32_t bit = g & (block_bits - 1);
+        uint64_t mask = uint64_t(1) << (bit & 63);
+        // 已经设置的位不再写，减少cache line的来回传递
+        if (!(block[bit >> 6] & mask))
+            atomic_or64_relaxed(&block[bit >> 6], mask);
+        g += delta;
+    }
+}
+
+bool NegativeFilter::may_contain(Slice key) const
+{
+    uint32_t h = hash(key.data(), key.size(), 0xbc9f1d34);
+    const uint64_t volatile *block = bits_ + ((uint64_t(h) * nblocks_) >> 32) * (block_bits / 64);
+    uint32_t g = h * 0x9e3779b9U;
+    uint32_t delta = (g >> 17) | (g << 15);
+    for (int i = 0; i < k_; ++i)
+    {
+        uint32_t bit = g & (block_bits - 1);
+        if (!(block[bit >> 6] & (uint64_t(1) << (bit & 63))))
+            return false;
+        g += delta;
+    }
+    return true;
+}
+
+struct FilterBuilder
+{
+    NegativeFilter *filter_;
+
+    void visit_leaf(const ScanStackElt &, const MtKey &, ThreadInfo *)
+    {
+    }
+
+    bool visit_value(Slice key, LeafValue &, ThreadInfo *)
+    {
+        filter_->add(key);
+        return true;
+    }
+};
+
+/*
+    1. 发布building_filter_, 之后的插入同时写新旧两个过滤器。
+    2. 等待之前打开的handle全部结束，没看到building_filter_的插入都已经可见。
+    3. scan把现有的key加入新过滤器, 然后替换filter_, 旧的通过limbo回收。
+*/
+void BasicTable::rebuild_filter(size_t expected_keys, ThreadInfo *ti, int bits_per_key)
+{
+    NegativeFilter *nf = NegativeFilter::make(expected_keys, bits_per_key, ti);
+    building_filter_ = nf;
+    Epoch epoch = atomic_add64(&global_epoch, 1);
+    while (min_active_epoch() <= epoch)
+        spin_hint();
+
+    LimboHandle *handle = ti->new_handle();
+    FilterBuilder fb = {nf};
+    scan(Slice(), true, fb, ti);
+
+    NegativeFilter *old = filter_;
+    filter_ = nf;
+    compiler_barrier();
+    building_filter_ = nullptr;
+    if (old)
+        ti->dealloc(old);
+    ti->delete_handle(handle);
+}
+
+void BasicTable::remove_filter(ThreadInfo *ti)
+{
+    NegativeFilter *old = filter_;
+    filter_ = nullptr;
+    if (old)
+        ti->dealloc(old);
+}
+
+} // namespace lf
@@ -0,0 +1,287 @@
+#pragma once
+
+#include "masstree/mt_scan.hh"
+#include <string>
+#include <vector>
+
+namespace lf
+{
+
+/*
+    按key的顺序分批读before_或born_, 每批最多batch个key
+*/
+struct SnapshotSideCursor
+{
+    enum
+    {
+        batch = 64
+    };
+
+    const BasicTable &side_;
+    std::vector<std::string> keys_;
+    std::vector<uint64_t> values_;
+    size_t pos_;
+    bool end_; // side_中已经没有keys_之后的key
+
+    explicit SnapshotSideCursor(const BasicTable &side)
+        : side_(side), pos_(0), end_(true)
+    {
+    }
+
+    static bool side_empty(const BasicTable &t)
+    {
+        NodeBase *root = t.root();
+        return root->isleaf() && static_cast<Leaf *>(root)->size() == 0;
+    }
+
+    void visit_leaf(const ScanStackElt &, const MtKey &, ThreadInfo *)
+    {
+    }
+
+    bool visit_value(Slice key, LeafValue &val, ThreadInfo *)
+    {
+        keys_.push_back(std::string(key.data(), key.size()));
+        values_.push_back(val.value());
+        return keys_.size() < batch;
+    }
+
+    // 丢掉缓存的key, 从from开始重新读一批
+    void fill(Slice from, bool emit_from, ThreadInfo *ti)
+    {
+        keys_.clear();
+        values_.clear();
+        pos_ = 0;
+        end_ = true;
+        if (side_empty(side_))
+            return;
+        side_.scan(from, emit_from, *this, ti);
+        end_ = keys_.size() < batch;
+    }
+
+    // 当前这批读完时接着读下一批，返回是否还有key
+    bool valid(ThreadInfo *ti)
+    {
+        if (pos_ < keys_.size())
+            return true;
+        if (end_)
+            return false;
+        std::string last;
+        last.swap(keys_.back());
+        fill(Slice(last), false, ti);
+        return pos_ < keys_.size();
+    }
+
+    Slice key() const
+    {
+        return Slice(keys_[pos_]);
+    }
+    uint64_t value() const
+    {
+        return values_[pos_];
+    }
+    void next()
+    {
+        ++pos_;
+    }
+};
+
+/*
+    扫描活动的表，同时按顺序归并before_和born_: 在每个key之前补上before_中
+    已经被删除的key，并用before_/born_修正当前key的值。
+    before_/born_只增不减，每次capture写入之后captures_加一。读到活动表中的key之后
+    captures_没有变，缓存的before_/born_就足以修正这个key; 变了就从last_重新读。
+*/
+template <typename F>
+struct SnapshotScanner
+{
+    const TableSnapshot *snap_;
+    F &scanner_;
+    SnapshotSideCursor before_;
+    SnapshotSideCursor born_;
+    uint64_t captures_;
+    std::string last_;
+    bool emit_last_;
+    bool stopped_;
+    int count_;
+
+    SnapshotScanner(const TableSnapshot *snap, F &scanner,
+                    Slice firstkey, bool emit_firstkey)
+        : snap_(snap), scanner_(scanner), before_(snap->before_), born_(snap->born_),
+          captures_(0), last_(firstkey.data(), firstkey.size()), emit_last_(emit_firstkey),
+          stopped_(false), count_(0)
+    {
+    }
+
+    // 先读captures_再读before_/born_, 与capture中相反的写入顺序配合
+    void refill(ThreadInfo *ti)
+    {
+        captures_ = snap_->captures_;
+        acquire_fence();
+        before_.fill(Slice(last_), emit_last_, ti);
+        born_.fill(Slice(last_), emit_last_, ti);
+    }
+
+    void sync(ThreadInfo *ti)
+    {
+        acquire_fence();
+        if (snap_->captures_ != captures_)
+            refill(ti);
+    }
+
+    bool emit(Slice key, uint64_t value, ThreadInfo *ti)
+    {
+        last_.assign(key.data(), key.size());
+        emit_last_ = false;
+        LeafValue lv(value);
+        ++count_;
+        if (!scanner_.visit_value(key, lv, ti))
+            stopped_ = true;
+        return !stopped_;
+    }
+
+    // 输出before_中小于bound的key, bound为nullptr时输出全部; 返回bound是否在before_中
+    bool emit_before(const Slice *bound, uint64_t &bound_value, ThreadInfo *ti)
+    {
+        while (before_.valid(ti))
+        {
+            int cmp = bound ? before_.key().compare(*bound) : -1;
+            if (cmp > 0)
+                return false;
+            if (cmp == 0)
+            {
+                bound_value = before_.value();
+                before_.next();
+                return true;
+            }
+            bool more = emit(before_.key(), before_.value(), ti);
+            before_.next();
+            if (!more)
+                return false;
+        }
+        return false;
+    }
+
+    void visit_leaf(const ScanStackElt &n, const MtKey &k, ThreadInfo *ti)
+    {
+        scanner_.visit_leaf(n, k, ti);
+    }
+
+    bool visit_value(Slice key, LeafValue &val, ThreadInfo *ti)
+    {
+        sync(ti);
+        uint64_t old;
+        bool hit = emit_before(&key, old, ti);
+        if (stopped_)
+            return false;
+        if (hit)
+            return emit(key, old, ti);
+
+        while (born_.valid(ti) && born_.key().compare(key) < 0)
+            born_.next();
+        if (born_.valid(ti) && born_.key().compare(key) == 0)
+        {
+            born_.next();
+            last_.assign(key.data(), key.size());
+            emit_last_ = false;
+            return true;
+        }
+        return emit(key, val.value(), ti);
+    }
+
+    void finish(ThreadInfo *ti)
+    {
+        uint64_t old;
+        if (stopped_)
+            return;
+        sync(ti);
+        emit_before(nullptr, old, ti);
+    }
+};
+
+TableSnapshot *BasicTable::fork(ThreadInfo *ti)
+{
+    void *data = ti->alloc(sizeof(TableSnapshot));
+    TableSnapshot *snap = new (data) TableSnapshot(this);
+    snap->before_.initialize(ti);
+    snap->born_.initialize(ti);
+
+    void *expected = nullptr;
+    if (!atomic_casptr(reinterpret_cast<void *volatile *>(&fork_), &expected, snap))
+    {
+        snap->before_.destroy(ti);
+        snap->born_.destroy(ti);
+        ti->dealloc(snap);
+        return nullptr;
+    }
+    // 在这之前打开的handle可能没有看到fork_, 要等它们全部结束
+    snap->fork_epoch_ = atomic_add64(&global_epoch, 1);
+    return snap;
+}
+
+bool TableSnapshot::ready() const
+{
+    return min_active_epoch() > fork_epoch_;
+}
+
+void TableSnapshot::capture(Slice key, const LeafValue *value, ThreadInfo *ti)
+{
+    LeafValue old;
+    if (before_.get(key, old, ti) || born_.get(key, old, ti))
+        return;
+
+    // 同一个key的capture被活动表中Leaf的锁串行化，只有第一次会写入
+    TCursor lp(value ? before_ : born_, key);
+    bool found = lp.find_insert(ti);
+    if (!found)
+        lp.value() = value ? *value : LeafValue(uint64_t(0));
+    lp.finish(found ? 0 : 1, ti);
+    if (!found)
+        atomic_add64(&captures_, 1);
+}
+
+bool TableSnapshot::get(Slice key, LeafValue &value, ThreadInfo *ti) const
+{
+    lf_precondition(ready());
+    // 先读活动的表：如果读到了fork之后的修改，它的旧值一定已经在before_/born_中
+    bool found = table_->get(key, value, ti);
+    acquire_fence();
+
+    LeafValue old;
+    if (before_.get(key, old, ti))
+    {
+        value = old;
+        return true;
+    }
+    if (born_.get(key, old, ti))
+        return false;
+    return found;
+}
+
+template <typename F>
+int TableSnapshot::scan(Slice firstkey, bool emit_firstkey,
+                        F &scanner, ThreadInfo *ti) const
+{
+    lf_precondition(ready());
+    SnapshotScanner<F> ss(this, scanner, firstkey, emit_firstkey);
+    ss.refill(ti);
+    table_->scan(firstkey, emit_firstkey, ss, ti);
+    ss.finish(ti);
+    return ss.count_;
+}
+
+void TableSnapshot::release(ThreadInfo *ti)
+{
+    table_->fork_ = nullptr;
+    memory_fence();
+    // 已经读到fork_的写者可能还在capture, 等grace period之后再回收
+    ti->register_rcu(this);
+}
+
+void TableSnapshot::operator()(ThreadInfo *ti)
+{
+    before_.destroy(ti);
+    born_.destroy(ti);
+    ThreadInfo::free_block(this);
+}
+
+} // namespace lf
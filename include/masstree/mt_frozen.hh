@@ -0,0 +1,351 @@
+#pragma once
+
+#include "masstree/mt_scan.hh"
+#include <string>
+#include <vector>
+
+namespace lf
+{
+
+/*
+    FrozenTable: BasicTable冻结后的只读格式。
+    1. 所有key排序后每block_keys个分成一个block, block内做前缀压缩
+       (shared, unshared, bytes), 每个block的第一个key完整保存。
+    2. 每个block首key的ikey按Eytzinger(BFS)顺序排列，作为静态索引。
+       首ikey相同的一串block(长的公共前缀)再按完整的首key倍增查找。
+    3. value连续存放，下标与key的全局序号一致。
+    block数不超过2^32, key的字节数不限。
+    全部数据在一次分配的连续内存里，没有指针，也不需要版本校验和锁。
+    build之后不可修改，clear之前调用者要保证没有并发读者。
+*/
+class FrozenTable
+{
+  public:
+    enum
+    {
+        block_keys = 16
+    };
+
+    FrozenTable()
+        : data_(nullptr), data_size_(0), nkeys_(0), nblocks_(0),
+          values_(nullptr), eytz_ikey_(nullptr), block_off_(nullptr),
+          eytz_block_(nullptr), keys_(nullptr)
+    {
+    }
+
+    ~FrozenTable()
+    {
+        clear();
+    }
+
+    void build(const BasicTable &table, ThreadInfo *ti);
+    void clear();
+
+    size_t size() const
+    {
+        return nkeys_;
+    }
+
+    size_t memory_usage() const
+    {
+        return data_size_;
+    }
+
+    bool get(Slice key, LeafValue &value) const;
+
+    // 语义与BasicTable::scan相同，只是不会调用scanner.visit_leaf
+    template <typename F>
+    int scan(Slice firstkey, bool emit_firstkey, F &scanner, ThreadInfo *ti) const;
+
+  private:
+    char *data_;
+    size_t data_size_;
+    size_t nkeys_;
+    size_t nblocks_;
+    const uint64_t *values_;     // [nkeys_]
+    const uint64_t *eytz_ikey_;  // [nblocks_ + 1], 1-based
+    const uint64_t *block_off_;  // [nblocks_ + 1], block在keys_中的偏移
+    const uint32_t *eytz_block_; // [nblocks_ + 1], eytz位置对应的block
+    const char *keys_;
+
+    FrozenTable(const FrozenTable &);
+    FrozenTable &operator=(const FrozenTable &);
+
+    static void put_varint(std::string &dst, uint32_t v)
+    {
+        while (v >= 128)
+        {
+            dst.push_back(char(v | 128));
+            v >>= 7;
+        }
+        dst.push_back(char(v));
+    }
+
+    static const char *get_varint(const char *p, uint32_t &v)
+    {
+        uint32_t result = 0;
+        for (int shift = 0; shift <= 28; shift += 7)
+        {
+            uint32_t byte = (unsigned char)*p++;
+            result |= (byte & 127) << shift;
+            if (!(byte & 128))
+                break;
+        }
+        v = result;
+        return p;
+    }
+
+    // 解码p处的一个entry到buf, 返回下一个entry的位置
+    static const char *decode_entry(const char *p, char *buf, int &len)
+    {
+        uint32_t shared, unshared;
+        p = get_varint(p, shared);
+        p = get_varint(p, unshared);
+        memcpy(buf + shared, p, unshared);
+        len = shared + unshared;
+        return p + unshared;
+    }
+
+    Slice block_first_key(size_t b) const
+    {
+        uint32_t shared, unshared;
+        const char *p = keys_ + block_off_[b];
+        p = get_varint(p, shared);
+        p = get_varint(p, unshared);
+        return Slice(p, unshared);
+    }
+
+    void fill_eytzinger(const std::vector<uint64_t> &ikeys,
+                        uint64_t *eytz_ikey, uint32_t *eytz_block,
+                        size_t &i, size_t k) const
+    {
+        if (k <= nblocks_)
+        {
+            fill_eytzinger(ikeys, eytz_ikey, eytz_block, i, 2 * k);
+            eytz_ikey[k] = ikeys[i];
+            eytz_block[k] = uint32_t(i);
+            ++i;
+            fill_eytzinger(ikeys, eytz_ikey, eytz_block, i, 2 * k + 1);
+        }
+    }
+
+    size_t find_block(Slice key) const;
+    size_t lower_bound(Slice key, bool emit_equal) const;
+
+    friend struct FrozenBuilder;
+};
+
+struct FrozenBuilder
+{
+    std::vector<std::string> keys_;
+    std::vector<uint64_t> values_;
+
+    void visit_leaf(const ScanStackElt &, const MtKey &, ThreadInfo *)
+    {
+    }
+
+    bool visit_value(Slice key, LeafValue &val, ThreadInfo *)
+    {
+        keys_.push_back(std::string(key.data(), key.size()));
+        values_.push_back(val.value());
+        return true;
+    }
+};
+
+void FrozenTable::clear()
+{
+    ThreadInfo::direct_free(data_);
+    data_ = nullptr;
+    data_size_ = nkeys_ = nblocks_ = 0;
+    values_ = nullptr;
+    eytz_ikey_ = nullptr;
+    block_off_ = nullptr;
+    eytz_block_ = nullptr;
+    keys_ = nullptr;
+}
+
+void FrozenTable::build(const BasicTable &table, ThreadInfo *ti)
+{
+    clear();
+
+    FrozenBuilder fb;
+    table.scan(Slice(), true, fb, ti);
+
+    nkeys_ = fb.keys_.size();
+    nblocks_ = (nkeys_ + block_keys - 1) / block_keys;
+    lf_precondition(nblocks_ < (size_t(1) << 32));
+
+    std::string kbuf;
+    std::vector<uint64_t> offs;
+    std::vector<uint64_t> ikeys;
+    for (size_t i = 0; i < nkeys_; ++i)
+    {
+        const std::string &k = fb.keys_[i];
+        size_t shared = 0;
+        if (i % block_keys == 0)
+        {
+            offs.push_back(kbuf.size());
+            ikeys.push_back(StringSlice::make_comparable(k.data(), k.size()));
+        }
+        else
+        {
+            const std::string &prev = fb.keys_[i - 1];
+            size_t l = std::min(prev.size(), k.size());
+            while (shared < l && prev[shared] == k[shared])
+                ++shared;
+        }
+        put_varint(kbuf, uint32_t(shared));
+        put_varint(kbuf, uint32_t(k.size() - shared));
+        kbuf.append(k.data() + shared, k.size() - shared);
+    }
+    offs.push_back(kbuf.size());
+
+    size_t values_sz = sizeof(uint64_t) * nkeys_;
+    size_t eytz_ikey_sz = sizeof(uint64_t) * (nblocks_ + 1);
+    size_t block_off_sz = sizeof(uint64_t) * (nblocks_ + 1);
+    size_t eytz_block_sz = sizeof(uint32_t) * (nblocks_ + 1);
+    data_size_ = values_sz + eytz_ikey_sz + block_off_sz + eytz_block_sz + kbuf.size();
+    data_ = (char *)ThreadInfo::direct_alloc(data_size_ ? data_size_ : 1);
+
+    char *p = data_;
+    uint64_t *values = reinterpret_cast<uint64_t *>(p);
+    p += values_sz;
+    uint64_t *eytz_ikey = reinterpret_cast<uint64_t *>(p);
+    p += eytz_ikey_sz;
+    uint64_t *block_off = reinterpret_cast<uint64_t *>(p);
+    p += block_off_sz;
+    uint32_t *eytz_block = reinterpret_cast<uint32_t *>(p);
+    p += eytz_block_sz;
+
+    if (nkeys_)
+        memcpy(values, &fb.values_[0], values_sz);
+    memcpy(block_off, &offs[0], block_off_sz);
+    memcpy(p, kbuf.data(), kbuf.size());
+    size_t i = 0;
+    fill_eytzinger(ikeys, eytz_ikey, eytz_block, i, 1);
+
+    values_ = values;
+    eytz_ikey_ = eytz_ikey;
+    eytz_block_ = eytz_block;
+    block_off_ = block_off;
+    keys_ = p;
+}
+
+// 返回首key不大于key的最后一个block
+size_t FrozenTable::find_block(Slice key) const
+{
+    uint64_t ikey = StringSlice::make_comparable(key.data(), key.size());
+    size_t k = 1;
+    while (k <= nblocks_)
+    {
+        __builtin_prefetch(eytz_ikey_ + 16 * k);
+        k = 2 * k + (eytz_ikey_[k] < ikey);
+    }
+    k >>= __builtin_ffsll(~k);
+
+    // 首ikey小于ikey的block，其首key一定小于key; 首ikey相同的block需要比较完整的key,
+    // 这样的block可能连续很多个，先倍增找到首key大于key的block, 再在中间二分
+    size_t b = k ? eytz_block_[k] : nblocks_;
+    b = b ? b - 1 : 0;
+    size_t step = 1;
+    size_t hi = b + 1;
+    while (hi < nblocks_ && block_first_key(hi).compare(key) <= 0)
+    {
+        b = hi;
+        hi = b + step;
+        step <<= 1;
+    }
+    hi = std::min(hi, nblocks_);
+    // 不变式: block b的首key不大于key(b为0时除外), block hi的首key大于key
+    while (b + 1 < hi)
+    {
+        size_t mid = b + (hi - b) / 2;
+        if (block_first_key(mid).compare(key) <= 0)
+            b = mid;
+        else
+            hi = mid;
+    }
+    return b;
+}
+
+// 返回第一个不小于(emit_equal)或大于key的序号
+size_t FrozenTable::lower_bound(Slice key, bool emit_equal) const
+{
+    if (!nblocks_)
+        return 0;
+    char buf[LF_MAXKEYLEN];
+    size_t b = find_block(key);
+    size_t idx = b * block_keys;
+    size_t end = std::min(idx + block_keys, nkeys_);
+    const char *p = keys_ + block_off_[b];
+    for (; idx < end; ++idx)
+    {
+        int len;
+        p = decode_entry(p, buf, len);
+        int cmp = Slice(buf, len).compare(key);
+        if (cmp > 0 || (cmp == 0 && emit_equal))
+            break;
+    }
+    return idx;
+}
+
+bool FrozenTable::get(Slice key, LeafValue &value) const
+{
+    if (!nblocks_)
+        return false;
+    char buf[LF_MAXKEYLEN];
+    size_t b = find_block(key);
+    size_t idx = b * block_keys;
+    size_t end = std::min(idx + block_keys, nkeys_);
+    const char *p = keys_ + block_off_[b];
+    for (; idx < end; ++idx)
+    {
+        int len;
+        p = decode_entry(p, buf, len);
+        int cmp = Slice(buf, len).compare(key);
+        if (cmp == 0)
+        {
+            value = LeafValue(values_[idx]);
+            return true;
+        }
+        else if (cmp > 0)
+        {
+            break;
+        }
+    }
+    return false;
+}
+
+template <typename F>
+int FrozenTable::scan(Slice firstkey, bool emit_firstkey, F &scanner, ThreadInfo *ti) const
+{
+    char buf[LF_MAXKEYLEN];
+    int scancount = 0;
+    size_t idx = lower_bound(firstkey, emit_firstkey);
+    if (idx >= nkeys_)
+        return 0;
+
+    // 从所在block的开头解码，恢复前缀
+    size_t b = idx / block_keys;
+    const char *p = keys_ + block_off_[b];
+    int len = 0;
+    for (size_t i = b * block_keys; i < idx; ++i)
+        p = decode_entry(p, buf, len);
+
+    for (; idx < nkeys_; ++idx)
+    {
+        p = decode_entry(p, buf, len);
+        LeafValue entry(values_[idx]);
+        ++scancount;
+        if (!scanner.visit_value(Slice(buf, len), entry, ti))
+            break;
+    }
+    return scancount;
+}
+
+void BasicTable::freeze(FrozenTable &frozen, ThreadInfo *ti) const
+{
+    frozen.build(*this, ti);
+}
+
+} // namespace lf
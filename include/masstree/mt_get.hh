@@ -1,6 +1,7 @@
 #pragma once
 
 #include "masstree/mt_tcursor.hh"
+#include "masstree/mt_cdc.hh"
 
 namespace lf
 {
@@ -10,19 +11,28 @@ bool UnlockedTCursor::find_unlocked(ThreadInfo *ti)
     int match;
     KeyIndexedPosition kx;
     NodeBase *root = const_cast<NodeBase *>(root_);
+    LF_MT_COUNTERS_BIND(ti);
 
 retry:
     n_ = root->reach_leaf(ka_, v_);
 
 forward:
     if (v_.deleted())
+    {
+        LF_MT_COUNT(find_unlocked_retry);
         goto retry;
+    }
     perm_ = n_->permutation();
     kx = Leaf::bound_type::lower(ka_, *this);
     if (kx.p >= 0)
     {
+        // 先读墓碑：复活时先写值再清墓碑位，并且不改版本
+        bool tomb = n_->is_tombstone(kx.p);
+        compiler_barrier();
         lv_ = n_->lv_[kx.p];
         match = n_->ksuf_matches(kx.p, ka_);
+        if (match > 0 && tomb)
+            match = 0;
     }
     else
     {
@@ -30,6 +40,7 @@ forward:
     }
     if (n_->has_changed(v_))
     {
+        LF_MT_COUNT(find_unlocked_forward);
         n_ = n_->advance_to_key(ka_, v_);
         goto forward;
     }
@@ -42,16 +53,37 @@ forward:
     }
     else
     {
+        slot_ = kx.p;
         return match;
     }
 }
 
 bool BasicTable::get(Slice& key, LeafValue& value, ThreadInfo *ti) const
 {
+    NegativeFilter *filter = filter_;
+    if (filter && !filter->may_contain(key))
+        return false;
+
+    // 代数在下降之前读，下降中找到的Leaf如果被回收，代数一定对不上
+    HotLeafIndex *hot = hot_;
+    uint64_t gen = hot ? leaf_gen_ : 0;
+    acquire_fence();
+    uint32_t h = 0;
+    if (hot)
+    {
+        h = HotLeafIndex::hash_key(key);
+        if (hot->lookup(key, h, gen, value))
+            return true;
+    }
+
     UnlockedTCursor lp(*this, key);
     bool found = lp.find_unlocked(ti);
     if (found)
+    {
         value = lp.value();
+        if (hot)
+            hot->record(key, h, lp.node(), lp.slot(), lp.version(), lp.shift(), gen);
+    }
     return found;
 }
 
@@ -60,13 +92,22 @@ bool TCursor::find_locked(ThreadInfo *ti)
     NodeBase *root = const_cast<NodeBase *>(root_);
     NodeVersion v;
     permuter_type perm;
+    LF_MT_COUNTERS_BIND(ti);
+
+    // 变更流的反压必须在锁Leaf之前, 见ChangeFeed
+    ChangeFeed *cdc = table_ ? table_->change_feed() : nullptr;
+    if (unlikely(cdc != nullptr))
+        cdc->reserve(feed_ti_ ? feed_ti_ : ti, ka_.full_string().size());
 
 retry:
     n_ = root->reach_leaf(ka_, v);
 
 forward:
     if (v.deleted())
+    {
+        LF_MT_COUNT(find_locked_retry);
         goto retry;
+    }
     perm = n_->permutation();
     compiler_barrier();
 
@@ -93,6 +134,7 @@ forward:
     {
         // 检查是为了保证之前获得的状态（kx_等）与n_加锁后处于一致状态
         n_->unlock();
+        LF_MT_COUNT(find_locked_forward);
         n_ = n_->advance_to_key(ka_, v);
         goto forward;
     }
@@ -103,15 +145,26 @@ forward:
         ka_.shift_by(-state_);
         n_->lv_[kx_.p] = root = n_->lv_[kx_.p].layer()->maybe_parent();
         n_->unlock();
+        LF_MT_COUNT(find_locked_retry);
         goto retry;
     }
     else if (unlikely(n_->deleted_layer()))
     {
         ka_.unshift_all();
         root = const_cast<NodeBase *>(root_);
+        LF_MT_COUNT(find_locked_retry);
         goto retry;
     }
-    return state_;
+    else if (state_ == 1 && unlikely(n_->is_tombstone(kx_.p)))
+    {
+        state_ = 4;
+    }
+
+    // 有快照时，已有key的新值先写在snap_value_里，由finish在记录修改前的状态之后写回Leaf
+    snap_ = table_ ? table_->snapshot() : nullptr;
+    if (unlikely(snap_ != nullptr) && state_ == 1)
+        snap_value_ = n_->lv_[kx_.p];
+    return state_ == 1;
 }
 
 } // namespace lf
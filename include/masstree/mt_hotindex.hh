@@ -0,0 +1,131 @@
+#pragma once
+
+#include "masstree/mt_get.hh"
+#include "lf/hash.hh"
+
+namespace lf
+{
+
+HotLeafIndex *HotLeafIndex::make(size_t nslots, ThreadInfo *ti)
+{
+    size_t n = 64;
+    while (n < nslots)
+        n <<= 1;
+    size_t sz = sizeof(HotLeafIndex) + 64 + n * sizeof(Slot);
+    char *data = static_cast<char *>(ti->alloc(sz));
+    HotLeafIndex *hi = new (data) HotLeafIndex();
+    hi->mask_ = n - 1;
+    uintptr_t slots = (reinterpret_cast<uintptr_t>(data + sizeof(HotLeafIndex)) + 63) & ~uintptr_t(63);
+    hi->slots_ = reinterpret_cast<Slot *>(slots);
+    return hi;
+}
+
+uint32_t HotLeafIndex::hash_key(Slice key)
+{
+    return hash(key.data(), key.size(), 0x5bd1e995);
+}
+
+bool HotLeafIndex::lookup(Slice key, uint32_t h, uint64_t gen, LeafValue &value) const
+{
+    Slot &s = slots_[h & mask_];
+    int32_t seq = atomic_load_acquire(&s.seq_);
+    uint32_t sh = s.hash_;
+    Leaf *n = s.leaf_;
+    NodeVersion recorded = s.version_;
+    uint64_t sgen = s.gen_;
+    int shift = s.shift_;
+    int p = s.p_;
+    char prefix[max_prefix];
+    if (shift > 0 && shift <= max_prefix)
+        memcpy(prefix, s.prefix_, shift);
+    acquire_fence();
+    if ((seq & 1) || s.seq_ != seq || sh != h || !n)
+    {
+        LF_MT_COUNT(hot_index_misses);
+        return false;
+    }
+
+    // 代数没变说明记录之后到打开handle之间表中没有Leaf被回收过，n一定还在;
+    // 之后才回收的Leaf要等当前的handle结束才会释放
+    if (sgen != gen)
+    {
+        LF_MT_COUNT(hot_index_misses);
+        return false;
+    }
+
+    NodeVersion v = n->stable();
+    if (v.deleted() || v.has_split(recorded))
+    {
+        LF_MT_COUNT(hot_index_misses);
+        return false;
+    }
+
+    // 下层layer里只能比较shift之后的部分，前缀和槽里保存的比较
+    if (shift > 0 && (shift > max_prefix || key.size() <= size_t(shift) ||
+                      memcmp(key.data(), prefix, shift) != 0))
+    {
+        LF_MT_COUNT(hot_index_misses);
+        return false;
+    }
+
+    MtKey ka(key);
+    if (shift)
+        ka.shift_by(shift);
+    Leaf::permuter_type perm = n->permutation();
+    int i = 0;
+    while (i < perm.size() && perm[i] != p)
+        ++i;
+    bool match = i < perm.size() && n->compare_key(ka, p) == 0 &&
+                 n->ksuf_matches(p, ka) == 1 && !n->is_tombstone(p);
+    compiler_barrier();
+    LeafValue lv = n->lv_[p];
+    if (!match || n->has_changed(v))
+    {
+        LF_MT_COUNT(hot_index_misses);
+        return false;
+    }
+    LF_MT_COUNT(hot_index_hits);
+    value = lv;
+    return true;
+}
+
+void HotLeafIndex::record(Slice key, uint32_t h, Leaf *n, int slot, NodeVersion v, int shift, uint64_t gen)
+{
+    if (shift > max_prefix)
+        return;
+    Slot &s = slots_[h & mask_];
+    int32_t seq = s.seq_;
+    // 已经是同样的内容就不写，热点key的槽不会在cache之间来回传递
+    if ((seq & 1) || (s.hash_ == h && s.leaf_ == n && s.p_ == slot && s.shift_ == shift &&
+                      s.gen_ == gen && !v.has_split(s.version_) &&
+                      memcmp(s.prefix_, key.data(), shift) == 0))
+        return;
+    if (!atomic_cas32(&s.seq_, &seq, seq + 1))
+        return;
+    s.hash_ = h;
+    s.leaf_ = n;
+    s.version_ = v;
+    s.gen_ = gen;
+    s.shift_ = uint16_t(shift);
+    s.p_ = uint8_t(slot);
+    memcpy(s.prefix_, key.data(), shift);
+    atomic_store_release(&s.seq_, seq + 2);
+}
+
+void BasicTable::enable_hot_index(size_t nslots, ThreadInfo *ti)
+{
+    HotLeafIndex *old = hot_;
+    hot_ = HotLeafIndex::make(nslots, ti);
+    if (old)
+        ti->dealloc(old);
+}
+
+void BasicTable::disable_hot_index(ThreadInfo *ti)
+{
+    HotLeafIndex *old = hot_;
+    hot_ = nullptr;
+    if (old)
+        ti->dealloc(old);
+}
+
+} // namespace lf
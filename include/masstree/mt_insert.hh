@@ -2,6 +2,7 @@
 
 #include "masstree/mt_get.hh"
 #include "masstree/mt_split.hh"
+#include "masstree/mt_cdc.hh"
 
 namespace lf
 {
@@ -11,6 +12,7 @@ namespace lf
         1  match找到
         -1 match并且是layer指针（find_locked的中间状态）
         2  正在插入值，但值还没有到位
+        4  match找到，但槽位上是懒删除留下的墓碑(对外就是不存在)
 */
 bool TCursor::find_insert(ThreadInfo *ti)
 {
@@ -19,11 +21,24 @@ bool TCursor::find_insert(ThreadInfo *ti)
     original_v_ = n_->full_unlocked_version_value();
 
     // maybe we found it
-    if (state_)
+    if (state_ == 1)
         return true;
 
-    // otherwise mark as inserted but not present
-    state_ = 2;
+    // 墓碑直接复用原来的槽位，finish(1)时清除墓碑
+    if (state_ != 4)
+        state_ = 2;
+
+    // 在key可见之前设置过滤器的位
+    // 先读building_filter_再读filter_, 与rebuild_filter中相反的写入顺序配合
+    if (table_)
+    {
+        if (NegativeFilter *filter = table_->building_filter())
+            filter->add(ka_.full_string());
+        if (NegativeFilter *filter = table_->filter())
+            filter->add(ka_.full_string());
+    }
+    if (state_ == 4)
+        return false;
 
     // maybe we need a new layer
     if (kx_.p >= 0)
@@ -61,6 +76,7 @@ bool TCursor::find_insert(ThreadInfo *ti)
 
 bool TCursor::make_new_layer(ThreadInfo *ti)
 {
+    LF_MT_COUNT(new_layers);
     MtKey oka(n_->ksuf(kx_.p));
     ka_.shift();
     int kcmp = oka.compare(ka_);
@@ -102,6 +118,8 @@ bool TCursor::make_new_layer(ThreadInfo *ti)
     nl->assign_initialize(0, kcmp < 0 ? oka : ka_, ti);
     nl->assign_initialize(1, kcmp < 0 ? ka_ : oka, ti);
     nl->lv_[kcmp > 0] = n_->lv_[kx_.p];
+    if (n_->is_tombstone(kx_.p))
+        nl->set_tombstone(kcmp > 0);
     nl->lock(*nl);
     if (kcmp < 0)
     {
@@ -130,6 +148,7 @@ bool TCursor::make_new_layer(ThreadInfo *ti)
         n_->lv_[kx_.p] = nl;
     }
     n_->keylenx_[kx_.p] = n_->layer_keylenx;
+    n_->clear_tombstone(kx_.p);
     updated_v_ = n_->full_unlocked_version_value();
     n_->unlock();
     n_ = nl;
@@ -149,8 +168,34 @@ void TCursor::finish_insert()
 
 void TCursor::finish(int state, ThreadInfo *ti)
 {
-    if (state < 0 && state_ == 1)
+    if (unlikely(snap_ != nullptr))
+    {
+        if (state != 0)
+            snap_->capture(ka_.full_string(), state_ == 1 ? &n_->lv_[kx_.p] : nullptr, ti);
+        if (state > 0 && state_ == 1)
+            n_->lv_[kx_.p] = snap_value_;
+        snap_ = nullptr;
+    }
+    ChangeFeed *cdc = table_ ? table_->change_feed() : nullptr;
+    if (unlikely(cdc != nullptr) && state != 0 && state_ != 0)
+    {
+        // 在解锁之前记录，保证同一个key的记录顺序与修改顺序一致
+        ThreadInfo *owner = feed_ti_ ? feed_ti_ : ti;
+        if (state > 0)
+            cdc->append(owner, ChangeOpPut, ka_.full_string(), n_->lv_[kx_.p].value());
+        else if (state_ == 1)
+            cdc->append(owner, ChangeOpRemove, ka_.full_string(), 0);
+    }
+
+    if (state < 0 && state_ == 1 && state != -2 && table_ && table_->lazy_delete())
+    {
+        n_->set_tombstone(kx_.p);
+        atomic_add64(&table_->tombstones_, 1);
+    }
+    else if ((state < 0 && state_ == 1) || (state == -2 && state_ == 4))
     {
+        if (state_ == 4 && table_)
+            atomic_add64(&table_->tombstones_, ~uint64_t(0));
         if (finish_remvoe(ti))
         {
             return;
@@ -160,6 +205,12 @@ void TCursor::finish(int state, ThreadInfo *ti)
     {
         finish_insert();
     }
+    else if (state > 0 && state_ == 4)
+    {
+        n_->clear_tombstone(kx_.p);
+        if (table_)
+            atomic_add64(&table_->tombstones_, ~uint64_t(0));
+    }
 
     if (n_ == original_n_)
         updated_v_ = n_->full_unlocked_version_value();
@@ -2,18 +2,25 @@
 
 #include "masstree/mt_tcursor.hh"
 #include "masstree/mt_leaflink.hh"
+#include <thread>
+#include <vector>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
 
 namespace lf
 {
 
-struct GcLayerRcuCallback : public MrcuCallback
+// 通过ThreadInfo::defer执行，本身从内存池分配，执行完还给执行线程的内存池
+struct GcLayerRcuCallback
 {
+    BasicTable *table_;
     NodeBase *root_;
     int len_;
     char s_[0];
 
-    GcLayerRcuCallback(NodeBase *root, Slice prefix)
-        : root_(root), len_(prefix.size())
+    GcLayerRcuCallback(BasicTable *table, NodeBase *root, Slice prefix)
+        : table_(table), root_(root), len_(prefix.size())
     {
         memcpy(s_, prefix.data(), len_);
     }
@@ -23,36 +30,38 @@ struct GcLayerRcuCallback : public MrcuCallback
         return len_ + sizeof(*this);
     }
 
-    void operator()(ThreadInfo *ti)
+    static void run(void *arg, ThreadInfo *ti)
     {
-        while (!root_->is_root())
+        GcLayerRcuCallback *cb = static_cast<GcLayerRcuCallback *>(arg);
+        while (!cb->root_->is_root())
         {
-            root_ = root_->maybe_parent();
+            cb->root_ = cb->root_->maybe_parent();
         }
-        if (!root_->deleted())
+        if (!cb->root_->deleted())
         {
-            TCursor lp(root_, s_, len_);
+            TCursor lp(cb->table_, cb->root_, cb->s_, cb->len_);
             bool do_remove = lp.gc_layer(ti);
             if (!do_remove || !lp.finish_remvoe(ti))
             {
                 lp.n_->unlock();
             }
-            ti->direct_free(this);
         }
+        ti->release(cb, ThreadInfo::pool_tag(cb->size()));
     }
 
-    static void make(NodeBase *root, Slice prefix, ThreadInfo *ti)
+    static void make(BasicTable *table, NodeBase *root, Slice prefix, ThreadInfo *ti)
     {
         size_t sz = prefix.size() + sizeof(GcLayerRcuCallback);
-        void *data = ti->alloc(sz);
-        GcLayerRcuCallback *cb = new (data) GcLayerRcuCallback(root, prefix);
-        ti->register_rcu(cb);
+        void *data = ti->alloc(sz, ThreadInfo::pool_tag(sz));
+        GcLayerRcuCallback *cb = new (data) GcLayerRcuCallback(table, root, prefix);
+        ti->defer(&GcLayerRcuCallback::run, cb);
     }
 };
 
 bool TCursor::gc_layer(ThreadInfo *ti)
 {
     find_locked(ti);
+    LF_MT_COUNT(gc_layer_attempts);
     lf_precondition(!n_->deleted() && !n_->deleted_layer());
 
     // find_locked might return early if another gc_layer attempt has
@@ -131,7 +140,8 @@ bool TCursor::gc_layer(ThreadInfo *ti)
         }
         lf->mark_deleted_layer();
         lf->unlock();
-        lf->deallocate(ti);
+        retire_leaf(table_, lf, ti);
+        LF_MT_COUNT(gc_layer_removed);
         return true;
     }
 
@@ -154,23 +164,23 @@ inline bool TCursor::finish_remvoe(ThreadInfo *ti)
     if (perm.size())
         return false;
     else
-        return remove_leaf(n_, root_, ka_.prefix_string(), ti);
+        return remove_leaf(table_, n_, root_, ka_.prefix_string(), ti);
 }
 
-bool TCursor::remove_leaf(Leaf *leaf, NodeBase *root,
+bool TCursor::remove_leaf(BasicTable *table, Leaf *leaf, NodeBase *root,
                           Slice prefix, ThreadInfo *ti)
 {
     if (!leaf->prev_)
     {
         // 第一个Leaf节点空，表示整棵树也是空的
         if (!leaf->next_.ptr && !prefix.empty())
-            GcLayerRcuCallback::make(root, prefix, ti);
+            GcLayerRcuCallback::make(table, root, prefix, ti);
         return false;
     }
 
     // mark Leaf deleted, RCU-free
     leaf->mark_deleted();
-    leaf->deallocate(ti);
+    retire_leaf(table, leaf, ti);
 
     // Ensure node that becomes responsible for
     // our keys has its phantom epoch kept up to data
@@ -368,9 +378,155 @@ void DestroyRcuCallback::operator()(ThreadInfo *ti)
     ti->dealloc(this);
 }
 
+/*
+    并行销毁：先从根开始按层展开(InterNode的孩子和Leaf中的layer都算子树)，
+    直到子树数量足够分给所有线程，展开过的节点由调用线程直接释放；
+    然后每个线程从共享的下标取子树，深度优先地释放。
+*/
+struct ParallelDestroyer
+{
+    std::vector<NodeBase *> units_;
+    volatile uint64_t next_;
+
+    ParallelDestroyer() : next_(0) {}
+
+    // layer中保存的root可能已经不是真正的root
+    static NodeBase *real_root(NodeBase *n)
+    {
+        while (!n->is_root())
+            n = n->maybe_parent();
+        return n;
+    }
+
+    // 释放n, 把它的子树放进out, 返回n是否有子树
+    static bool free_node(NodeBase *n, std::vector<NodeBase *> &out)
+    {
+        size_t old = out.size();
+        if (n->isleaf())
+        {
+            Leaf *l = static_cast<Leaf *>(n);
+            Leaf::permuter_type perm = l->permutation();
+            for (int i = 0; i != perm.size(); ++i)
+            {
+                int p = perm[i];
+                if (l->is_layer(p))
+                    out.push_back(real_root(l->lv_[p].layer()));
+            }
+            if (l->ksuf_)
+                ThreadInfo::free_block(l->ksuf_);
+            ThreadInfo::free_block(l);
+        }
+        else
+        {
+            InterNode *in = static_cast<InterNode *>(n);
+            for (int i = 0; i != in->size() + 1; ++i)
+            {
+                if (in->child_[i])
+                    out.push_back(in->child_[i]);
+            }
+            ThreadInfo::free_block(in);
+        }
+        return out.size() != old;
+    }
+
+    static bool expandable(NodeBase *n)
+    {
+        if (!n->isleaf())
+            return true;
+        Leaf *l = static_cast<Leaf *>(n);
+        Leaf::permuter_type perm = l->permutation();
+        for (int i = 0; i != perm.size(); ++i)
+        {
+            if (l->is_layer(perm[i]))
+                return true;
+        }
+        return false;
+    }
+
+    void split(NodeBase *root, size_t target)
+    {
+        units_.push_back(real_root(root));
+        bool changed = true;
+        while (units_.size() < target && changed)
+        {
+            std::vector<NodeBase *> next;
+            changed = false;
+            for (size_t i = 0; i < units_.size(); ++i)
+            {
+                if (expandable(units_[i]))
+                {
+                    free_node(units_[i], next);
+                    changed = true;
+                }
+                else
+                {
+                    next.push_back(units_[i]);
+                }
+            }
+            units_.swap(next);
+        }
+    }
+
+    void run()
+    {
+        std::vector<NodeBase *> stack;
+        while (true)
+        {
+            uint64_t i = atomic_add64(&next_, 1);
+            if (i >= units_.size())
+                break;
+            stack.push_back(units_[i]);
+            while (!stack.empty())
+            {
+                NodeBase *n = stack.back();
+                stack.pop_back();
+                free_node(n, stack);
+            }
+        }
+    }
+};
+
+void BasicTable::destroy_parallel(int nthreads, bool trim)
+{
+    // 表已经静止，过滤器和热点索引不用经过limbo
+    lf_precondition(building_filter_ == nullptr);
+    lf_precondition(fork_ == nullptr);
+    ThreadInfo::free_block(filter_);
+    filter_ = nullptr;
+    ThreadInfo::free_block(hot_);
+    hot_ = nullptr;
+    if (!root_)
+        return;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    ParallelDestroyer pd;
+    pd.split(root_, size_t(nthreads) * 8);
+    root_ = nullptr;
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < nthreads; ++i)
+        workers.push_back(std::thread(&ParallelDestroyer::run, &pd));
+    pd.run();
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+
+#if defined(__GLIBC__)
+    if (trim)
+        malloc_trim(0);
+#else
+    (void)trim;
+#endif
+}
+
 // 如果BasicTable中还有value，则value值并没有被释放 
 void BasicTable::destroy(ThreadInfo *ti)
 {
+    // 不能和rebuild_filter并发; 快照引用着表，要先release
+    lf_precondition(building_filter_ == nullptr);
+    lf_precondition(fork_ == nullptr);
+    remove_filter(ti);
+    disable_hot_index(ti);
     if (root_)
     {
         void *data = ti->alloc(sizeof(DestroyRcuCallback));
@@ -51,7 +51,8 @@ class ScanStackElt
     NodeVersion v_;
     permuter_type perm_;
     int ki_;
-    std::vector<NodeBase *> node_stack_;
+    // 每进入一层layer压入root_和n_
+    InlineVector<NodeBase *, 2 * (LF_MAXKEYLEN / 8 + 1)> node_stack_;
 
     enum
     {
@@ -94,6 +95,12 @@ struct ForwardScanHelper
         return ksuf_compare > 0 || (ksuf_compare == 0 && emit_equal);
     }
 
+    // 懒删除留下的墓碑不交给scanner
+    bool skip(bool tombstone) const
+    {
+        return tombstone;
+    }
+
     bool is_duplicate(const MtKey &k,
                       uint64_t ikey, int keylenx) const
     {
@@ -150,6 +157,11 @@ struct ReverseScanHelper
         return ksuf_compare < 0 || (ksuf_compare == 0 && emit_equal);
     }
 
+    bool skip(bool tombstone) const
+    {
+        return tombstone;
+    }
+
     bool is_duplicate(const MtKey &k, uint64_t ikey, int keylenx) const
     {
         return k.compare(ikey, keylenx) <= 0 && !upper_bound_;
@@ -198,7 +210,7 @@ struct ReverseScanHelper
             NodeVersion v = n->stable();
             N *pnext = n->safe_next();
             int cmp;
-            if (!pnext || (cmp == StringSlice::compare(k.ikey(), pnext->ikey_bound())) < 0 || (cmp == 0 && k.length() == 0))
+            if (!pnext || (cmp = StringSlice::compare(k.ikey(), pnext->ikey_bound())) < 0 || (cmp == 0 && k.length() == 0))
                 return v;
             n = pnext;
         }
@@ -220,6 +232,7 @@ int ScanStackElt::find_initial(H &helper, MtKey &ka, bool emit_equal,
 {
     KeyIndexedPosition kx;
     int keylenx = 0;
+    bool tomb = false;
     char suffixbuf[LF_MAXKEYLEN];
     Slice suffix;
 
@@ -228,13 +241,17 @@ retry_root:
 
 retry_node:
     if (v_.deleted())
+    {
+        LF_MT_COUNT(scan_retry);
         goto retry_root;
+    }
     perm_ = n_->permutation();
 
     kx = helper.lower_with_position(ka, this);
     if (kx.p >= 0)
     {
         keylenx = n_->keylenx_[kx.p];
+        tomb = n_->is_tombstone(kx.p);
         compiler_barrier();
         entry = n_->lv_[kx.p];
         if (n_->keylenx_has_ksuf(keylenx))
@@ -246,6 +263,7 @@ retry_node:
     }
     if (n_->has_changed(v_))
     {
+        LF_MT_COUNT(scan_changed);
         n_ = n_->advance_to_key(ka, v_);
         goto retry_node;
     }
@@ -260,6 +278,9 @@ retry_node:
             root_ = entry.layer();
             return scan_down;
         }
+        else if (helper.skip(tomb))
+        {
+        }
         else if (n_->keylenx_has_ksuf(keylenx))
         {
             int ksuf_compare = suffix.compare(ka.suffix());
@@ -287,6 +308,7 @@ retry:
     n_ = root_->reach_leaf(ka, v_);
     if (v_.deleted())
     {
+        LF_MT_COUNT(scan_retry);
         goto retry;
     }
 
@@ -302,6 +324,7 @@ int ScanStackElt::find_next(H &helper, MtKey &ka, LeafValue &entry)
 
     if (v_.deleted())
     {
+        LF_MT_COUNT(scan_retry);
         return scan_retry;
     }
 
@@ -312,6 +335,7 @@ retry_entry:
         uint64_t ikey = n_->ikey0_[ikp];
         int keylenx = n_->keylenx_[ikp];
         int keylen = keylenx;
+        bool tomb = n_->is_tombstone(ikp);
 
         compiler_barrier();
         entry = n_->lv_[ikp];
@@ -322,11 +346,13 @@ retry_entry:
 
         if (n_->has_changed(v_))
         {
+            LF_MT_COUNT(scan_changed);
             // ע⣺ kaĺ׺ֵѾ仯
             goto changed;
         }
         else if (helper.is_duplicate(ka, ikey, keylenx))
         {
+            LF_MT_COUNT(scan_skipped);
             ki_ = helper.next(ki_);
             goto retry_entry;
         }
@@ -344,6 +370,13 @@ retry_entry:
         else
         {
             ka.assign_store_length(keylen);
+            if (helper.skip(tomb))
+            {
+                // ka已经是这个key, 后面的去重和重新定位以它为准
+                LF_MT_COUNT(scan_skipped);
+                ki_ = helper.next(ki_);
+                goto retry_entry;
+            }
             return scan_emit;
         }
     }
@@ -369,6 +402,7 @@ int BasicTable::scan(H helper,
                      Slice firstkey, bool emit_firstkey,
                      F &scanner, ThreadInfo *ti) const
 {
+    LF_MT_COUNTERS_BIND(ti);
     union {
         uint64_t x[(LF_MAXKEYLEN + sizeof(uint64_t) - 1) / sizeof(uint64_t)];
         char s[LF_MAXKEYLEN];
@@ -0,0 +1,333 @@
+#pragma once
+
+#include "masstree/mt_scan.hh"
+#include "masstree/mt_stats.hh"
+#include "lf/hash.hh"
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+namespace lf
+{
+
+/*
+    ShardedTable: 按key区间或key的hash把数据分到N个独立的BasicTable。
+    每个shard是完整的BasicTable, 可以单独fork/freeze/rebuild_filter/
+    reclaim_tombstones/destroy_parallel, 维护一个shard不影响其他shard。
+    1. 区间分片: splits严格递增，shard i负责[splits[i-1], splits[i]), 有序scan依次扫各个shard。
+    2. hash分片: 负载更均匀，有序scan对各个shard做k路归并。
+    每个shard可以指定一个home worker, for_each_shard按它把shard分给工作线程，
+    部署成thread-per-core时同一个shard总由同一个线程(同一个NUMA节点)处理。
+    写操作用table_for(key)取得shard后照常使用TCursor。
+*/
+class ShardedTable
+{
+  public:
+    enum ShardMode
+    {
+        shard_by_range,
+        shard_by_hash
+    };
+
+    ShardedTable();
+    ~ShardedTable();
+
+    // 区间分片，shard个数是splits.size() + 1
+    void initialize_range(const std::vector<std::string> &splits, ThreadInfo *ti);
+    void initialize_hash(int nshards, ThreadInfo *ti);
+    // 每个shard按BasicTable::destroy释放(包括过滤器和热点索引), 要先release各个shard的快照
+    void destroy(ThreadInfo *ti);
+
+    ShardMode mode() const
+    {
+        return mode_;
+    }
+    int nshards() const
+    {
+        return int(shards_.size());
+    }
+    int shard_of(Slice key) const;
+    BasicTable &shard(int i)
+    {
+        return *shards_[i];
+    }
+    const BasicTable &shard(int i) const
+    {
+        return *shards_[i];
+    }
+    BasicTable &table_for(Slice key)
+    {
+        return *shards_[shard_of(key)];
+    }
+
+    void set_home(int shard, int worker)
+    {
+        homes_[shard] = worker;
+    }
+    int home(int shard) const
+    {
+        return homes_[shard];
+    }
+
+    bool get(Slice &key, LeafValue &value, ThreadInfo *ti) const;
+
+    // 与BasicTable::scan相同的语义和scanner接口，调用者需要持有LimboHandle。
+    // hash分片时每个shard按batch个key一批读出后归并，visit_value拿到的LeafValue是拷贝，
+    // 也不调用visit_leaf; 结果不是跨shard的快照
+    template <typename F>
+    int scan(Slice firstkey, bool emit_firstkey, F &scanner, ThreadInfo *ti, size_t batch = 64) const;
+
+    TableStats shard_stats(int i, ThreadInfo *ti) const
+    {
+        return shards_[i]->stats(ti);
+    }
+    // 各个shard的stats之和
+    TableStats stats(ThreadInfo *ti) const;
+
+    // 启动nthreads个线程，线程t按顺序处理home % nthreads == t的shard: f(shard, table, t)。
+    // 线程里要访问树时，t对应的ThreadInfo由调用者提供
+    template <typename F>
+    void for_each_shard(int nthreads, F f);
+
+  private:
+    ShardMode mode_;
+    std::vector<BasicTable *> shards_;
+    std::vector<std::string> splits_;
+    std::vector<int> homes_;
+
+    ShardedTable(const ShardedTable &);
+    ShardedTable &operator=(const ShardedTable &);
+
+    void make_shards(int n, ThreadInfo *ti);
+
+    template <typename F>
+    struct StopTracker
+    {
+        F &scanner_;
+        bool stopped_;
+
+        void visit_leaf(const ScanStackElt &stack, const MtKey &ka, ThreadInfo *ti)
+        {
+            scanner_.visit_leaf(stack, ka, ti);
+        }
+
+        bool visit_value(Slice key, LeafValue &value, ThreadInfo *ti)
+        {
+            stopped_ = !scanner_.visit_value(key, value, ti);
+            return !stopped_;
+        }
+    };
+
+    // 归并时每个shard的读取位置
+    struct MergeCursor
+    {
+        std::vector<std::string> keys_;
+        std::vector<LeafValue> values_;
+        size_t limit_;
+        size_t pos_;
+        bool more_;
+
+        void visit_leaf(const ScanStackElt &, const MtKey &, ThreadInfo *)
+        {
+        }
+
+        bool visit_value(Slice key, LeafValue &value, ThreadInfo *)
+        {
+            keys_.push_back(std::string(key.data(), key.size()));
+            values_.push_back(value);
+            return keys_.size() < limit_;
+        }
+
+        void fill(const BasicTable &t, Slice from, bool emit, size_t batch, ThreadInfo *ti)
+        {
+            keys_.clear();
+            values_.clear();
+            limit_ = batch;
+            pos_ = 0;
+            t.scan(from, emit, *this, ti);
+            more_ = keys_.size() == limit_;
+        }
+
+        Slice key() const
+        {
+            return Slice(keys_[pos_]);
+        }
+    };
+
+    struct MergeGreater
+    {
+        const MergeCursor *c_;
+
+        bool operator()(int a, int b) const
+        {
+            return c_[a].key().compare(c_[b].key()) > 0;
+        }
+    };
+};
+
+ShardedTable::ShardedTable()
+    : mode_(shard_by_range)
+{
+}
+
+ShardedTable::~ShardedTable()
+{
+    lf_precondition(shards_.empty());
+}
+
+void ShardedTable::make_shards(int n, ThreadInfo *ti)
+{
+    lf_precondition(n > 0 && shards_.empty());
+    for (int i = 0; i < n; ++i)
+    {
+        BasicTable *t = new BasicTable();
+        t->initialize(ti);
+        shards_.push_back(t);
+        homes_.push_back(i);
+    }
+}
+
+void ShardedTable::initialize_range(const std::vector<std::string> &splits, ThreadInfo *ti)
+{
+    for (size_t i = 1; i < splits.size(); ++i)
+        lf_precondition(Slice(splits[i - 1]).compare(Slice(splits[i])) < 0);
+    mode_ = shard_by_range;
+    splits_ = splits;
+    make_shards(int(splits.size()) + 1, ti);
+}
+
+void ShardedTable::initialize_hash(int nshards, ThreadInfo *ti)
+{
+    mode_ = shard_by_hash;
+    splits_.clear();
+    make_shards(nshards, ti);
+}
+
+void ShardedTable::destroy(ThreadInfo *ti)
+{
+    for (size_t i = 0; i < shards_.size(); ++i)
+    {
+        shards_[i]->destroy(ti);
+        delete shards_[i];
+    }
+    shards_.clear();
+    homes_.clear();
+    splits_.clear();
+}
+
+int ShardedTable::shard_of(Slice key) const
+{
+    if (mode_ == shard_by_hash)
+        return int((uint64_t(slice_hash(key.data(), key.size())) * shards_.size()) >> 32);
+
+    // 第一个大于key的分界点的下标就是shard号
+    int lo = 0, hi = int(splits_.size());
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (key.compare(Slice(splits_[mid])) < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+bool ShardedTable::get(Slice &key, LeafValue &value, ThreadInfo *ti) const
+{
+    return shards_[shard_of(key)]->get(key, value, ti);
+}
+
+template <typename F>
+int ShardedTable::scan(Slice firstkey, bool emit_firstkey, F &scanner, ThreadInfo *ti, size_t batch) const
+{
+    int count = 0;
+    if (mode_ == shard_by_range)
+    {
+        StopTracker<F> st = {scanner, false};
+        for (int i = shard_of(firstkey); i < nshards() && !st.stopped_; ++i)
+        {
+            count += shards_[i]->scan(firstkey, emit_firstkey, st, ti);
+            // 后面的shard中的key都大于firstkey
+            firstkey = Slice();
+            emit_firstkey = true;
+        }
+        return count;
+    }
+
+    lf_precondition(batch > 0);
+    int n = nshards();
+    std::vector<MergeCursor> cursors(n);
+    std::vector<int> heap;
+    for (int i = 0; i < n; ++i)
+    {
+        cursors[i].fill(*shards_[i], firstkey, emit_firstkey, batch, ti);
+        if (!cursors[i].keys_.empty())
+            heap.push_back(i);
+    }
+    MergeGreater greater = {cursors.data()};
+    std::make_heap(heap.begin(), heap.end(), greater);
+
+    std::string last;
+    while (!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        int i = heap.back();
+        MergeCursor &c = cursors[i];
+        ++count;
+        LeafValue value = c.values_[c.pos_];
+        if (!scanner.visit_value(c.key(), value, ti))
+            break;
+
+        if (++c.pos_ == c.keys_.size())
+        {
+            if (!c.more_)
+            {
+                heap.pop_back();
+                continue;
+            }
+            last.swap(c.keys_.back());
+            c.fill(*shards_[i], Slice(last), false, batch, ti);
+            if (c.keys_.empty())
+            {
+                heap.pop_back();
+                continue;
+            }
+        }
+        std::push_heap(heap.begin(), heap.end(), greater);
+    }
+    return count;
+}
+
+template <typename F>
+void ShardedTable::for_each_shard(int nthreads, F f)
+{
+    lf_precondition(nthreads > 0);
+    struct Worker
+    {
+        static void run(ShardedTable *st, F *f, int nthreads, int t)
+        {
+            for (int i = 0; i < st->nshards(); ++i)
+                if (st->home(i) % nthreads == t)
+                    (*f)(i, st->shard(i), t);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < nthreads; ++t)
+        workers.push_back(std::thread(&Worker::run, this, &f, nthreads, t));
+    Worker::run(this, &f, nthreads, 0);
+    for (size_t t = 0; t < workers.size(); ++t)
+        workers[t].join();
+}
+
+TableStats ShardedTable::stats(ThreadInfo *ti) const
+{
+    TableStats s;
+    for (int i = 0; i < nshards(); ++i)
+        s += shards_[i]->stats(ti);
+    return s;
+}
+
+} // namespace lf
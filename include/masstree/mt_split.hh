@@ -178,6 +178,7 @@ bool TCursor::make_split(ThreadInfo *ti)
         }
     }
 
+    LF_MT_COUNT(leaf_splits);
     NodeBase *child = Leaf::make(n_->ksuf_used_capacity(), n_->phantom_epoch(), ti);
     child->assign_version(*n_);
     uint64_t xikey[2];
@@ -222,6 +223,7 @@ bool TCursor::make_split(ThreadInfo *ti)
         {
             if (p->size() >= p->width)
             {
+                LF_MT_COUNT(internode_splits);
                 next_child = InterNode::make(height + 1, ti);
                 next_child->assign_version(*p);
                 next_child->mark_nonroot();
@@ -252,6 +254,7 @@ bool TCursor::make_split(ThreadInfo *ti)
             }
             nl->mark_split();
             nl->permutation_ = perml.value();
+            nl->compact_ksuf(ti);
             if (split_type == 0)
             {
                 kx_.p = perml.back();
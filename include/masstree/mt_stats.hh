@@ -0,0 +1,286 @@
+#pragma once
+
+#include "masstree/mt_struct.hh"
+#include "lf/random.hh"
+#include <stdio.h>
+#include <inttypes.h>
+#include <algorithm>
+
+namespace lf
+{
+
+/*
+    TableStats的遍历。节点只做乐观读，不加锁，并发修改时结果是近似的。
+    每个节点按权重w计入：完整遍历时w总是1;
+    抽样时w是从根到这个节点路径上各层分支数的乘积，即到达这个节点概率的倒数(Knuth估计)，
+    所以每次抽样的结果都是全树统计量的无偏估计。
+    layer的大小很不均匀时(比如少数Leaf下面挂着很大的layer)估计的方差很大，需要更多的抽样。
+*/
+class TableStatsWalker
+{
+  public:
+    explicit TableStatsWalker(TableStats &s) : s_(s) {}
+
+    void walk_layer(NodeBase *root, int depth)
+    {
+        add_layer(depth, 1);
+        walk(root, depth, 0);
+    }
+
+    void sample_layer(NodeBase *root, int depth, Random &rnd)
+    {
+        double w = 1;
+        add_layer(depth, w);
+        NodeBase *n = root;
+        int level = 0;
+        while (true)
+        {
+            if (!n->isleaf())
+            {
+                InterNode *in = static_cast<InterNode *>(n);
+                int nchild = internode_children(in, children_);
+                add_internode(w);
+                if (!nchild)
+                    return;
+                w *= nchild;
+                n = children_[rnd.uniform(nchild)];
+                ++level;
+                continue;
+            }
+
+            int nlayer = add_leaf(static_cast<Leaf *>(n), depth, level, w);
+            if (!nlayer || depth + 1 >= TableStats::max_layer_depth)
+                return;
+            w *= nlayer;
+            n = layer_root(layers_[rnd.uniform(nlayer)]);
+            ++depth;
+            level = 0;
+            add_layer(depth, w);
+        }
+    }
+
+    // 乘了权重的累加值，抽样结束后除以抽样次数写回s_
+    void finish(double scale)
+    {
+        s_.layers = round(layers_sum_ * scale);
+        s_.leaves = round(leaves_sum_ * scale);
+        s_.internodes = round(internodes_sum_ * scale);
+        s_.keys = round(keys_sum_ * scale);
+        for (int i = 0; i < TableStats::max_layer_depth; ++i)
+            s_.layers_at_depth[i] = round(at_depth_sum_[i] * scale);
+        for (int i = 0; i < TableStats::fill_buckets; ++i)
+            s_.fill[i] = round(fill_sum_[i] * scale);
+        s_.leaf_bytes = round(leaf_bytes_sum_ * scale);
+        s_.internode_bytes = round(internode_bytes_sum_ * scale);
+        s_.iksuf_bytes = round(iksuf_bytes_sum_ * scale);
+        s_.iksuf_used = round(iksuf_used_sum_ * scale);
+        s_.ksuf_bytes = round(ksuf_bytes_sum_ * scale);
+        s_.ksuf_used = round(ksuf_used_sum_ * scale);
+        s_.ksufs = round(ksufs_sum_ * scale);
+    }
+
+  private:
+    TableStats &s_;
+    NodeBase *children_[InterNode::width + 1];
+    NodeBase *layers_[Leaf::width];
+    double layers_sum_ = 0;
+    double leaves_sum_ = 0;
+    double internodes_sum_ = 0;
+    double keys_sum_ = 0;
+    double at_depth_sum_[TableStats::max_layer_depth] = {};
+    double fill_sum_[TableStats::fill_buckets] = {};
+    double leaf_bytes_sum_ = 0;
+    double internode_bytes_sum_ = 0;
+    double iksuf_bytes_sum_ = 0;
+    double iksuf_used_sum_ = 0;
+    double ksuf_bytes_sum_ = 0;
+    double ksuf_used_sum_ = 0;
+    double ksufs_sum_ = 0;
+
+    static uint64_t round(double x)
+    {
+        return uint64_t(x + 0.5);
+    }
+
+    static NodeBase *layer_root(NodeBase *n)
+    {
+        while (!n->is_root())
+            n = n->maybe_parent();
+        return n;
+    }
+
+    static int internode_children(const InterNode *in, NodeBase **children)
+    {
+        int nchild;
+        NodeVersion v;
+        do
+        {
+            v = in->stable();
+            nchild = in->size() + 1;
+            memcpy(children, in->child_, sizeof(NodeBase *) * nchild);
+        } while (in->has_changed(v));
+
+        // 分裂中间可能看到还没有填上的孩子
+        int k = 0;
+        for (int i = 0; i < nchild; ++i)
+            if (children[i])
+                children[k++] = children[i];
+        return k;
+    }
+
+    void add_layer(int depth, double w)
+    {
+        layers_sum_ += w;
+        at_depth_sum_[depth] += w;
+    }
+
+    void add_internode(double w)
+    {
+        internodes_sum_ += w;
+        internode_bytes_sum_ += w * sizeof(InterNode);
+    }
+
+    // 计入一个Leaf, 把它的layer指针放到layers_中，返回个数
+    int add_leaf(Leaf *n, int depth, int level, double w)
+    {
+        NodeVersion v;
+        int nkeys, nlayer;
+        do
+        {
+            v = n->stable();
+            Leaf::permuter_type perm = n->permutation();
+            nkeys = perm.size();
+            nlayer = 0;
+            for (int i = 0; i < nkeys; ++i)
+            {
+                int p = perm[i];
+                if (n->is_layer(p))
+                    layers_[nlayer++] = n->lv_[p].layer();
+            }
+        } while (n->has_changed(v));
+
+        if (uint32_t(level + 1) > s_.height_at_depth[depth])
+            s_.height_at_depth[depth] = level + 1;
+        if (depth > int(s_.max_depth))
+            s_.max_depth = depth;
+
+        leaves_sum_ += w;
+        keys_sum_ += w * (nkeys - nlayer);
+        fill_sum_[nkeys] += w;
+        leaf_bytes_sum_ += w * n->allocated_size();
+        if (n->extrasize64_ > 0)
+        {
+            iksuf_bytes_sum_ += w * n->iksuf_[0].capacity();
+            iksuf_used_sum_ += w * n->iksuf_[0].used_capacity();
+        }
+        // 换下来的ksuf_在grace period之后才释放，持有handle时可以安全地读
+        Leaf::external_ksuf_type *ksuf = n->ksuf_;
+        acquire_fence();
+        if (ksuf)
+        {
+            ksuf_bytes_sum_ += w * ksuf->capacity();
+            ksuf_used_sum_ += w * ksuf->used_capacity();
+            ksufs_sum_ += w;
+        }
+        return nlayer;
+    }
+
+    void walk(NodeBase *n, int depth, int level)
+    {
+        if (!n->isleaf())
+        {
+            NodeBase *children[InterNode::width + 1];
+            int nchild = internode_children(static_cast<InterNode *>(n), children);
+            add_internode(1);
+            for (int i = 0; i < nchild; ++i)
+                walk(children[i], depth, level + 1);
+            return;
+        }
+
+        int nlayer = add_leaf(static_cast<Leaf *>(n), depth, level, 1);
+        if (depth + 1 >= TableStats::max_layer_depth)
+            return;
+        NodeBase *layers[Leaf::width];
+        memcpy(layers, layers_, sizeof(NodeBase *) * nlayer);
+        for (int i = 0; i < nlayer; ++i)
+            walk_layer(layer_root(layers[i]), depth + 1);
+    }
+};
+
+TableStats BasicTable::stats(ThreadInfo *) const
+{
+    TableStats s;
+    TableStatsWalker w(s);
+    w.walk_layer(root(), 0);
+    w.finish(1);
+    return s;
+}
+
+TableStats BasicTable::sample_stats(int samples, ThreadInfo *, uint32_t seed) const
+{
+    lf_precondition(samples > 0);
+    TableStats s;
+    s.sampled = true;
+    s.samples = samples;
+    Random rnd(seed);
+    TableStatsWalker w(s);
+    for (int i = 0; i < samples; ++i)
+        w.sample_layer(root(), 0, rnd);
+    w.finish(1.0 / samples);
+    return s;
+}
+
+TableStats &TableStats::operator+=(const TableStats &x)
+{
+    sampled = sampled || x.sampled;
+    samples = std::max(samples, x.samples);
+    layers += x.layers;
+    leaves += x.leaves;
+    internodes += x.internodes;
+    keys += x.keys;
+    max_depth = std::max(max_depth, x.max_depth);
+    for (int i = 0; i < max_layer_depth; ++i)
+    {
+        layers_at_depth[i] += x.layers_at_depth[i];
+        height_at_depth[i] = std::max(height_at_depth[i], x.height_at_depth[i]);
+    }
+    for (int i = 0; i < fill_buckets; ++i)
+        fill[i] += x.fill[i];
+    leaf_bytes += x.leaf_bytes;
+    internode_bytes += x.internode_bytes;
+    iksuf_bytes += x.iksuf_bytes;
+    iksuf_used += x.iksuf_used;
+    ksuf_bytes += x.ksuf_bytes;
+    ksuf_used += x.ksuf_used;
+    ksufs += x.ksufs;
+    return *this;
+}
+
+void TableStats::print(FILE *f) const
+{
+    f = f ? f : stdout;
+    fprintf(f, "%s: %" PRIu64 " keys, %" PRIu64 " layers, %" PRIu64 " leaves, %" PRIu64 " internodes",
+            sampled ? "sampled stats" : "stats", keys, layers, leaves, internodes);
+    if (sampled)
+        fprintf(f, " (%u samples)", samples);
+    fprintf(f, "\n");
+
+    for (uint32_t d = 0; d <= max_depth; ++d)
+        fprintf(f, "  depth %u: %" PRIu64 " layers, height %u\n",
+                d, layers_at_depth[d], height_at_depth[d]);
+
+    uint64_t slots = 0;
+    for (int i = 0; i < fill_buckets; ++i)
+        slots += fill[i] * i;
+    fprintf(f, "  fill factor %.1f%%:", leaves ? 100.0 * slots / (leaves * Leaf::width) : 0.0);
+    for (int i = 0; i < fill_buckets; ++i)
+        fprintf(f, " %" PRIu64, fill[i]);
+    fprintf(f, "\n");
+
+    fprintf(f, "  bytes: leaf %" PRIu64 ", internode %" PRIu64 ", ksuf %" PRIu64 "/%" PRIu64
+               " (internal %" PRIu64 "/%" PRIu64 "), total %" PRIu64 "\n",
+            leaf_bytes, internode_bytes, ksuf_used, ksuf_bytes,
+            iksuf_used, iksuf_bytes, total_bytes());
+}
+
+} // namespace lf
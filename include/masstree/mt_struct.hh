@@ -244,6 +244,7 @@ class Leaf : public NodeBase
     int8_t extrasize64_;
     uint8_t modstate_;
     uint8_t keylenx_[width];
+    uint16_t tomb_; // 懒删除留下的墓碑，每个槽位一位，只对permutation中的槽位有意义
     Kpermuter::storage_type permutation_;
     uint64_t ikey0_[width];
     LeafValue lv_[width];
@@ -260,7 +261,7 @@ class Leaf : public NodeBase
     Leaf(size_t sz, phantom_epoch_type p_phantom_epoch)
         : NodeBase(true),
           modstate_(modstate_insert),
-          permutation_(Kpermuter::make_empty()),
+          tomb_(0), permutation_(Kpermuter::make_empty()),
           ksuf_(), parent_(), iksuf_{}
     {
         lf_precondition(sz % 64 == 0 && sz / 64 < 128);
@@ -381,6 +382,22 @@ class Leaf : public NodeBase
         return keylenx_is_layer(keylenx_[p]);
     }
 
+    // 墓碑只在持有锁时修改，并且不改版本。
+    // 复活时先写lv_再清位，读者要先读墓碑再读lv_(中间compiler_barrier), 见find_unlocked
+    bool is_tombstone(int p) const
+    {
+        return tomb_ & (1U << p);
+    }
+    void set_tombstone(int p)
+    {
+        tomb_ |= uint16_t(1U << p);
+    }
+    void clear_tombstone(int p)
+    {
+        compiler_barrier();
+        tomb_ &= uint16_t(~(1U << p));
+    }
+
     bool has_ksuf(int p) const
     {
         return keylenx_has_ksuf(keylenx_[p]);
@@ -480,7 +497,7 @@ class Leaf : public NodeBase
     void deallocate(ThreadInfo *ti)
     {
         if (ksuf_)
-            ti->dealloc(ksuf_);
+            ti->dealloc(ksuf_, ThreadInfo::pool_tag(ksuf_->capacity()));
         if (extrasize64_ != 0)
             iksuf_[0].~Stringbag();
         ti->dealloc(this);
@@ -497,6 +514,7 @@ class Leaf : public NodeBase
 
     inline void assign(int p, const MtKey &ka, ThreadInfo *ti)
     {
+        clear_tombstone(p);
         lv_[p] = LeafValue::make_empty();
         ikey0_[p] = ka.ikey();
         if (!ka.has_suffix())
@@ -510,6 +528,7 @@ class Leaf : public NodeBase
 
     inline void assign_initialize(int p, const MtKey &ka, ThreadInfo *ti)
     {
+        clear_tombstone(p);
         lv_[p] = LeafValue::make_empty();
         ikey0_[p] = ka.ikey();
         if (!ka.has_suffix())
@@ -523,6 +542,10 @@ class Leaf : public NodeBase
 
     inline void assign_initialize(int p, Leaf *x, int xp, ThreadInfo *ti)
     {
+        if (x->is_tombstone(xp))
+            set_tombstone(p);
+        else
+            clear_tombstone(p);
         lv_[p] = x->lv_[xp];
         ikey0_[p] = x->ikey0_[xp];
         keylenx_[p] = x->keylenx_[xp];
@@ -533,11 +556,15 @@ class Leaf : public NodeBase
     inline void assign_initialize_for_layer(int p, const MtKey &ka)
     {
         assert(ka.has_suffix());
+        clear_tombstone(p);
         ikey0_[p] = ka.ikey();
         keylenx_[p] = layer_keylenx;
     }
 
     void assign_ksuf(int p, Slice s, bool initializing, ThreadInfo *to);
+    external_ksuf_type *make_ksuf(size_t len, const external_ksuf_type *oksuf,
+                                  ThreadInfo *ti);
+    void compact_ksuf(ThreadInfo *ti);
 
     inline uint64_t ikey_after_insert(const permuter_type &perm, int i,
                                       const MtKey &ka, int ka_i) const;
@@ -621,6 +648,7 @@ inline Leaf *Leaf::advance_to_key(const MtKey &ka, NodeVersion &v) const
                (next = n->safe_next()) &&
                StringSlice::compare(ka.ikey(), next->ikey_bound()) >= 0)
         {
+            LF_MT_COUNT(advance_hops);
             n = next;
             v = n->stable();
         }
@@ -648,12 +676,7 @@ void Leaf::assign_ksuf(int p, Slice s, bool initializing, ThreadInfo *ti)
             csz += ksuf(mp).size();
     }
 
-    size_t sz = iceil_log2(external_ksuf_type::safe_size(width, csz + s.size()));
-    if (oksuf)
-        sz = std::max(sz, oksuf->capacity());
-
-    void *ptr = ti->alloc(sz);
-    external_ksuf_type *nksuf = new (ptr) external_ksuf_type(width, sz);
+    external_ksuf_type *nksuf = make_ksuf(csz + s.size(), oksuf, ti);
     for (int i = 0; i < n; ++i)
     {
         int mp = initializing ? i : perm[i];
@@ -679,13 +702,81 @@ void Leaf::assign_ksuf(int p, Slice s, bool initializing, ThreadInfo *ti)
         extrasize64_ = -extrasize64_ - 1;
 
     if (oksuf)
-        ti->dealloc(oksuf);
+        ti->dealloc(oksuf, ThreadInfo::pool_tag(oksuf->capacity()));
+}
+
+Leaf::external_ksuf_type *Leaf::make_ksuf(size_t len, const external_ksuf_type *oksuf,
+                                          ThreadInfo *ti)
+{
+    // 多留一半的空间，长key连续插入时不必每次都重新分配和拷贝
+    size_t need = external_ksuf_type::safe_size(width, len);
+    size_t sz = iceil_log2(need + len / 2);
+    if (oksuf)
+        sz = std::max(sz, oksuf->capacity());
+    sz = std::max(std::min(sz, size_t(external_ksuf_type::max_size())), need);
+
+    // 小的bag从线程的内存池中分配，回收时也回到内存池
+    void *ptr = ti->alloc(sz, ThreadInfo::pool_tag(sz));
+    return new (ptr) external_ksuf_type(width, sz);
+}
+
+/*
+    分裂之后左边Leaf的外部bag里还留着移走的后缀，
+    死掉的部分超过一半时重新拷贝一份紧凑的bag。
+    @pre this->locked() && 已经设置了分裂后的permutation_
+*/
+void Leaf::compact_ksuf(ThreadInfo *ti)
+{
+    if (!ksuf_)
+        return;
+
+    permuter_type perm(permutation_);
+    size_t live = 0;
+    for (int i = 0; i < perm.size(); ++i)
+    {
+        if (has_ksuf(perm[i]))
+            live += ksuf(perm[i]).size();
+    }
+    size_t used = ksuf_->used_capacity() - external_ksuf_type::overhead(width);
+    if (live * 2 >= used)
+        return;
+
+    external_ksuf_type *oksuf = ksuf_;
+    size_t need = external_ksuf_type::safe_size(width, live);
+    size_t sz = iceil_log2(need + live / 2);
+    void *ptr = ti->alloc(sz, ThreadInfo::pool_tag(sz));
+    external_ksuf_type *nksuf = new (ptr) external_ksuf_type(width, sz);
+    for (int i = 0; i < perm.size(); ++i)
+    {
+        int mp = perm[i];
+        if (has_ksuf(mp))
+        {
+            bool ok = nksuf->assign(mp, oksuf->get(mp));
+            assert(ok);
+            (void)ok;
+        }
+    }
+    compiler_barrier();
+    ksuf_ = nksuf;
+    compiler_barrier();
+    ti->dealloc(oksuf, ThreadInfo::pool_tag(oksuf->capacity()));
 }
 
 BasicTable::BasicTable()
-    : root_(nullptr)
+    : root_(nullptr), fork_(nullptr), cdc_(nullptr),
+      filter_(nullptr), building_filter_(nullptr), hot_(nullptr),
+      leaf_gen_(0), tombstones_(0), lazy_delete_(false)
 {}
 
+inline void BasicTable::retire_leaf(Leaf *leaf, ThreadInfo *ti)
+{
+    // 先摘下(删除)Leaf再读hot_, 与get中先读hot_再下降配合
+    memory_fence();
+    if (unlikely(hot_ != nullptr))
+        atomic_add64(&leaf_gen_, 1);
+    leaf->deallocate(ti);
+}
+
 inline NodeBase *BasicTable::root() const
 {
     return root_;
@@ -758,7 +849,10 @@ retry:
         int kp = InterNode::bound_type::upper(ka, *in);
         n[!sense] = in->child_[kp];
         if (!n[!sense])
+        {
+            LF_MT_COUNT(reach_leaf_retry);
             goto retry;
+        }
         v[!sense] = n[!sense]->stable();
 
         if (likely(!in->has_changed(v[sense])))
@@ -773,11 +867,13 @@ retry:
             in->stable_last_key_compare(ka, v[sense]) > 0)
         {
             // root retry
+            LF_MT_COUNT(reach_leaf_retry);
             goto retry;
         }
         else
         {
             // internode retry
+            LF_MT_COUNT(internode_retry);
         }
     }
 
@@ -1,7 +1,8 @@
 #pragma once
 
 #include "masstree/mt_struct.hh"
-#include <vector>
+#include "lf/inline_vector.hh"
+#include <utility>
 
 namespace lf
 {
@@ -13,13 +14,13 @@ class UnlockedTCursor
     typedef Kpermuter permuter_type;
 
     UnlockedTCursor(const BasicTable& table, Slice str)
-        : n_(nullptr), ka_(str), lv_(LeafValue::make_empty()), root_(table.root()){}
+        : n_(nullptr), ka_(str), lv_(LeafValue::make_empty()), slot_(-1), root_(table.root()){}
     UnlockedTCursor(BasicTable& table, Slice str)
-        : n_(nullptr), ka_(str), lv_(LeafValue::make_empty()), root_(table.fix_root()) {}
+        : n_(nullptr), ka_(str), lv_(LeafValue::make_empty()), slot_(-1), root_(table.fix_root()) {}
     UnlockedTCursor(const BasicTable& table, const char *s, int len)
-        : n_(nullptr), ka_(s, len), lv_(LeafValue::make_empty()), root_(table.root()){}
+        : n_(nullptr), ka_(s, len), lv_(LeafValue::make_empty()), slot_(-1), root_(table.root()){}
     UnlockedTCursor(BasicTable& table, const char *s, int len)
-        : n_(nullptr), ka_(s, len), lv_(LeafValue::make_empty()), root_(table.fix_root()) {}
+        : n_(nullptr), ka_(s, len), lv_(LeafValue::make_empty()), slot_(-1), root_(table.fix_root()) {}
 
     bool find_unlocked(ThreadInfo *ti);
 
@@ -33,6 +34,21 @@ class UnlockedTCursor
         return n_;
     }
 
+    // 找到时key在node()中的位置，以及读到它时node()的版本
+    inline int slot() const
+    {
+        return slot_;
+    }
+    inline NodeVersion version() const
+    {
+        return v_;
+    }
+    // 找到时key已经跳过的字节数(每个layer 8字节)
+    inline int shift() const
+    {
+        return int(ka_.full_string().size()) - ka_.length();
+    }
+
     inline permuter_type permutation() const
     {
         return perm_;
@@ -53,6 +69,7 @@ class UnlockedTCursor
     NodeVersion v_;
     permuter_type perm_;
     LeafValue lv_;
+    int slot_;
     const NodeBase *root_;
 };
 
@@ -60,26 +77,32 @@ class TCursor
 {
   public:
     typedef Kpermuter permuter_type;
-    typedef std::vector<std::pair<Leaf *, uint64_t>> new_nodes_type;
+    // 每个layer最多一个新Leaf, 再加上分裂和finish各一个
+    typedef InlineVector<std::pair<Leaf *, uint64_t>, LF_MAXKEYLEN / 8 + 2> new_nodes_type;
 
     TCursor(BasicTable &table, Slice str)
-        : ka_(str), root_(table.fix_root())
+        : ka_(str), root_(table.fix_root()), table_(&table), snap_(nullptr), feed_ti_(nullptr)
     {
     }
     TCursor(BasicTable &table, const char *s, int len)
-        : ka_(s, len), root_(table.fix_root())
+        : ka_(s, len), root_(table.fix_root()), table_(&table), snap_(nullptr), feed_ti_(nullptr)
     {
     }
     TCursor(BasicTable &table, const unsigned char *s, int len)
-        : ka_(reinterpret_cast<const char *>(s), len), root_(table.fix_root())
+        : ka_(reinterpret_cast<const char *>(s), len), root_(table.fix_root()), table_(&table), snap_(nullptr), feed_ti_(nullptr)
     {
     }
     TCursor(NodeBase *root, const char *s, int len)
-        : ka_(s, len), root_(root)
+        : ka_(s, len), root_(root), table_(nullptr), snap_(nullptr), feed_ti_(nullptr)
+    {
+    }
+    // table中某个layer的根, GcLayerRcuCallback用
+    TCursor(BasicTable *table, NodeBase *root, const char *s, int len)
+        : ka_(s, len), root_(root), table_(table), snap_(nullptr), feed_ti_(nullptr)
     {
     }
     TCursor(NodeBase *root, const unsigned char *s, int len)
-        : ka_(reinterpret_cast<const char *>(s), len), root_(root)
+        : ka_(reinterpret_cast<const char *>(s), len), root_(root), table_(nullptr), snap_(nullptr), feed_ti_(nullptr)
     {
     }
 
@@ -90,6 +113,8 @@ class TCursor
 
     inline LeafValue &value() const
     {
+        if (unlikely(snap_ != nullptr) && state_ == 1)
+            return snap_value_;
         return n_->lv_[kx_.p];
     }
 
@@ -123,11 +148,26 @@ class TCursor
         return new_nodes_;
     }
 
+    // 变更流的记录写进owner的环而不是当前线程的, 代别的线程写入时(FlatCombiner)用;
+    // owner必须已经为这次写入reserve过, 并且在写入完成前不会使用自己的环
+    inline void set_feed_owner(ThreadInfo *owner)
+    {
+        feed_ti_ = owner;
+    }
+
     inline bool find_locked(ThreadInfo *ti);
     inline bool find_insert(ThreadInfo *ti);
 
+    // answer: 1 提交插入/更新，0 不修改，-1 删除(懒删除模式下只留下墓碑)，
+    //         -2 物理删除，也用于删除find_locked遇到的墓碑
     inline void finish(int answer, ThreadInfo *ti);
 
+    // find_locked/find_insert找到的是墓碑
+    inline bool tombstoned() const
+    {
+        return state_ == 4;
+    }
+
     inline uint64_t previous_full_version_value() const;
     inline uint64_t next_full_version_value(int state) const;
 
@@ -136,7 +176,11 @@ class TCursor
     MtKey ka_;
     KeyIndexedPosition kx_;
     NodeBase *root_;
+    BasicTable *table_;
     int state_;
+    TableSnapshot *snap_; // find_locked时表的快照, 只有修改(finish的state不为0)才记录
+    mutable LeafValue snap_value_;
+    ThreadInfo *feed_ti_; // 见set_feed_owner
 
     Leaf *original_n_;
     uint64_t original_v_;
@@ -156,8 +200,16 @@ class TCursor
 
     static void redirect(InterNode *n, uint64_t ikey,
                          uint64_t replacement, ThreadInfo *ti);
-    static bool remove_leaf(Leaf *leaf, NodeBase *root,
+    static bool remove_leaf(BasicTable *table, Leaf *leaf, NodeBase *root,
                             Slice prefix, ThreadInfo *ti);
+    // table为nullptr时(只有根节点的游标)直接回收
+    static void retire_leaf(BasicTable *table, Leaf *leaf, ThreadInfo *ti)
+    {
+        if (table)
+            table->retire_leaf(leaf, ti);
+        else
+            leaf->deallocate(ti);
+    }
 
     bool gc_layer(ThreadInfo *ti);
 
@@ -174,7 +226,8 @@ inline uint64_t TCursor::next_full_version_value(int state) const
     NodeVersion v(*n_);
     v.unlock();
     uint64_t result = (v.version_value() << Leaf::permuter_type::size_bits) + n_->size();
-    if (state < 0 && (state_ & 1))
+    if ((state < 0 && state_ == 1 && (state == -2 || !table_ || !table_->lazy_delete())) ||
+        (state == -2 && state_ == 4))
         return result - 1;
     else if (state > 0 && state_ == 2)
         return result + 1;
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "masstree/mt_tcursor.hh"
+#include "masstree/mt_scan.hh"
+#include <string>
+#include <vector>
+#include <thread>
+#include <unistd.h>
+
+namespace lf
+{
+
+// 与ForwardScanHelper相同，只是反过来只交出墓碑
+struct TombstoneScanHelper : public ForwardScanHelper
+{
+    bool skip(bool tombstone) const
+    {
+        return !tombstone;
+    }
+};
+
+// key后面留出8字节，equals_sloppy按8字节读
+struct TombstoneCollector
+{
+    std::vector<std::string> *keys_;
+    size_t limit_;
+
+    void visit_leaf(const ScanStackElt &, const MtKey &, ThreadInfo *)
+    {
+    }
+
+    bool visit_value(Slice key, LeafValue &, ThreadInfo *)
+    {
+        keys_->push_back(std::string(key.data(), key.size()));
+        keys_->back().append(8, '\0');
+        return keys_->size() < limit_;
+    }
+};
+
+/*
+    每批先在一个handle内scan出最多batch个墓碑，再逐个加锁确认后物理删除。
+    scan和加锁之间key可能被重新插入(墓碑被清掉)或已经被别的线程回收，
+    这时find_locked看到的不再是墓碑，finish(0)什么都不做。
+    tombstones_为0时不扫描，后台线程在没有墓碑的大表上不会一直扫表。
+*/
+size_t BasicTable::reclaim_tombstones(ThreadInfo *ti, size_t batch)
+{
+    lf_precondition(batch > 0);
+    if (atomic_load_acquire(&tombstones_) == 0)
+        return 0;
+    std::vector<std::string> keys;
+    std::string from;
+    bool emit_from = true;
+    size_t removed = 0;
+
+    while (true)
+    {
+        keys.clear();
+        LimboHandle *handle = ti->new_handle();
+        TombstoneCollector c = {&keys, batch};
+        scan(TombstoneScanHelper(), Slice(from), emit_from, c, ti);
+
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            TCursor lp(*this, Slice(keys[i].data(), keys[i].size() - 8));
+            lp.find_locked(ti);
+            if (lp.tombstoned())
+                ++removed;
+            lp.finish(lp.tombstoned() ? -2 : 0, ti);
+        }
+        ti->delete_handle(handle);
+
+        if (keys.size() < batch)
+            break;
+        from.swap(keys.back());
+        from.resize(from.size() - 8);
+        emit_from = false;
+    }
+    return removed;
+}
+
+/*
+    TombstoneReclaimer: 后台线程，每interval_ms毫秒调用一次reclaim_tombstones, 表中没有墓碑时这一轮不扫描。
+    ti只能给这个后台线程使用；stop之后才能销毁table。
+*/
+class TombstoneReclaimer
+{
+  public:
+    TombstoneReclaimer(BasicTable &table, ThreadInfo *ti, int interval_ms = 10, size_t batch = 256)
+        : table_(table), ti_(ti), interval_ms_(interval_ms), batch_(batch),
+          stop_(false), reclaimed_(0)
+    {
+    }
+
+    ~TombstoneReclaimer()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        lf_precondition(!thread_.joinable());
+        stop_ = false;
+        thread_ = std::thread(&TombstoneReclaimer::run, this);
+    }
+
+    // 停止之前再回收一轮
+    void stop()
+    {
+        if (!thread_.joinable())
+            return;
+        stop_ = true;
+        thread_.join();
+    }
+
+    uint64_t reclaimed() const
+    {
+        return reclaimed_;
+    }
+
+  private:
+    BasicTable &table_;
+    ThreadInfo *ti_;
+    int interval_ms_;
+    size_t batch_;
+    volatile bool stop_;
+    volatile uint64_t reclaimed_;
+    std::thread thread_;
+
+    TombstoneReclaimer(const TombstoneReclaimer &);
+    TombstoneReclaimer &operator=(const TombstoneReclaimer &);
+
+    void run()
+    {
+        while (true)
+        {
+            bool last = stop_;
+            reclaimed_ += table_.reclaim_tombstones(ti_, batch_);
+            if (last)
+                break;
+            usleep(interval_ms_ * 1000);
+        }
+    }
+};
+
+} // namespace lf
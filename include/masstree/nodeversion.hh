@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include "lf/compiler.hh"
+#include "lf/mt_counters.hh"
 
 namespace lf
 {
@@ -45,6 +46,7 @@ class NodeVersion
         uint64_t x = v_;
         while (x & dirty_mask)
         {
+            LF_MT_COUNT(stable_spins);
             spin_function();
             //x = atomic_load_relaxed(&v_);
             x = v_;
@@ -120,6 +122,7 @@ class NodeVersion
             {
                 break;
             }
+            LF_MT_COUNT(lock_spins);
             spin_function();
             expected.v_ = v_;
         }
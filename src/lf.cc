@@ -1,22 +1,81 @@
 #include "lf/lf.hh"
 #include "lf/limbo.hh"
 #include "lf/wfmcas.hh"
+#include <thread>
+#include <algorithm>
+#include <unistd.h>
 
 namespace lf {
-    Status init_lf_library(size_t work_thread_no)
+    Status init_lf_library(size_t work_thread_no, size_t max_thread_no)
+    {
+        LfOptions options;
+        options.work_thread_no = work_thread_no;
+        options.max_thread_no = max_thread_no;
+        return init_lf_library(options);
+    }
+
+    Status init_lf_library(const LfOptions &options)
     {
         static bool bInited = false;
         assert(bInited == false);
 
         bInited = true;
-        g_all_threads = new std::vector<ThreadInfo>(work_thread_no);
-        Status ret = init_wfmcas(work_thread_no);
+        // 在任何ThreadInfo::alloc之前确定，块头的格式依赖它
+        reclaim_mode = options.reclaim_mode;
+        size_t work_thread_no = options.work_thread_no;
+        size_t max_thread_no = options.max_thread_no;
+        size_t capacity = std::max(work_thread_no, max_thread_no);
+        g_all_threads = new std::vector<ThreadInfo>(capacity);
+        for (size_t i = 0; i < capacity; i++)
+            (*g_all_threads)[i].set_index(int32_t(i));
+        for (size_t i = 0; i < work_thread_no; i++)
+            atomic_store_relaxed(&(*g_all_threads)[i].in_use_, 1);
+        atomic_store_relaxed(&g_thread_slots_hwm, uint32_t(work_thread_no));
+        Status ret = init_wfmcas(capacity);
 
         return ret;
     }
 
+    void set_limbo_policy(uint64_t watermark_bytes, uint64_t repin_age)
+    {
+        atomic_store_relaxed(&limbo_watermark_bytes, watermark_bytes);
+        atomic_store_relaxed(&repin_epoch_age, repin_age);
+        if (!watermark_bytes)
+            limbo_pressure = false;
+    }
+
+    ThreadInfo *register_thread()
+    {
+        assert(g_all_threads);
+        for (size_t i = 0; i < g_all_threads->size(); i++)
+        {
+            ThreadInfo &ti = (*g_all_threads)[i];
+            int32_t free_slot = 0;
+            if (atomic_load_relaxed(&ti.in_use_) || !atomic_cas32(&ti.in_use_, &free_slot, 1))
+                continue;
+            // 先占住槽位再提高hwm, 这之后才会打开LimboHandle
+            uint32_t hwm = atomic_load_relaxed(&g_thread_slots_hwm);
+            while (hwm < i + 1 && !atomic_cas32(reinterpret_cast<int32_t volatile *>(&g_thread_slots_hwm),
+                                                reinterpret_cast<int32_t *>(&hwm), int32_t(i + 1)))
+                ;
+            return &ti;
+        }
+        return nullptr;
+    }
+
+    void unregister_thread(ThreadInfo *ti)
+    {
+        assert(atomic_load_relaxed(&ti->in_use_));
+        ti->retire();
+        compiler_barrier();
+        atomic_store_release(&ti->in_use_, 0);
+    }
+
     void deinit_lf_library()
     {
+        stop_background_reclaimer();
+        stop_epoch_ticker();
+        deinit_wfmcas();
         if (g_all_threads)
         {
             for (size_t i = 0; i < g_all_threads->size(); i++)
@@ -28,4 +87,77 @@ namespace lf {
             g_all_threads = nullptr;
         }
     }    
+
+    static std::thread *g_epoch_ticker = nullptr;
+    static volatile bool g_epoch_ticker_stop = false;
+
+    static void epoch_ticker_run(uint32_t interval_us)
+    {
+        while (!g_epoch_ticker_stop)
+        {
+            atomic_add64(&global_epoch, 1);
+            if (g_all_threads)
+                refresh_reclaim_frontier();
+            usleep(interval_us);
+        }
+    }
+
+    Status start_epoch_ticker(uint32_t interval_us)
+    {
+        if (g_epoch_ticker)
+            return Status::InvalidArgument("epoch ticker already started");
+        g_epoch_ticker_stop = false;
+        epoch_ticker_on = true;
+        g_epoch_ticker = new std::thread(epoch_ticker_run, interval_us);
+        return Status::OK();
+    }
+
+    void stop_epoch_ticker()
+    {
+        if (!g_epoch_ticker)
+            return;
+        g_epoch_ticker_stop = true;
+        g_epoch_ticker->join();
+        delete g_epoch_ticker;
+        g_epoch_ticker = nullptr;
+        epoch_ticker_on = false;
+    }
+
+    static std::thread *g_reclaimer = nullptr;
+    static ThreadInfo *g_reclaimer_ti = nullptr;
+    static volatile bool g_reclaimer_stop = false;
+
+    static void reclaimer_run(ThreadInfo *ti, uint32_t interval_us)
+    {
+        while (!g_reclaimer_stop)
+        {
+            ti->reclaim_retired_groups();
+            usleep(interval_us);
+        }
+    }
+
+    Status start_background_reclaimer(ThreadInfo *ti, uint32_t interval_us)
+    {
+        if (g_reclaimer)
+            return Status::InvalidArgument("background reclaimer already started");
+        g_reclaimer_stop = false;
+        g_reclaimer_ti = ti;
+        background_reclaim_on = true;
+        g_reclaimer = new std::thread(reclaimer_run, ti, interval_us);
+        return Status::OK();
+    }
+
+    void stop_background_reclaimer()
+    {
+        if (!g_reclaimer)
+            return;
+        background_reclaim_on = false;
+        g_reclaimer_stop = true;
+        g_reclaimer->join();
+        delete g_reclaimer;
+        g_reclaimer = nullptr;
+        // 回收线程已经退出，剩下的group交给它的ThreadInfo, 之后正常释放
+        g_reclaimer_ti->reclaim_retired_groups(true);
+        g_reclaimer_ti = nullptr;
+    }
 } // end namespace
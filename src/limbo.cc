@@ -1,12 +1,233 @@
 #include "lf/limbo.hh"
 #include "lf/logger.hh"
+#include "lf/time_util.hh"
 #include <assert.h>
 
 namespace lf
 {
 
-volatile Epoch global_epoch = 0;
+volatile Epoch global_epoch = 1;
+volatile bool epoch_ticker_on = false;
+volatile bool background_reclaim_on = false;
+volatile uint64_t limbo_watermark_bytes = 0;
+volatile uint64_t repin_epoch_age = 0;
+volatile bool limbo_pressure = false;
+ReclaimMode reclaim_mode = reclaim_epoch;
+volatile Epoch reclaim_frontier_epoch = 0;
+volatile uint64_t reclaim_frontier_micros = 0;
 std::vector<ThreadInfo> *g_all_threads;
+volatile uint32_t g_thread_slots_hwm = 0;
+EpochBucket g_epoch_buckets[epoch_bucket_count];
+
+// 工作线程交出的group, 和回收线程释放完还回来的group
+static LimboGroup *volatile g_retired_groups = nullptr;
+static LimboGroup *volatile g_free_groups = nullptr;
+// 注销的线程留下的group, 由下一个执行hard_free的线程接管
+static LimboGroup *volatile g_orphan_groups = nullptr;
+// 只由回收线程访问，按交出的顺序排列
+static LimboGroup *g_pending_groups = nullptr;
+
+static void push_group(LimboGroup *volatile *stack, LimboGroup *g)
+{
+    void *head = atomic_loadptr_relaxed(reinterpret_cast<void *volatile *>(stack));
+    do
+    {
+        g->next_ = static_cast<LimboGroup *>(head);
+    } while (!atomic_casptr(reinterpret_cast<void *volatile *>(stack), &head, g));
+}
+
+static LimboGroup *take_groups(LimboGroup *volatile *stack)
+{
+    if (!*stack)
+        return nullptr;
+    return static_cast<LimboGroup *>(atomic_xchgptr(reinterpret_cast<void *volatile *>(stack), nullptr));
+}
+
+Epoch refresh_reclaim_frontier()
+{
+    Epoch frontier = atomic_load_relaxed(&global_epoch);
+    compiler_barrier();
+    Epoch ae = min_active_epoch();
+    if (ae < frontier)
+        frontier = ae;
+    atomic_store_relaxed(&reclaim_frontier_epoch, frontier);
+    return frontier;
+}
+
+Epoch reclaim_frontier()
+{
+    uint64_t now = now_micros();
+    uint64_t last = atomic_load_relaxed(&reclaim_frontier_micros);
+    if (now - last >= reclaim_frontier_interval_us &&
+        atomic_cas64(&reclaim_frontier_micros, &last, now))
+        return refresh_reclaim_frontier();
+    return atomic_load_relaxed(&reclaim_frontier_epoch);
+}
+
+// 桶里只有epoch的低位，还原成不大于now的完整epoch
+static Epoch bucket_epoch(uint64_t word, Epoch now)
+{
+    const uint64_t span = uint64_t(1) << (64 - epoch_bucket_count_bits);
+    Epoch epoch = (now & ~(span - 1)) | (word >> epoch_bucket_count_bits);
+    return epoch > now ? epoch - span : epoch;
+}
+
+Epoch pin_epoch_bucket(Epoch epoch, int32_t *bucket)
+{
+    const uint64_t count_mask = (uint64_t(1) << epoch_bucket_count_bits) - 1;
+    int32_t b = int32_t(epoch % epoch_bucket_count);
+    int probes = 0;
+    while (true)
+    {
+        volatile uint64_t *word = &g_epoch_buckets[b].word_;
+        uint64_t w = atomic_load_relaxed(word);
+        uint64_t count = w & count_mask;
+        Epoch pinned = epoch;
+        uint64_t nw;
+        if (count == 0)
+        {
+            nw = (epoch << epoch_bucket_count_bits) | 1;
+        }
+        else
+        {
+            pinned = bucket_epoch(w, atomic_load_relaxed(&global_epoch));
+            if (pinned > epoch)
+            {
+                // 读到epoch之后global_epoch已经前进了(一圈)，重新读
+                epoch = atomic_load_relaxed(&global_epoch);
+                b = int32_t(epoch % epoch_bucket_count);
+                probes = 0;
+                continue;
+            }
+            if (epoch - pinned > epoch_bucket_count)
+            {
+                // 桶里的epoch太旧，加入会让它一直停在那里; 试下一个桶，全都太旧时等它们排空
+                b = (b + 1) % epoch_bucket_count;
+                if (++probes == epoch_bucket_count)
+                {
+                    probes = 0;
+                    spin_hint();
+                }
+                continue;
+            }
+            lf_precondition(count < count_mask);
+            nw = w + 1;
+        }
+        // CAS是全屏障，之后对树的读在计数对回收者可见之后
+        if (atomic_cas64(word, &w, nw))
+        {
+            *bucket = b;
+            return pinned;
+        }
+    }
+}
+
+bool unpin_epoch_bucket(int32_t bucket)
+{
+    const uint64_t count_mask = (uint64_t(1) << epoch_bucket_count_bits) - 1;
+    uint64_t w = atomic_add64(&g_epoch_buckets[bucket].word_, uint64_t(-1));
+    assert(w & count_mask);
+    return (w & count_mask) == 1;
+}
+
+Epoch min_bucket_epoch()
+{
+    const uint64_t count_mask = (uint64_t(1) << epoch_bucket_count_bits) - 1;
+    Epoch now = atomic_load_relaxed(&global_epoch);
+    Epoch ae = 1UL << 63;
+    for (int i = 0; i < epoch_bucket_count; i++)
+    {
+        uint64_t w = atomic_load_relaxed(&g_epoch_buckets[i].word_);
+        if (w & count_mask)
+        {
+            Epoch epoch = bucket_epoch(w, now);
+            if (epoch < ae)
+                ae = epoch;
+        }
+    }
+    return ae;
+}
+
+static bool era_blocked(const EraReservation *rs, size_t nrs, Epoch birth, Epoch retire)
+{
+    for (size_t i = 0; i < nrs; i++)
+    {
+        if (rs[i].lo <= retire && birth <= rs[i].hi)
+            return true;
+    }
+    return false;
+}
+
+/*
+先读global_epoch再读各个线程，之后打开的handle看不到退休epoch小于返回值的对象(与reclaim_frontier相同)。
+每个线程先读min_epoch_再读hi_era_, 与open_handle的发布顺序相反。
+返回false表示所有reservation都是无穷大的hi, 区间回收不比epoch回收多释放任何东西
+*/
+static bool snapshot_reservations(std::vector<EraReservation> &rs, Epoch *bound)
+{
+    *bound = atomic_load_relaxed(&global_epoch);
+    compiler_barrier();
+    rs.clear();
+    bool bounded = false;
+    size_t n = thread_scan_limit();
+    for (size_t i = 0; i < n; i++)
+    {
+        ThreadInfo &ti = (*g_all_threads)[i];
+        EraReservation r;
+        r.lo = atomic_load_relaxed(&ti.min_epoch_);
+        if (!r.lo)
+            continue;
+        compiler_barrier();
+        r.hi = atomic_load_relaxed(&ti.hi_era_);
+        bounded = bounded || r.hi != unbounded_era;
+        rs.push_back(r);
+    }
+    EraReservation r = {min_bucket_epoch(), unbounded_era};
+    if (r.lo != 1UL << 63)
+        rs.push_back(r);
+    return bounded;
+}
+
+inline size_t LimboGroup::clean_intervals(ThreadInfo &ti, const EraReservation *rs, size_t nrs, Epoch bound)
+{
+    size_t freed = 0;
+    uint32_t w = head_;
+    Epoch epoch = 0;
+    Epoch written = 0;
+    bool has_written = false;
+    // 释放MrcuCallback时可能往本group追加，所以每次重新读tail_
+    for (uint32_t r = head_; r < tail_; ++r)
+    {
+        Element e = e_[r];
+        if (!e.ptr_)
+        {
+            epoch = e.u_.epoch;
+            continue;
+        }
+        if (epoch < bound && !era_blocked(rs, nrs, ThreadInfo::block_birth(e.ptr_, e.u_.tag), epoch))
+        {
+            ti.free_rcu(e.ptr_, e.u_.tag);
+            ++freed;
+            continue;
+        }
+        // 需要写出标记时已经读过一个没有写出的标记，所以w < r
+        if (!has_written || written != epoch)
+        {
+            e_[w].ptr_ = nullptr;
+            e_[w].u_.epoch = epoch;
+            ++w;
+            written = epoch;
+            has_written = true;
+        }
+        e_[w++] = e;
+    }
+    tail_ = w;
+    if (head_ == tail_)
+        head_ = tail_ = 0;
+    else
+        epoch_ = written;
+    return freed;
+}
 
 inline uint32_t LimboGroup::clean_until(ThreadInfo &ti, Epoch epoch_bound, uint32_t count)
 {
@@ -47,11 +268,23 @@ ThreadInfo::ThreadInfo()
       empty_handle_(nullptr),
       group_head_(nullptr),
       group_tail_(nullptr),
-      max_epoch_(0)
+      max_epoch_(0),
+      handles_since_advance_(0),
+      in_reclaim_(false),
+      groups_since_reclaim_(0),
+      groups_after_reclaim_(0),
+      defer_batch_(nullptr),
+      free_batches_(nullptr),
+      free_batch_cnt_(0),
+      limbo_objects_(0),
+      limbo_bytes_(0)
 {
     atomic_store_relaxed(&min_epoch_, 0);
+    atomic_store_relaxed(&hi_era_, 0);
+    atomic_store_relaxed(&in_use_, 0);
     group_head_ = group_tail_ = new LimboGroup();
     memset(pool_, 0x00, sizeof(pool_));
+    memset(pool_cnt_, 0x00, sizeof(pool_cnt_));
 }
 
 ThreadInfo::~ThreadInfo()
@@ -62,10 +295,13 @@ void ThreadInfo::destroy()
     // ûҪȷʱûлԾLimboHandle
     assert(limbo_handle_.prev_ == limbo_handle_.next_);
     assert(limbo_handle_.prev_ = &limbo_handle_);
-    while (group_head_->head_ != group_head_->tail_)
+    // hard_free会把没写满的DeferBatch放进limbo, 执行时还可能登记新的
+    while (group_head_->head_ != group_head_->tail_ || defer_batch_)
     {
-        hard_free();
+        refresh_reclaim_frontier();
+        hard_free(true);
     }
+    free_defer_batches();
     while (empty_handle_)
     {
         LimboHandle *next = empty_handle_->next_;
@@ -84,14 +320,16 @@ void ThreadInfo::destroy()
         void *head = pool_[i];
         while (head)
         {
+            void *next = *reinterpret_cast<void **>(head);
             direct_free(head);
-            head = *reinterpret_cast<void **>(head);
+            head = next;
         }
         pool_[i] = nullptr;
+        pool_cnt_[i] = 0;
     } 
 }
 
-LimboHandle *ThreadInfo::new_handle()
+LimboHandle *ThreadInfo::take_empty_handle()
 {
     LimboHandle *handle = nullptr;
     if (empty_handle_)
@@ -105,21 +343,75 @@ LimboHandle *ThreadInfo::new_handle()
         handle_cnt_++;
     }
     handle->ti_ = this;
-    handle->my_epoch_ = atomic_add64_relaxed(&global_epoch, 1) + 1;
+    return handle;
+}
+
+Epoch ThreadInfo::next_handle_epoch()
+{
+    Epoch epoch = atomic_load_relaxed(&global_epoch);
+    if (++handles_since_advance_ >= epoch_advance_interval)
+    {
+        handles_since_advance_ = 0;
+        if (!epoch_ticker_on)
+            try_advance_epoch(epoch);
+    }
+    return epoch;
+}
+
+LimboHandle *ThreadInfo::open_handle(bool interval)
+{
+    LimboHandle *handle = take_empty_handle();
+    handle->my_epoch_ = next_handle_epoch();
+    handle->hi_era_ = interval && reclaim_mode == reclaim_interval ? handle->my_epoch_ : unbounded_era;
+    // hi_era_先于min_epoch_发布
+    bool raised = reclaim_mode == reclaim_interval && handle->hi_era_ > hi_era_;
+    if (raised)
+        atomic_store_relaxed(&hi_era_, handle->hi_era_);
 
     link(limbo_handle_.prev_, handle, &limbo_handle_);
     if (limbo_handle_.next_ == handle)
     {
+        // 之后对树的读必须在min_epoch_对其他线程可见之后，
+        // 否则回收者可能没有看到这个handle, 而这个handle读到了已经摘下的节点
         atomic_store_relaxed(&min_epoch_, handle->my_epoch_);
+        memory_fence();
+    }
+    else if (raised)
+    {
+        memory_fence();
     }
     max_epoch_ = handle->my_epoch_;
 
     return handle;
 }
 
+LimboHandle *ThreadInfo::new_migratable_handle()
+{
+    LimboHandle *handle = take_empty_handle();
+    handle->my_epoch_ = pin_epoch_bucket(next_handle_epoch(), &handle->bucket_);
+    handle->hi_era_ = unbounded_era;
+    handle->prev_ = handle->next_ = nullptr;
+    return handle;
+}
+
 void ThreadInfo::delete_handle(LimboHandle *handle)
 {
-    handle->~LimboHandle();
+    if (handle->migratable())
+    {
+        handle->ti_ = this;
+        handle->flush();
+        bool emptied = unpin_epoch_bucket(handle->bucket_);
+        handle->bucket_ = -1;
+        handle->next_ = empty_handle_;
+        empty_handle_ = handle;
+        if (emptied)
+            hard_free();
+        // 释放之后水位可能已经降下来
+        if (unlikely(limbo_pressure))
+            check_limbo_watermark();
+        return;
+    }
+    handle->flush();
     Epoch epoch = limbo_handle_.next_->my_epoch_;
     assert(handle != &limbo_handle_);
     handle->prev_->next_ = handle->next_;
@@ -128,12 +420,191 @@ void ThreadInfo::delete_handle(LimboHandle *handle)
     handle->prev_ = nullptr;
     handle->next_ = empty_handle_;
     empty_handle_ = handle;
+    if (reclaim_mode == reclaim_interval)
+        update_hi_era();
     compiler_barrier();
     if (epoch != limbo_handle_.next_->my_epoch_)
     {
         atomic_store_relaxed(&min_epoch_, limbo_handle_.next_->my_epoch_);
         hard_free();
+        if (unlikely(limbo_pressure))
+            check_limbo_watermark();
+    }
+}
+
+void ThreadInfo::repin(LimboHandle *handle)
+{
+    assert(handle->ti_ == this);
+    if (handle->migratable())
+    {
+        // 先计入新的桶再离开旧的，中间不会没有保护
+        int32_t bucket;
+        Epoch epoch = pin_epoch_bucket(next_handle_epoch(), &bucket);
+        bool emptied = unpin_epoch_bucket(handle->bucket_);
+        handle->bucket_ = bucket;
+        handle->my_epoch_ = epoch;
+        if (emptied)
+            hard_free();
+        return;
+    }
+
+    // 新的epoch不小于链表中所有handle的epoch, 移到末尾仍然有序
+    bool was_first = limbo_handle_.next_ == handle;
+    handle->prev_->next_ = handle->next_;
+    handle->next_->prev_ = handle->prev_;
+    handle->my_epoch_ = next_handle_epoch();
+    link(limbo_handle_.prev_, handle, &limbo_handle_);
+    max_epoch_ = handle->my_epoch_;
+    if (handle->hi_era_ != unbounded_era)
+    {
+        handle->hi_era_ = handle->my_epoch_;
+        raise_hi_era(handle->hi_era_);
+    }
+    if (was_first)
+    {
+        // 与new_handle相同，之后的读要在新的min_epoch_可见之后
+        atomic_store_relaxed(&min_epoch_, limbo_handle_.next_->my_epoch_);
+        memory_fence();
+        hard_free();
+    }
+}
+
+void ThreadInfo::raise_hi_era(Epoch hi)
+{
+    if (hi > hi_era_)
+    {
+        atomic_store_relaxed(&hi_era_, hi);
+        memory_fence();
+    }
+}
+
+// handle关闭之后重新计算，只会变小，不需要屏障
+void ThreadInfo::update_hi_era()
+{
+    Epoch hi = 0;
+    for (LimboHandle *h = limbo_handle_.next_; h != &limbo_handle_; h = h->next_)
+    {
+        if (h->hi_era_ > hi)
+            hi = h->hi_era_;
     }
+    atomic_store_relaxed(&hi_era_, hi);
+}
+
+/*
+区间回收时每写满一个group检查一次，扫描本线程所有的group。
+上次之后新写满的group数不少于上次剩下的group数时才扫描，所以每个对象分摊的扫描次数是常数。
+*/
+void ThreadInfo::reclaim_intervals()
+{
+    if (groups_since_reclaim_ < groups_after_reclaim_)
+        return;
+    groups_since_reclaim_ = 0;
+    std::vector<EraReservation> &rs = reservations_;
+    Epoch bound;
+    if (!snapshot_reservations(rs, &bound))
+    {
+        groups_after_reclaim_ = 0;
+        return;
+    }
+
+    in_reclaim_ = true;
+    uint32_t ngroups = 0;
+    LimboGroup *empty_head = nullptr;
+    LimboGroup **pp = &group_head_;
+    while (true)
+    {
+        LimboGroup *g = *pp;
+        g->clean_intervals(*this, rs.data(), rs.size(), bound);
+        // 释放时的refill_group可能换了group_tail_, 每次重新比较
+        if (g == group_tail_)
+            break;
+        if (g->head_ == g->tail_)
+        {
+            *pp = g->next_;
+            g->next_ = empty_head;
+            empty_head = g;
+            continue;
+        }
+        ++ngroups;
+        pp = &g->next_;
+    }
+    if (empty_head)
+    {
+        LimboGroup *last = empty_head;
+        while (last->next_)
+            last = last->next_;
+        last->next_ = group_tail_->next_;
+        group_tail_->next_ = empty_head;
+    }
+    groups_after_reclaim_ = ngroups;
+    in_reclaim_ = false;
+}
+
+void ThreadInfo::check_limbo_watermark()
+{
+    uint64_t watermark = atomic_load_relaxed(&limbo_watermark_bytes);
+    bool over = false;
+    if (watermark)
+    {
+        int64_t bytes = 0;
+        size_t n = thread_scan_limit();
+        for (size_t i = 0; i < n; i++)
+            bytes += (*g_all_threads)[i].limbo_bytes();
+        over = bytes > int64_t(watermark);
+    }
+    if (over == limbo_pressure)
+        return;
+    // 并发时可能打印多次，不影响正确性
+    limbo_pressure = over;
+    if (over)
+    {
+        LimboReport r = limbo_report();
+        lf::log("limbo over watermark %llu bytes: %lld objects, %lld bytes pending, "
+                "oldest handle epoch %llu (age %llu) on thread %d",
+                (unsigned long long)watermark, (long long)r.objects, (long long)r.bytes,
+                (unsigned long long)r.oldest_epoch, (unsigned long long)r.epoch_age(),
+                r.oldest_thread);
+    }
+}
+
+LimboReport limbo_report()
+{
+    LimboReport r;
+    memset(&r, 0, sizeof(r));
+    r.oldest_thread = -1;
+    r.global_epoch = atomic_load_relaxed(&global_epoch);
+    assert(g_all_threads);
+    size_t n = thread_scan_limit();
+    for (size_t i = 0; i < n; i++)
+    {
+        ThreadInfo &ti = (*g_all_threads)[i];
+        r.objects += ti.limbo_objects();
+        r.bytes += ti.limbo_bytes();
+        Epoch epoch = atomic_load_relaxed(&ti.min_epoch_);
+        if (epoch && (!r.oldest_epoch || epoch < r.oldest_epoch))
+        {
+            r.oldest_epoch = epoch;
+            r.oldest_thread = int32_t(i);
+        }
+    }
+    Epoch be = min_bucket_epoch();
+    if (be != 1UL << 63 && (!r.oldest_epoch || be < r.oldest_epoch))
+    {
+        r.oldest_epoch = be;
+        r.oldest_thread = -1;
+    }
+    return r;
+}
+
+void LimboReport::print(FILE *f) const
+{
+    f = f ? f : stdout;
+    fprintf(f, "limbo: %lld objects, %lld bytes, global epoch %llu",
+            (long long)objects, (long long)bytes, (unsigned long long)global_epoch);
+    if (oldest_epoch)
+        fprintf(f, ", oldest handle epoch %llu (age %llu) on thread %d",
+                (unsigned long long)oldest_epoch, (unsigned long long)epoch_age(), oldest_thread);
+    fprintf(f, "\n");
 }
 
 void ThreadInfo::link(LimboHandle *prev, LimboHandle *cur, LimboHandle *next)
@@ -144,18 +615,37 @@ void ThreadInfo::link(LimboHandle *prev, LimboHandle *cur, LimboHandle *next)
     next->prev_ = cur;
 }
 
-void ThreadInfo::hard_free()
+void ThreadInfo::hard_free(bool force)
 {
+    // 没写满的一批等epoch前进之后也在这里进入limbo, 否则登记得少的线程上可能一直不执行。
+    // 同一个epoch内的继续攒着，每次请求都关闭handle时也能成批
+    if (defer_batch_ && (force || defer_batch_->epoch_ != atomic_load_relaxed(&global_epoch)))
+        seal_defer_batch();
+    if (background_reclaim_on && !force)
+    {
+        return;
+    }
+    if (unlikely(g_orphan_groups != nullptr))
+    {
+        adopt_orphans();
+    }
     LimboGroup *empty_head = nullptr;
     LimboGroup *empty_tail = nullptr;
     uint32_t count = 1024 * 10;
 
-    Epoch epoch_bound = min_active_epoch() - 1;
-    if (group_head_->head_ == group_head_->tail_ ||
-        group_head_->first_epoch() > epoch_bound)
+    Epoch epoch_bound = reclaim_frontier() - 1;
+    if (group_head_->head_ == group_head_->tail_)
     {
         return;
     }
+    if (group_head_->first_epoch() > epoch_bound)
+    {
+        // epoch不前进的话这些内存永远不能释放
+        Epoch epoch = atomic_load_relaxed(&global_epoch);
+        if (group_head_->first_epoch() >= epoch)
+            try_advance_epoch(epoch);
+        return;
+    }
     while (count)
     {
         count = group_head_->clean_until(*this, epoch_bound, count);
@@ -183,11 +673,217 @@ void ThreadInfo::hard_free()
     return;
 }
 
+LimboGroup *ThreadInfo::new_group()
+{
+    // 多拿的仍然挂在next_上作为备用
+    LimboGroup *g = take_groups(&g_free_groups);
+    if (!g)
+        return new LimboGroup();
+    return g;
+}
+
+size_t ThreadInfo::reclaim_retired_groups(bool final)
+{
+    // 执行DeferBatch时登记的放在本线程的limbo上，写满之后同样交给这里
+    if (defer_batch_)
+        seal_defer_batch();
+    // 栈是后进先出，反转后接到待处理链表的末尾
+    LimboGroup *taken = take_groups(&g_retired_groups);
+    LimboGroup *fifo = nullptr;
+    while (taken)
+    {
+        LimboGroup *next = taken->next_;
+        taken->next_ = fifo;
+        fifo = taken;
+        taken = next;
+    }
+    LimboGroup **tailp = &g_pending_groups;
+    while (*tailp)
+        tailp = &(*tailp)->next_;
+    *tailp = fifo;
+
+    // 不同线程的group之间epoch没有顺序，每个都要检查
+    Epoch epoch_bound = refresh_reclaim_frontier() - 1;
+    std::vector<EraReservation> &rs = reservations_;
+    Epoch interval_bound = 0;
+    bool intervals = reclaim_mode == reclaim_interval && snapshot_reservations(rs, &interval_bound);
+    size_t remaining = 0;
+    LimboGroup **pp = &g_pending_groups;
+    while (*pp)
+    {
+        LimboGroup *g = *pp;
+        while (g->head_ != g->tail_ && g->first_epoch() <= epoch_bound)
+            g->clean_until(*this, epoch_bound, 1024 * 10);
+        if (intervals && g->head_ != g->tail_)
+            g->clean_intervals(*this, rs.data(), rs.size(), interval_bound);
+        if (g->head_ == g->tail_)
+        {
+            *pp = g->next_;
+            g->epoch_ = 0;
+            push_group(&g_free_groups, g);
+            continue;
+        }
+        ++remaining;
+        pp = &g->next_;
+    }
+    // 和hard_free一样，epoch不前进的话剩下的永远不能释放
+    Epoch epoch = atomic_load_relaxed(&global_epoch);
+    if (remaining && epoch_bound + 1 >= epoch)
+        try_advance_epoch(epoch);
+    if (unlikely(limbo_pressure))
+        check_limbo_watermark();
+
+    if (final && g_pending_groups)
+    {
+        LimboGroup *last = g_pending_groups;
+        while (last->next_)
+            last = last->next_;
+        last->next_ = group_head_;
+        group_head_ = g_pending_groups;
+        g_pending_groups = nullptr;
+    }
+    if (final)
+    {
+        LimboGroup *g = take_groups(&g_free_groups);
+        while (g)
+        {
+            LimboGroup *next = g->next_;
+            delete g;
+            g = next;
+        }
+    }
+    return remaining;
+}
+
+void ThreadInfo::retire()
+{
+    assert(limbo_handle_.next_ == &limbo_handle_);
+    if (defer_batch_)
+        seal_defer_batch();
+    if (group_head_->head_ != group_head_->tail_ || group_head_ != group_tail_)
+    {
+        // head..tail交出去，后面空的group留着给这个槽位的下一个线程
+        LimboGroup *spare = group_tail_->next_;
+        group_tail_->next_ = nullptr;
+        LimboGroup *volatile *stack = background_reclaim_on ? &g_retired_groups : &g_orphan_groups;
+        for (LimboGroup *g = group_head_; g;)
+        {
+            LimboGroup *next = g->next_;
+            push_group(stack, g);
+            g = next;
+        }
+        group_head_ = group_tail_ = spare ? spare : new LimboGroup();
+    }
+    for (int i = 0; i < pool_max_nlines; i++)
+    {
+        void *head = pool_[i];
+        while (head)
+        {
+            void *next = *reinterpret_cast<void **>(head);
+            direct_free(head);
+            head = next;
+        }
+        pool_[i] = nullptr;
+        pool_cnt_[i] = 0;
+    }
+    free_defer_batches();
+    handles_since_advance_ = 0;
+}
+
+DeferBatch *ThreadInfo::new_defer_batch()
+{
+    DeferBatch *b = free_batches_;
+    if (b)
+    {
+        free_batches_ = b->next_;
+        --free_batch_cnt_;
+    }
+    else
+    {
+        b = static_cast<DeferBatch *>(alloc(sizeof(DeferBatch)));
+    }
+    b->size_ = 0;
+    b->next_ = nullptr;
+    return b;
+}
+
+void ThreadInfo::seal_defer_batch()
+{
+    DeferBatch *b = defer_batch_;
+    defer_batch_ = nullptr;
+    record_rcu(b, MemTagDeferBatch);
+}
+
+void ThreadInfo::run_defer_batch(DeferBatch *b)
+{
+    // fn中可能再defer, 进的是本线程当前的一批，不会改动b
+    for (uint32_t i = 0; i < b->size_; i++)
+        b->e_[i].fn_(b->e_[i].arg_, this);
+    if (free_batch_cnt_ >= defer_batch_max_free)
+    {
+        free_block(b);
+        return;
+    }
+    b->next_ = free_batches_;
+    free_batches_ = b;
+    ++free_batch_cnt_;
+}
+
+void ThreadInfo::free_defer_batches()
+{
+    while (free_batches_)
+    {
+        DeferBatch *next = free_batches_->next_;
+        free_block(free_batches_);
+        free_batches_ = next;
+    }
+    free_batch_cnt_ = 0;
+}
+
+void ThreadInfo::adopt_orphans()
+{
+    // 接到最前面：它们的epoch比本线程的早，会先变得可以释放
+    LimboGroup *orphans = take_groups(&g_orphan_groups);
+    if (!orphans)
+        return;
+    LimboGroup *last = orphans;
+    while (last->next_)
+        last = last->next_;
+    last->next_ = group_head_;
+    group_head_ = orphans;
+}
+
 void ThreadInfo::refill_group()
 {
+    if (atomic_load_relaxed(&limbo_watermark_bytes) || limbo_pressure)
+        check_limbo_watermark();
+    // 只有一个group时epoch回收跟得上，不需要区间回收
+    if (reclaim_mode == reclaim_interval && !background_reclaim_on && !in_reclaim_ &&
+        group_head_ != group_tail_)
+    {
+        ++groups_since_reclaim_;
+        reclaim_intervals();
+        if (group_tail_->tail_ + 2 <= LimboGroup::capacity)
+            return;
+    }
+    if (background_reclaim_on)
+    {
+        // 把group_head_到group_tail_整个交给回收线程(打开后台回收之前可能积累了多个)，
+        // 空闲的group先用本线程备用的，再从回收线程还回来的里面取
+        LimboGroup *spare = group_tail_->next_;
+        group_tail_->next_ = nullptr;
+        for (LimboGroup *g = group_head_; g;)
+        {
+            LimboGroup *next = g->next_;
+            push_group(&g_retired_groups, g);
+            g = next;
+        }
+        group_head_ = group_tail_ = spare ? spare : new_group();
+        return;
+    }
     if (!group_tail_->next_)
     {
-        group_tail_->next_ = new LimboGroup();
+        group_tail_->next_ = new_group();
     }
     group_tail_ = group_tail_->next_;
     assert(group_tail_->head_ == 0 && group_tail_->tail_ == 0);
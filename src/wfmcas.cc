@@ -20,6 +20,112 @@ intptr_t *end_of_casrow = (intptr_t *)1;
 struct MCasHelper
 {
     CasRow *cr; // 只有在cr->mch == this, MCasHelper与CasRow关联才有效
+    // 以下只由持有它的MCasThreadCtx使用，回收之后其他线程仍可能读cr, 所以不能复用cr
+    MCasHelper *next;
+    Epoch retire_epoch;
+};
+
+/*
+MCasHelper和MCasDescriptor不经过ThreadInfo的limbo, 由MCasThreadCtx自己回收复用:
+其他线程可能看到过的对象带着当时的global_epoch挂到retired链表尾部(epoch递增)，
+等retire_epoch小于reclaim_frontier(所有能读到它的handle都已关闭)再移到free链表。
+从来没有暴露给其他线程的直接回到free链表。
+稳定状态下mcas不分配内存，也不往limbo里记录。
+T要有next和retire_epoch两个成员，回收之后只改写它们。
+*/
+template <typename T>
+struct RecyclePool
+{
+    enum
+    {
+        max_free = 1024 // free链表最多缓存的个数，多的还给系统
+    };
+    T *free_;
+    size_t free_cnt_;
+    T *retired_head_;
+    T *retired_tail_;
+    Epoch refreshed_at_; // 上次重新计算边界时的global_epoch
+
+    RecyclePool()
+        : free_(nullptr), free_cnt_(0), retired_head_(nullptr), retired_tail_(nullptr), refreshed_at_(0)
+    {}
+
+    T *get()
+    {
+        if (!free_)
+            harvest();
+        T *p = free_;
+        if (!p)
+            return new T();
+        free_ = p->next;
+        free_cnt_--;
+        return p;
+    }
+
+    // 调用者持有的LimboHandle保证retire_epoch不早于其他线程读到p时的epoch
+    void retire(T *p)
+    {
+        p->next = nullptr;
+        p->retire_epoch = atomic_load_relaxed(&global_epoch);
+        if (retired_tail_)
+            retired_tail_->next = p;
+        else
+            retired_head_ = p;
+        retired_tail_ = p;
+    }
+
+    void recycle(T *p)
+    {
+        p->next = free_;
+        free_ = p;
+        free_cnt_++;
+    }
+
+    // 把retired链表头部已经过了grace period的移到free链表。
+    // 缓存的边界不够新时重新计算，但每个epoch最多一次：有handle停住时边界不会前进，
+    // 每次分配都重新计算只是白白遍历所有线程
+    void harvest()
+    {
+        T *p = retired_head_;
+        if (!p)
+            return;
+        Epoch frontier = reclaim_frontier();
+        Epoch epoch = atomic_load_relaxed(&global_epoch);
+        if (p->retire_epoch >= frontier && epoch != refreshed_at_)
+        {
+            refreshed_at_ = epoch;
+            frontier = refresh_reclaim_frontier();
+        }
+        while (p && p->retire_epoch < frontier)
+        {
+            T *next = p->next;
+            if (free_cnt_ < max_free)
+                recycle(p);
+            else
+                delete p;
+            p = next;
+        }
+        retired_head_ = p;
+        if (!p)
+            retired_tail_ = nullptr;
+    }
+
+    void clear()
+    {
+        delete_list(free_);
+        delete_list(retired_head_);
+        *this = RecyclePool();
+    }
+
+    static void delete_list(T *p)
+    {
+        while (p)
+        {
+            T *next = p->next;
+            delete p;
+            p = next;
+        }
+    }
 };
 
 // 每个工作线程持有一个threadCtx，相当于__thread 变量
@@ -28,6 +134,12 @@ struct MCasThreadCtx
     size_t thread_id; // thread-local 线程ID
     size_t check_id;  // thread-local 用于线程检查的id
     int recur_depth;  // thread-local 用于标识递归深度（帮助其他线程完成operations）
+
+    // 槽位换了线程之后留给新的线程
+    RecyclePool<MCasHelper> helpers;
+    RecyclePool<MCasDescriptor> descriptors;
+
+    MCasThreadCtx() : thread_id(0), check_id(0), recur_depth(0) {}
 };
 
 void place_mcas_helper(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
@@ -55,6 +167,15 @@ Status init_wfmcas(size_t work_thread_no)
     return Status::OK();
 }
 
+void deinit_wfmcas()
+{
+    for (size_t i = 0; i < gMCasThreadCtxs.size(); i++)
+    {
+        gMCasThreadCtxs[i].helpers.clear();
+        gMCasThreadCtxs[i].descriptors.clear();
+    }
+}
+
 MCasThreadCtx *init_mcas_thread_ctx(size_t thd_id)
 {
     assert(thd_id < gMCasThreadCtxs.size());
@@ -81,12 +202,25 @@ inline intptr_t mcas_helper_unmask(intptr_t val)
 static MCasHelper *allocate_mcas_helper(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
                                         CasRow *cr)
 {
-    MCasHelper *mch = (MCasHelper *)limbo_hdl->alloc(sizeof(MCasHelper));
+    (void)limbo_hdl;
+    MCasHelper *mch = thd_ctx->helpers.get();
     mch->cr = cr;
     assert(mch->cr != nullptr);
     return mch;
 }
 
+// 曾经放到过address上的helper
+static void retire_mcas_helper(MCasThreadCtx *thd_ctx, MCasHelper *mch)
+{
+    thd_ctx->helpers.retire(mch);
+}
+
+// 没有放到address上过的helper
+static void recycle_mcas_helper(MCasThreadCtx *thd_ctx, MCasHelper *mch)
+{
+    thd_ctx->helpers.recycle(mch);
+}
+
 // 返回MCAS操作是否成功
 // CasRow的任意长的数组，以0x1标识结束
 bool invoke_mcas(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
@@ -154,7 +288,7 @@ void place_mcas_helper(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
                 set_mcas_fail(cr, last_row);
                 if (likely(cr->mch != mch))
                 {
-                    limbo_hdl->dealloc(mch);
+                    recycle_mcas_helper(thd_ctx, mch);
                 }
                 return;
             }
@@ -182,7 +316,7 @@ void place_mcas_helper(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
                     ev = mcas_helper_mask((intptr_t)mch);
                     if (atomic_cas64(address, &ev, evalue))
                     {
-                        limbo_hdl->dealloc(mch);
+                        retire_mcas_helper(thd_ctx, mch);
                     }
                 }
                 else
@@ -224,7 +358,7 @@ void place_mcas_helper(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
                     if (atomic_cas64(address, &cvalue1, evalue))
                     {
                         log("%p dealloc %p from 2.1.1", thd_ctx, cmch);
-                        limbo_hdl->dealloc(cmch);
+                        retire_mcas_helper(thd_ctx, cmch);
                     }
                     log("%p path2.1.1 mch %p, emch %p", thd_ctx, mch, emch);
                 }
@@ -233,7 +367,7 @@ void place_mcas_helper(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
                 }
                 if (likely(mch != emch))
                 {
-                    limbo_hdl->dealloc(mch);
+                    recycle_mcas_helper(thd_ctx, mch);
                 }
                 return;
             }
@@ -254,7 +388,7 @@ void place_mcas_helper(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
                         if (atomic_cas64(address, &ev, evalue))
                         {
                             log("%p dealloc %p from 2.2.1", thd_ctx, mch);
-                            limbo_hdl->dealloc(mch);
+                            retire_mcas_helper(thd_ctx, mch);
                         }
                         log("%p path2.2.1.1 mch %p, emch %ld", thd_ctx, mch, emch);
                     }
@@ -282,7 +416,7 @@ void place_mcas_helper(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
 
     if (likely(cr->mch != mch))
     {
-        limbo_hdl->dealloc(mch);
+        recycle_mcas_helper(thd_ctx, mch);
     }
     return;
 }
@@ -326,7 +460,8 @@ bool should_replace(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
 
 void help_if_needed(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl)
 {
-    thd_ctx->check_id = (thd_ctx->check_id + 1) % (gMCasThreadNo);
+    // 只看注册过的槽位
+    thd_ctx->check_id = (thd_ctx->check_id + 1) % thread_scan_limit();
     if (thd_ctx->check_id == thd_ctx->thread_id)
         return;
     CasRow *cr = (CasRow *)atomic_loadptr_relaxed((void **)&(gPendingOpTable[thd_ctx->check_id]));
@@ -398,7 +533,7 @@ void remove_mcas_helper(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
         {
             atomic_cas64(m->address, &ev, m->expected_value);
         }
-        limbo_hdl->dealloc((void *)(mch));
+        retire_mcas_helper(thd_ctx, mch);
     } while ((m++) != last_row);
 }
 
@@ -416,7 +551,18 @@ bool mcas(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
     }
     std::sort(desc.begin(), desc.end(), sort_by_address_desc);
 
-    CasRow *mcasp = (CasRow *)limbo_hdl->alloc(sizeof(CasRow) * (desc.size() + 1));
+    // 放得下时用MCasDescriptor的行，与它一样回收复用
+    MCasDescriptor *pooled = nullptr;
+    CasRow *mcasp;
+    if (desc.size() <= MCasDescriptor::max_rows)
+    {
+        pooled = thd_ctx->descriptors.get();
+        mcasp = pooled->rows_;
+    }
+    else
+    {
+        mcasp = (CasRow *)limbo_hdl->alloc(sizeof(CasRow) * (desc.size() + 1));
+    }
     for (size_t i = 0; i < desc.size(); i++)
     {
         new (mcasp + i) CasRow(desc[i].address, desc[i].expected_value, desc[i].new_value);
@@ -427,10 +573,73 @@ bool mcas(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
 
     bool ret = invoke_mcas(thd_ctx, limbo_hdl, mcasp, last_row);
 
-    limbo_hdl->dealloc(mcasp);
+    if (pooled)
+        thd_ctx->descriptors.retire(pooled);
+    else
+        limbo_hdl->dealloc(mcasp);
     return ret;
 }
 
+MCasDescriptor *new_mcas_descriptor(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl)
+{
+    (void)limbo_hdl;
+    MCasDescriptor *desc = thd_ctx->descriptors.get();
+    desc->size_ = 0;
+    return desc;
+}
+
+void free_mcas_descriptor(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl, MCasDescriptor *desc)
+{
+    (void)limbo_hdl;
+    thd_ctx->descriptors.recycle(desc);
+}
+
+// 提前返回时没有放置过helper, 其他线程看不到desc, 直接回到free链表
+MCasResult mcas(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl, MCasDescriptor *desc)
+{
+    CasRow *rows = desc->rows_;
+    size_t n = desc->size_;
+    if (n == 0)
+    {
+        free_mcas_descriptor(thd_ctx, limbo_hdl, desc);
+        return mcas_succeeded;
+    }
+
+    // 行数很少，插入排序，与sort_by_address_desc的顺序相同
+    for (size_t i = 1; i < n; i++)
+    {
+        CasRow r = rows[i];
+        size_t j = i;
+        for (; j > 0 && (intptr_t)rows[j - 1].address < (intptr_t)r.address; j--)
+            rows[j] = rows[j - 1];
+        rows[j] = r;
+    }
+    for (size_t i = 1; i < n; i++)
+    {
+        if (rows[i].address == rows[i - 1].address)
+        {
+            free_mcas_descriptor(thd_ctx, limbo_hdl, desc);
+            return mcas_duplicate_address;
+        }
+    }
+    // address上是helper时逻辑值要帮助完成才知道，留给place_mcas_helper
+    for (size_t i = 0; i < n; i++)
+    {
+        assert(rows[i].address && rows[i].mch == nullptr);
+        intptr_t cvalue = atomic_load_relaxed(rows[i].address);
+        if (!is_mcas_helper(cvalue) && cvalue != rows[i].expected_value)
+        {
+            free_mcas_descriptor(thd_ctx, limbo_hdl, desc);
+            return mcas_doomed;
+        }
+    }
+
+    new (rows + n) CasRow(end_of_casrow, 0, 0);
+    bool ret = invoke_mcas(thd_ctx, limbo_hdl, rows, rows + n - 1);
+    thd_ctx->descriptors.retire(desc);
+    return ret ? mcas_succeeded : mcas_failed;
+}
+
 intptr_t mcas_read(MCasThreadCtx *thd_ctx, LimboHandle *limbo_hdl,
                    intptr_t *address)
 {
@@ -1,4 +1,5 @@
 #include "gtest/gtest.h"
+#include <map>
 #include "lf/logger.hh"
 #include "lf/masstree.hh"
 
@@ -67,6 +68,1003 @@ TEST_F(MtStructTest, MakeComparable)
     ASSERT_FALSE(StringSlice::equals_sloppy(a, b, 10));
 }
 
+static void mt_put(BasicTable &table, Slice key, uint64_t val, ThreadInfo *ti)
+{
+    TCursor lp(table, key);
+    bool found = lp.find_insert(ti);
+    (void)found;
+    lp.value() = val;
+    lp.finish(1, ti);
+}
+
+struct SumScanner
+{
+    Slice end_;
+    ScanAggregate agg_;
+
+    void visit_leaf(const ScanStackElt &, const MtKey &, ThreadInfo *)
+    {
+    }
+
+    bool visit_value(Slice key, LeafValue &val, ThreadInfo *)
+    {
+        if (!end_.empty() && key.compare(end_) >= 0)
+            return false;
+        aggregate_values(&val.value(), 1, agg_);
+        return true;
+    }
+};
+
+TEST_F(MtStructTest, Aggregate)
+{
+    BasicTable table;
+    LimboHandle *handle = ti_->new_handle();
+    table.initialize(ti_);
+
+    char buf[64];
+    for (int i = 0; i < 2000; i++)
+    {
+        // 短key与共享前缀的长key混合，产生多个layer
+        int n = snprintf(buf, sizeof(buf), "%08d", i);
+        mt_put(table, Slice(buf, n), i, ti_);
+        n = snprintf(buf, sizeof(buf), "prefix-longkey-%06d", i);
+        mt_put(table, Slice(buf, n), i * 3, ti_);
+    }
+
+    const char *ranges[][2] = {
+        {"", ""},
+        {"00000100", "00001500"},
+        {"0000010", "00000999x"},
+        {"prefix-longkey-000100", "prefix-longkey-001000"},
+        {"prefix-l", "prefix-longkey-0015"},
+        {"00001999", "z"}};
+    for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++)
+    {
+        SumScanner ss;
+        ss.end_ = Slice(ranges[r][1]);
+        table.scan(Slice(ranges[r][0]), true, ss, ti_);
+        ScanAggregate agg = table.aggregate(Slice(ranges[r][0]), Slice(ranges[r][1]), ti_);
+        EXPECT_EQ(agg.count, ss.agg_.count);
+        EXPECT_EQ(agg.sum, ss.agg_.sum);
+        EXPECT_EQ(agg.min, ss.agg_.min);
+        EXPECT_EQ(agg.max, ss.agg_.max);
+    }
+
+    table.destroy(ti_);
+    ti_->delete_handle(handle);
+    ti_->destroy();
+}
+
+// AVX2和标量两个归约核对同样的输入给出同样的结果，包括跨符号位的值和不满4个的尾部
+TEST_F(MtStructTest, AggregateKernels)
+{
+    uint64_t v[64];
+    uint64_t x = 88172645463325252ULL;
+    for (int round = 0; round < 200; round++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            v[i] = round % 3 == 0 ? x : round % 3 == 1 ? (x & 1 ? ~uint64_t(0) - (x & 15) : x & 15)
+                                                       : 0x8000000000000000ULL + (x & 255) - 128;
+        }
+        int n = round % 65;
+        ScanAggregate scalar, dispatch;
+        aggregate_values_scalar(v, n, scalar);
+        aggregate_values(v, n, dispatch);
+        EXPECT_EQ(scalar.count, dispatch.count);
+        EXPECT_EQ(scalar.sum, dispatch.sum);
+        EXPECT_EQ(scalar.min, dispatch.min);
+        EXPECT_EQ(scalar.max, dispatch.max);
+#if LF_AGGREGATE_AVX2
+        if (aggregate_has_avx2())
+        {
+            ScanAggregate avx2;
+            aggregate_values_avx2(v, n, avx2);
+            EXPECT_EQ(scalar.count, avx2.count);
+            EXPECT_EQ(scalar.sum, avx2.sum);
+            EXPECT_EQ(scalar.min, avx2.min) << n;
+            EXPECT_EQ(scalar.max, avx2.max) << n;
+        }
+#endif
+    }
+}
+
+struct CollectScanner
+{
+    std::vector<std::string> keys_;
+    std::vector<uint64_t> values_;
+    size_t limit_;
+
+    explicit CollectScanner(size_t limit) : limit_(limit) {}
+
+    void visit_leaf(const ScanStackElt &, const MtKey &, ThreadInfo *)
+    {
+    }
+
+    bool visit_value(Slice key, LeafValue &val, ThreadInfo *)
+    {
+        keys_.push_back(std::string(key.data(), key.size()));
+        values_.push_back(val.value());
+        return keys_.size() < limit_;
+    }
+};
+
+TEST_F(MtStructTest, Freeze)
+{
+    BasicTable table;
+    LimboHandle *handle = ti_->new_handle();
+    table.initialize(ti_);
+
+    char buf[64];
+    for (int i = 0; i < 3000; i += 3)
+    {
+        int n = snprintf(buf, sizeof(buf), "%d", i);
+        mt_put(table, Slice(buf, n), i, ti_);
+        n = snprintf(buf, sizeof(buf), "http://www.example.com/path/%d", i);
+        mt_put(table, Slice(buf, n), i + 1, ti_);
+    }
+
+    FrozenTable frozen;
+    table.freeze(frozen, ti_);
+    EXPECT_EQ(frozen.size(), 2000u);
+
+    for (int i = 0; i < 3000; i++)
+    {
+        LeafValue v1, v2;
+        int n = snprintf(buf, sizeof(buf), "%d", i);
+        Slice key(buf, n);
+        bool f1 = table.get(key, v1, ti_);
+        bool f2 = frozen.get(key, v2);
+        EXPECT_EQ(f1, f2);
+        if (f1)
+        {
+            EXPECT_EQ(v1.value(), v2.value());
+        }
+        n = snprintf(buf, sizeof(buf), "http://www.example.com/path/%d", i);
+        key = Slice(buf, n);
+        f1 = table.get(key, v1, ti_);
+        f2 = frozen.get(key, v2);
+        EXPECT_EQ(f1, f2);
+        if (f1)
+        {
+            EXPECT_EQ(v1.value(), v2.value());
+        }
+    }
+
+    // URL的首ikey都是"http://w", 这些key跨了几十个block
+    const char *starts[] = {"", "1", "150", "2997", "http://", "http://www.example.com/path/2",
+                            "http://www.example.com/path/1500", "http://www.example.com/path/999", "z"};
+    for (size_t s = 0; s < sizeof(starts) / sizeof(starts[0]); s++)
+    {
+        for (int emit = 0; emit < 2; emit++)
+        {
+            CollectScanner c1(50), c2(50);
+            table.scan(Slice(starts[s]), emit, c1, ti_);
+            frozen.scan(Slice(starts[s]), emit, c2, ti_);
+            EXPECT_EQ(c1.keys_, c2.keys_);
+            EXPECT_EQ(c1.values_, c2.values_);
+        }
+    }
+
+    table.destroy(ti_);
+    ti_->delete_handle(handle);
+    ti_->destroy();
+}
+
+
+static void mt_remove(BasicTable &table, Slice key, ThreadInfo *ti)
+{
+    TCursor lp(table, key);
+    bool found = lp.find_locked(ti);
+    lp.finish(found ? -1 : 0, ti);
+}
+
+// 每访问一个key就删除或者新增一个还没有被fork之后的修改碰过的key
+struct ChurnScanner : public CollectScanner
+{
+    BasicTable &table_;
+    const std::vector<std::string> &keys_all_;
+    size_t next_;
+    ThreadInfo *ti_;
 
+    ChurnScanner(BasicTable &table, const std::vector<std::string> &keys, ThreadInfo *ti)
+        : CollectScanner(~size_t(0)), table_(table), keys_all_(keys), next_(2), ti_(ti)
+    {
+    }
+
+    bool visit_value(Slice key, LeafValue &val, ThreadInfo *ti)
+    {
+        if (next_ < keys_all_.size())
+        {
+            if (next_ % 2 == 0)
+                mt_remove(table_, Slice(keys_all_[next_]), ti_);
+            else
+                mt_put(table_, Slice(keys_all_[next_]), next_ + 200000, ti_);
+            next_ += 3;
+        }
+        return CollectScanner::visit_value(key, val, ti);
+    }
+};
+
+TEST_F(MtStructTest, Fork)
+{
+    BasicTable table;
+    LimboHandle *handle = ti_->new_handle();
+    table.initialize(ti_);
+
+    char buf[64];
+    std::vector<std::string> keys;
+    for (int i = 0; i < 2000; i++)
+    {
+        int n = snprintf(buf, sizeof(buf), "%d", i);
+        keys.push_back(std::string(buf, n));
+        n = snprintf(buf, sizeof(buf), "http://www.example.com/path/%d", i);
+        keys.push_back(std::string(buf, n));
+    }
+    for (size_t i = 0; i < keys.size(); i += 2)
+        mt_put(table, Slice(keys[i]), i, ti_);
+
+    CollectScanner before(~size_t(0));
+    table.scan(Slice(), true, before, ti_);
+    ti_->delete_handle(handle);
+
+    TableSnapshot *snap = table.fork(ti_);
+    ASSERT_TRUE(snap != nullptr);
+    EXPECT_TRUE(table.fork(ti_) == nullptr);
+
+    handle = ti_->new_handle();
+    EXPECT_TRUE(snap->ready());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        if (i % 3 == 0)
+            mt_put(table, Slice(keys[i]), i + 100000, ti_);
+        else if (i % 3 == 1)
+            mt_remove(table, Slice(keys[i]), ti_);
+    }
+
+    CollectScanner after(~size_t(0));
+    table.scan(Slice(), true, after, ti_);
+    EXPECT_NE(before.keys_, after.keys_);
+
+    CollectScanner c(~size_t(0));
+    int count = snap->scan(Slice(), true, c, ti_);
+    EXPECT_EQ(count, int(before.keys_.size()));
+    EXPECT_EQ(before.keys_, c.keys_);
+    EXPECT_EQ(before.values_, c.values_);
+
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        LeafValue v;
+        bool found = snap->get(Slice(keys[i]), v, ti_);
+        EXPECT_EQ(found, i % 2 == 0);
+        if (found)
+        {
+            EXPECT_EQ(v.value(), i);
+        }
+    }
+
+    CollectScanner part(20);
+    snap->scan(Slice("1500"), false, part, ti_);
+    CollectScanner expect(20);
+    for (size_t i = 0; i < before.keys_.size() && expect.keys_.size() < 20; i++)
+    {
+        if (Slice(before.keys_[i]).compare(Slice("1500")) > 0)
+        {
+            LeafValue v(before.values_[i]);
+            expect.visit_value(Slice(before.keys_[i]), v, ti_);
+        }
+    }
+    EXPECT_EQ(expect.keys_, part.keys_);
+    EXPECT_EQ(expect.values_, part.values_);
+
+    // 扫描快照的同时修改活动的表，扫描中途新增的before_/born_也要归并进来
+    ChurnScanner churn(table, keys, ti_);
+    count = snap->scan(Slice(), true, churn, ti_);
+    EXPECT_EQ(count, int(before.keys_.size()));
+    EXPECT_EQ(before.keys_, churn.keys_);
+    EXPECT_EQ(before.values_, churn.values_);
+
+    snap->release(ti_);
+    EXPECT_TRUE(table.snapshot() == nullptr);
+
+    // 持有fork之前的handle时快照不会ready, 关闭之后重新打开才行
+    snap = table.fork(ti_);
+    ASSERT_TRUE(snap != nullptr);
+    EXPECT_FALSE(snap->ready());
+    ti_->delete_handle(handle);
+    handle = ti_->new_handle();
+    EXPECT_TRUE(snap->ready());
+    snap->release(ti_);
+
+    table.destroy(ti_);
+    ti_->delete_handle(handle);
+    ti_->destroy();
+}
+
+struct ReplayVisitor
+{
+    std::map<std::string, uint64_t> replica_;
+    uint64_t last_lsn_;
+    Epoch last_epoch_;
+    bool ordered_;
+
+    ReplayVisitor() : last_lsn_(0), last_epoch_(0), ordered_(true) {}
+
+    void operator()(const ChangeRecord &rec)
+    {
+        if (!replica_.empty() || last_lsn_)
+            ordered_ = ordered_ && rec.lsn == last_lsn_ + 1;
+        last_lsn_ = rec.lsn;
+        ordered_ = ordered_ && rec.epoch >= last_epoch_;
+        last_epoch_ = rec.epoch;
+        std::string key(rec.key.data(), rec.key.size());
+        if (rec.op == ChangeOpPut)
+            replica_[key] = rec.value;
+        else
+            replica_.erase(key);
+    }
+};
+
+TEST_F(MtStructTest, ChangeFeed)
+{
+    BasicTable table;
+    LimboHandle *handle = ti_->new_handle();
+    table.initialize(ti_);
+
+    // 小环，反复回绕
+    ChangeFeed feed(1, ChangeFeed::min_ring_bytes);
+    table.set_change_feed(&feed);
+
+    ReplayVisitor replay;
+    char buf[64];
+    for (int i = 0; i < 5000; i++)
+    {
+        int k = (i * 7919) % 1500;
+        int n = snprintf(buf, sizeof(buf), i % 2 ? "%d" : "http://www.example.com/path/%d", k);
+        if (i % 5 == 4)
+            mt_remove(table, Slice(buf, n), ti_);
+        else
+            mt_put(table, Slice(buf, n), i, ti_);
+        if (i % 16 == 15)
+            feed.poll(replay);
+    }
+    feed.poll(replay);
+    table.set_change_feed(nullptr);
+    EXPECT_TRUE(replay.ordered_);
+    EXPECT_EQ(feed.read_lsn(), replay.last_lsn_ + 1);
+
+    CollectScanner c(~size_t(0));
+    table.scan(Slice(), true, c, ti_);
+    ASSERT_EQ(c.keys_.size(), replay.replica_.size());
+    size_t i = 0;
+    for (std::map<std::string, uint64_t>::iterator it = replay.replica_.begin();
+         it != replay.replica_.end(); ++it, ++i)
+    {
+        EXPECT_EQ(c.keys_[i], it->first);
+        EXPECT_EQ(c.values_[i], it->second);
+    }
+
+    table.destroy(ti_);
+    ti_->delete_handle(handle);
+    ti_->destroy();
+}
+
+TEST_F(MtStructTest, LongKeySuffix)
+{
+    BasicTable table;
+    LimboHandle *handle = ti_->new_handle();
+    table.initialize(ti_);
+
+    // 60~200字节的key, 同一个前缀下后缀不断变长，触发外部bag的扩容和分裂压缩
+    // key的比较会按8字节读，key放在足够大的缓冲区里
+    std::map<std::string, uint64_t> expect;
+    std::string prefix = "https://www.example.com/";
+    char kbuf[256];
+    for (int i = 0; i < 4000; i++)
+    {
+        int k = (i * 7919) % 4000;
+        std::string key = prefix + std::string(36 + k % 140, char('a' + k % 26)) + std::to_string(k);
+        memcpy(kbuf, key.data(), key.size());
+        mt_put(table, Slice(kbuf, key.size()), k, ti_);
+        expect[key] = k;
+        if (i % 4 == 3)
+        {
+            mt_remove(table, Slice(kbuf, key.size()), ti_);
+            expect.erase(key);
+        }
+    }
+
+    CollectScanner c(~size_t(0));
+    table.scan(Slice(), true, c, ti_);
+    ASSERT_EQ(c.keys_.size(), expect.size());
+    size_t i = 0;
+    for (std::map<std::string, uint64_t>::iterator it = expect.begin(); it != expect.end(); ++it, ++i)
+    {
+        EXPECT_EQ(c.keys_[i], it->first);
+        EXPECT_EQ(c.values_[i], it->second);
+        LeafValue v;
+        memcpy(kbuf, it->first.data(), it->first.size());
+        Slice key(kbuf, it->first.size());
+        EXPECT_TRUE(table.get(key, v, ti_));
+        EXPECT_EQ(v.value(), it->second);
+    }
+
+    table.destroy(ti_);
+    ti_->delete_handle(handle);
+    ti_->destroy();
+}
+
+TEST_F(MtStructTest, NegativeFilter)
+{
+    BasicTable table;
+    LimboHandle *handle = ti_->new_handle();
+    table.initialize(ti_);
+
+    char buf[64];
+    for (int i = 0; i < 10000; i += 2)
+        mt_put(table, Slice(buf, snprintf(buf, sizeof(buf), "key-%d", i)), i, ti_);
+    ti_->delete_handle(handle);
+
+    table.rebuild_filter(10000, ti_);
+    ASSERT_TRUE(table.filter() != nullptr);
+
+    handle = ti_->new_handle();
+    // 挂上过滤器之后的插入
+    for (int i = 10000; i < 12000; i += 2)
+        mt_put(table, Slice(buf, snprintf(buf, sizeof(buf), "key-%d", i)), i, ti_);
+
+    int false_positive = 0;
+    for (int i = 0; i < 12000; i++)
+    {
+        Slice key(buf, snprintf(buf, sizeof(buf), "key-%d", i));
+        LeafValue v;
+        bool found = table.get(key, v, ti_);
+        EXPECT_EQ(found, i % 2 == 0);
+        if (found)
+            EXPECT_EQ(v.value(), uint64_t(i));
+        else if (table.filter()->may_contain(key))
+            ++false_positive;
+    }
+    EXPECT_LT(false_positive, 6000 / 20);
+
+    // 删除之后重建，删除的key不再通过过滤器
+    for (int i = 0; i < 12000; i += 4)
+        mt_remove(table, Slice(buf, snprintf(buf, sizeof(buf), "key-%d", i)), ti_);
+    ti_->delete_handle(handle);
+    table.rebuild_filter(10000, ti_);
+
+    handle = ti_->new_handle();
+    int passed = 0;
+    for (int i = 0; i < 12000; i += 2)
+    {
+        Slice key(buf, snprintf(buf, sizeof(buf), "key-%d", i));
+        LeafValue v;
+        EXPECT_EQ(table.get(key, v, ti_), i % 4 != 0);
+        if (i % 4 == 0 && table.filter()->may_contain(key))
+            ++passed;
+    }
+    EXPECT_LT(passed, 3000 / 20);
+
+    table.remove_filter(ti_);
+    EXPECT_TRUE(table.filter() == nullptr);
+    ti_->delete_handle(handle);
+
+    // destroy连同过滤器一起释放
+    table.rebuild_filter(10000, ti_);
+    table.destroy(ti_);
+    EXPECT_TRUE(table.filter() == nullptr);
+    ti_->destroy();
+}
+
+TEST_F(MtStructTest, DestroyParallel)
+{
+    BasicTable table;
+    LimboHandle *handle = ti_->new_handle();
+    table.initialize(ti_);
+
+    char buf[128];
+    for (int i = 0; i < 30000; i++)
+    {
+        int n = snprintf(buf, sizeof(buf), i % 2 ? "%d" : "https://www.example.com/items/%d/detail", i);
+        mt_put(table, Slice(buf, n), i, ti_);
+    }
+    ti_->delete_handle(handle);
+    ti_->destroy();
+
+    // 每个块都被释放由mt-alloc-test统计free次数检查
+    table.destroy_parallel(4, true);
+    EXPECT_TRUE(table.root() == nullptr);
+}
+
+TEST_F(MtStructTest, Stats)
+{
+    BasicTable table;
+    LimboHandle *handle = ti_->new_handle();
+    table.initialize(ti_);
+
+    // 公共前缀形成一条layer链，下面的layer里是带后缀的key
+    const int nkeys = 20000;
+    char buf[128];
+    for (int i = 0; i < nkeys; i++)
+    {
+        int n = snprintf(buf, sizeof(buf), "user/%08d/profile", i * 7);
+        mt_put(table, Slice(buf, n), i, ti_);
+    }
+
+    TableStats s = table.stats(ti_);
+    EXPECT_FALSE(s.sampled);
+    EXPECT_EQ(uint64_t(nkeys), s.keys);
+    EXPECT_GT(s.layers, 1u);
+    EXPECT_GT(s.max_depth, 0u);
+    EXPECT_EQ(1u, s.layers_at_depth[0]);
+    EXPECT_GT(s.internodes, 0u);
+    EXPECT_GT(s.ksuf_used + s.iksuf_used, 0u);
+    uint64_t leaves = 0;
+    for (int i = 0; i < TableStats::fill_buckets; ++i)
+        leaves += s.fill[i];
+    EXPECT_EQ(s.leaves, leaves);
+
+    TableStats e = table.sample_stats(4000, ti_);
+    EXPECT_TRUE(e.sampled);
+    EXPECT_NEAR(double(s.leaves), double(e.leaves), s.leaves * 0.2);
+    EXPECT_NEAR(double(s.keys), double(e.keys), s.keys * 0.2);
+    EXPECT_NEAR(double(s.total_bytes()), double(e.total_bytes()), s.total_bytes() * 0.2);
+
+    ti_->delete_handle(handle);
+    table.destroy(ti_);
+}
+
+TEST_F(MtStructTest, Counters)
+{
+    BasicTable table;
+    LimboHandle *handle = ti_->new_handle();
+    table.initialize(ti_);
+
+    MtCounters before = mt_counters_snapshot();
+    char buf[128];
+    for (int i = 0; i < 5000; i++)
+    {
+        int n = snprintf(buf, sizeof(buf), "user/%08d/profile", i);
+        mt_put(table, Slice(buf, n), i, ti_);
+    }
+    MtCounters d = mt_counters_snapshot() - before;
+#if LF_MT_COUNTERS
+    EXPECT_GT(d.leaf_splits, 0u);
+    EXPECT_GT(d.internode_splits, 0u);
+    EXPECT_GT(d.new_layers, 0u);
+#else
+    EXPECT_EQ(0u, d.leaf_splits);
+    EXPECT_EQ(0u, d.new_layers);
+#endif
+
+    // 扫描时在刚交出的key后面插入，当前Leaf的版本变化，scan要重新定位
+    struct InsertingScanner
+    {
+        BasicTable &table_;
+        int n_;
+        void visit_leaf(const ScanStackElt &, const MtKey &, ThreadInfo *) {}
+        bool visit_value(Slice key, LeafValue &, ThreadInfo *ti)
+        {
+            if (++n_ <= 100)
+            {
+                std::string k(key.data(), key.size());
+                k += "/x";
+                mt_put(table_, Slice(k), n_, ti);
+            }
+            return true;
+        }
+    } ins = {table, 0};
+    before = mt_counters_snapshot();
+    table.scan(Slice(), true, ins, ti_);
+    d = mt_counters_snapshot() - before;
+    EXPECT_GE(ins.n_, 5000);
+#if LF_MT_COUNTERS
+    EXPECT_GT(d.scan_changed, 0u);
+#else
+    EXPECT_EQ(0u, d.scan_changed);
+#endif
+
+    ti_->delete_handle(handle);
+    table.destroy(ti_);
+}
+
+TEST_F(MtStructTest, HotIndex)
+{
+    BasicTable table;
+    LimboHandle *handle = ti_->new_handle();
+    table.initialize(ti_);
+    table.enable_hot_index(1024, ti_);
+
+    const int nkeys = 3000;
+    char buf[256];
+    auto make_key = [&](int i) {
+        if (i % 3 == 0)
+            return snprintf(buf, sizeof(buf), "%d", i);
+        else if (i % 3 == 1)
+            return snprintf(buf, sizeof(buf), "user/%08d/profile", i);
+        return snprintf(buf, sizeof(buf), "https://www.example.com/a/very/long/path/%d", i);
+    };
+    for (int i = 0; i < nkeys; i++)
+        mt_put(table, Slice(buf, make_key(i)), i, ti_);
+
+    MtCounters before = mt_counters_snapshot();
+    for (int round = 0; round < 2; round++)
+    {
+        for (int i = 0; i < nkeys; i++)
+        {
+            Slice key(buf, make_key(i));
+            LeafValue v;
+            ASSERT_TRUE(table.get(key, v, ti_));
+            EXPECT_EQ(uint64_t(i), v.value());
+        }
+    }
+#if LF_MT_COUNTERS
+    EXPECT_GT((mt_counters_snapshot() - before).hot_index_hits, 0u);
+#else
+    (void)before;
+#endif
+
+    // 原地更新不改变版本，命中的槽要读到新值
+    for (int i = 0; i < nkeys; i++)
+        mt_put(table, Slice(buf, make_key(i)), i + 1, ti_);
+    // 删掉前一半，空的Leaf被回收后旧的槽全部失效
+    for (int i = 0; i < nkeys / 2; i++)
+        mt_remove(table, Slice(buf, make_key(i)), ti_);
+    for (int i = 0; i < nkeys; i++)
+    {
+        Slice key(buf, make_key(i));
+        LeafValue v;
+        bool found = table.get(key, v, ti_);
+        ASSERT_EQ(i >= nkeys / 2, found) << i;
+        if (found)
+        {
+            EXPECT_EQ(uint64_t(i + 1), v.value());
+        }
+    }
+
+#if LF_MT_COUNTERS
+    // 代数是每个表自己的：另一个表回收Leaf不会让这个表的槽失效
+    auto hot_pass = [&]() {
+        MtCounters start = mt_counters_snapshot();
+        for (int i = nkeys / 2; i < nkeys; i++)
+        {
+            Slice key(buf, make_key(i));
+            LeafValue v;
+            EXPECT_TRUE(table.get(key, v, ti_));
+        }
+        return (mt_counters_snapshot() - start).hot_index_hits;
+    };
+    hot_pass();
+    uint64_t quiet_hits = hot_pass();
+    EXPECT_GT(quiet_hits, 0u);
+    BasicTable other;
+    other.initialize(ti_);
+    for (int i = 0; i < 2000; i++)
+        mt_put(other, Slice(buf, make_key(i)), i, ti_);
+    for (int i = 0; i < 2000; i++)
+        mt_remove(other, Slice(buf, make_key(i)), ti_);
+    EXPECT_EQ(quiet_hits, hot_pass());
+    other.destroy(ti_);
+#endif
+
+    // destroy连同热点索引一起释放
+    ti_->delete_handle(handle);
+    table.destroy(ti_);
+    EXPECT_TRUE(table.hot_index() == nullptr);
+}
+
+TEST_F(MtStructTest, HotIndexLayerCollision)
+{
+    BasicTable table;
+    LimboHandle *handle = ti_->new_handle();
+    table.initialize(ti_);
+    table.enable_hot_index(1024, ti_);
+
+    // 两个key前8字节相同, 都在第二层layer里
+    Slice hot("00000005/tail");
+    mt_put(table, hot, 111, ti_);
+    mt_put(table, Slice("00000005/other"), 222, ti_);
+
+    // 找一个hash相同、前缀不同、shift之后相同的key
+    char buf[32];
+    int n = 0;
+    uint32_t h = HotLeafIndex::hash_key(hot);
+    for (int i = 6; i < 100000000; i++)
+    {
+        n = snprintf(buf, sizeof(buf), "%08d/tail", i);
+        if (HotLeafIndex::hash_key(Slice(buf, n)) == h)
+            break;
+        n = 0;
+    }
+    ASSERT_GT(n, 0);
+
+    LeafValue v;
+    for (int round = 0; round < 2; round++)
+    {
+        ASSERT_TRUE(table.get(hot, v, ti_));
+        EXPECT_EQ(111u, v.value());
+    }
+    Slice other(buf, n);
+    EXPECT_FALSE(table.get(other, v, ti_)) << buf;
+
+    table.disable_hot_index(ti_);
+    ti_->delete_handle(handle);
+    table.destroy(ti_);
+}
+
+struct AsyncResult
+{
+    bool done_;
+    bool found_;
+    uint64_t value_;
+    uint64_t sum_;
+
+    static void done(void *arg, bool found, uint64_t value)
+    {
+        AsyncResult *r = static_cast<AsyncResult *>(arg);
+        r->done_ = true;
+        r->found_ = found;
+        r->value_ = value;
+    }
+
+    static bool visit(void *arg, Slice, uint64_t value)
+    {
+        static_cast<AsyncResult *>(arg)->sum_ += value;
+        return true;
+    }
+};
+
+TEST_F(MtStructTest, AsyncExecutor)
+{
+    BasicTable table;
+    table.initialize(ti_);
+
+    const int nkeys = 4000;
+    std::vector<std::string> keys;
+    for (int i = 0; i < nkeys; i++)
+    {
+        char buf[128];
+        int n = snprintf(buf, sizeof(buf), i % 2 ? "%d" : "https://www.example.com/items/%d/detail", i);
+        // equals_sloppy按8字节读，留出余量
+        keys.push_back(std::string(buf, n) + std::string(8, '\0'));
+        keys.back().resize(n);
+    }
+
+    std::vector<AsyncResult> res(nkeys);
+    {
+        MtExecutor ex(table, ti_, 8);
+        for (int i = 0; i < nkeys; i++)
+            ex.put(Slice(keys[i]), i, AsyncResult::done, &res[i]);
+        ex.drain();
+        for (int i = 0; i < nkeys; i++)
+        {
+            ASSERT_TRUE(res[i].done_);
+            EXPECT_FALSE(res[i].found_);
+        }
+
+        res.assign(nkeys, AsyncResult());
+        for (int i = 0; i < nkeys; i++)
+            ex.get(Slice(keys[i]), AsyncResult::done, &res[i]);
+        AsyncResult miss = AsyncResult();
+        ex.get(Slice("no such key\0\0\0\0\0\0\0\0", 11), AsyncResult::done, &miss);
+        ex.drain();
+        for (int i = 0; i < nkeys; i++)
+        {
+            ASSERT_TRUE(res[i].done_);
+            EXPECT_TRUE(res[i].found_);
+            EXPECT_EQ(uint64_t(i), res[i].value_);
+        }
+        EXPECT_TRUE(miss.done_);
+        EXPECT_FALSE(miss.found_);
+
+        AsyncResult sr = AsyncResult();
+        ex.scan(Slice(), 100, AsyncResult::visit, AsyncResult::done, &sr);
+        ex.drain();
+        EXPECT_TRUE(sr.found_);
+        EXPECT_EQ(100u, sr.value_);
+        EXPECT_EQ(0u, ex.inflight());
+
+        // 操作不断提交时在途数不会降到0, 执行器仍然要定期换handle, 不能一直挡住epoch
+        res.assign(nkeys, AsyncResult());
+        for (int i = 0; i < nkeys; i++)
+        {
+            if (i % 100 == 0)
+                try_advance_epoch(atomic_load_relaxed(&global_epoch));
+            ex.get(Slice(keys[i]), AsyncResult::done, &res[i]);
+            ASSERT_LE(atomic_load_relaxed(&global_epoch) - min_active_epoch(),
+                      Epoch(MtExecutor::max_handle_epochs + 1));
+        }
+        ex.drain();
+        for (int i = 0; i < nkeys; i++)
+        {
+            ASSERT_TRUE(res[i].done_);
+            EXPECT_EQ(uint64_t(i), res[i].value_);
+        }
+    }
+
+    LimboHandle *handle = ti_->new_handle();
+    table.destroy(ti_);
+    ti_->delete_handle(handle);
+}
+
+TEST_F(MtStructTest, Tombstones)
+{
+    BasicTable table;
+    table.initialize(ti_);
+    table.set_lazy_delete(true);
+
+    const int nkeys = 3000;
+    char buf[128];
+    auto make_key = [&](int i) {
+        if (i % 3 == 0)
+            return snprintf(buf, sizeof(buf), "%08d", i);
+        return snprintf(buf, sizeof(buf), "prefix-longkey-%06d/suffix", i);
+    };
+
+    LimboHandle *handle = ti_->new_handle();
+    for (int i = 0; i < nkeys; i++)
+        mt_put(table, Slice(buf, make_key(i)), i, ti_);
+    for (int i = 1; i < nkeys; i += 2)
+        mt_remove(table, Slice(buf, make_key(i)), ti_);
+    // 删除已经是墓碑的key等同于删除不存在的key
+    for (int i = 1; i < nkeys; i += 4)
+        mt_remove(table, Slice(buf, make_key(i)), ti_);
+    // 重新插入一部分，墓碑被清掉
+    for (int i = 1; i < nkeys; i += 10)
+    {
+        TCursor lp(table, Slice(buf, make_key(i)));
+        EXPECT_FALSE(lp.find_insert(ti_));
+        lp.value() = i + 1;
+        lp.finish(1, ti_);
+    }
+
+    auto live = [](int i) { return i % 2 == 0 || i % 10 == 1; };
+    auto check = [&]() {
+        uint64_t count = 0, sum = 0;
+        for (int i = 0; i < nkeys; i++)
+        {
+            Slice key(buf, make_key(i));
+            LeafValue v;
+            bool found = table.get(key, v, ti_);
+            ASSERT_EQ(live(i), found) << i;
+            if (!found)
+                continue;
+            uint64_t expect = i % 2 ? i + 1 : i;
+            EXPECT_EQ(expect, v.value());
+            ++count;
+            sum += expect;
+        }
+
+        CollectScanner cs(nkeys);
+        table.scan(Slice(), true, cs, ti_);
+        EXPECT_EQ(count, cs.keys_.size());
+        CollectScanner rs(nkeys);
+        table.rscan(Slice("\xff"), true, rs, ti_);
+        EXPECT_EQ(count, rs.keys_.size());
+        ScanAggregate agg = table.aggregate(Slice(), Slice(), ti_);
+        EXPECT_EQ(count, agg.count);
+        EXPECT_EQ(sum, agg.sum);
+    };
+    check();
+    ti_->delete_handle(handle);
+
+    size_t tombs = 0;
+    for (int i = 0; i < nkeys; i++)
+        tombs += !live(i);
+    EXPECT_EQ(uint64_t(tombs), table.tombstones());
+    EXPECT_EQ(tombs, table.reclaim_tombstones(ti_, 100));
+    EXPECT_EQ(0u, table.tombstones());
+    EXPECT_EQ(0u, table.reclaim_tombstones(ti_));
+
+    handle = ti_->new_handle();
+    check();
+    EXPECT_EQ(uint64_t(nkeys - tombs), table.stats(ti_).keys);
+    // 后台回收
+    for (int i = 0; i < nkeys; i += 2)
+        mt_remove(table, Slice(buf, make_key(i)), ti_);
+    ti_->delete_handle(handle);
+    EXPECT_EQ(uint64_t(nkeys / 2), table.tombstones());
+    {
+        TombstoneReclaimer r(table, ti_, 1);
+        r.start();
+        r.stop();
+        EXPECT_EQ(uint64_t(nkeys / 2), r.reclaimed());
+    }
+    EXPECT_EQ(0u, table.tombstones());
+
+    handle = ti_->new_handle();
+    EXPECT_EQ(uint64_t(nkeys / 10), table.stats(ti_).keys);
+    table.destroy(ti_);
+    ti_->delete_handle(handle);
+}
+
+TEST_F(MtStructTest, ShardedTable)
+{
+    const int nkeys = 5000;
+    std::map<std::string, uint64_t> expect;
+    char buf[128];
+    for (int i = 0; i < nkeys; i++)
+    {
+        int n = snprintf(buf, sizeof(buf), i % 2 ? "%c/%d" : "%c/item/%08d/payload", 'a' + i % 26, i);
+        expect[std::string(buf, n)] = i;
+    }
+
+    for (int mode = 0; mode < 2; mode++)
+    {
+        ShardedTable st;
+        if (mode == 0)
+            st.initialize_range({"f", "m", "m/", "t"}, ti_);
+        else
+            st.initialize_hash(7, ti_);
+        LimboHandle *handle = ti_->new_handle();
+        for (auto &kv : expect)
+            mt_put(st.table_for(Slice(kv.first)), Slice(kv.first), kv.second, ti_);
+
+        for (auto &kv : expect)
+        {
+            Slice key(kv.first);
+            LeafValue v;
+            ASSERT_TRUE(st.get(key, v, ti_));
+            EXPECT_EQ(kv.second, v.value());
+        }
+        if (mode == 0)
+        {
+            EXPECT_EQ(0, st.shard_of(Slice("a")));
+            EXPECT_EQ(2, st.shard_of(Slice("m")));
+            EXPECT_EQ(3, st.shard_of(Slice("m/1")));
+            EXPECT_EQ(4, st.shard_of(Slice("z")));
+        }
+
+        // 整表有序scan, 以及从中间开始、提前停止的scan
+        CollectScanner all(nkeys + 1);
+        EXPECT_EQ(nkeys, st.scan(Slice(), true, all, ti_, 50));
+        ASSERT_EQ(expect.size(), all.keys_.size());
+        size_t k = 0;
+        for (auto &kv : expect)
+        {
+            EXPECT_EQ(kv.first, all.keys_[k]);
+            EXPECT_EQ(kv.second, all.values_[k]);
+            ++k;
+        }
+
+        auto from = expect.lower_bound("k/");
+        CollectScanner part(300);
+        st.scan(Slice(from->first), false, part, ti_, 16);
+        ASSERT_EQ(300u, part.keys_.size());
+        ++from;
+        for (size_t i = 0; i < part.keys_.size(); ++i, ++from)
+            EXPECT_EQ(from->first, part.keys_[i]);
+
+        EXPECT_EQ(uint64_t(nkeys), st.stats(ti_).keys);
+        uint64_t sum = 0;
+        for (int i = 0; i < st.nshards(); i++)
+            sum += st.shard_stats(i, ti_).keys;
+        EXPECT_EQ(uint64_t(nkeys), sum);
+
+        // 按home分给工作线程，每个shard恰好处理一次
+        std::vector<int> visited(st.nshards());
+        for (int i = 0; i < st.nshards(); i++)
+            st.set_home(i, st.nshards() - i);
+        st.for_each_shard(3, [&](int shard, BasicTable &, int t) {
+            EXPECT_EQ(st.home(shard) % 3, t);
+            ++visited[shard];
+        });
+        for (int i = 0; i < st.nshards(); i++)
+            EXPECT_EQ(1, visited[i]);
+
+        // shard上的过滤器和热点索引由destroy一起释放
+        ti_->delete_handle(handle);
+        for (int i = 0; i < st.nshards(); i++)
+        {
+            st.shard(i).rebuild_filter(nkeys, ti_);
+            st.shard(i).enable_hot_index(64, ti_);
+        }
+        st.destroy(ti_);
+    }
+    ti_->destroy();
+}
 
 } // namespace lf
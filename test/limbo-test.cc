@@ -1,7 +1,13 @@
 #include "lf/limbo.hh"
+#include "lf/lf.hh"
 #include "lf/time_util.hh"
 #include "lf/logger.hh"
 #include <thread>
+#include <chrono>
+#include <algorithm>
+#include <mutex>
+#include <deque>
+#include <assert.h>
 
 /*
 因为全局锁的原因，增加线程数量并没有提高系统吞吐量。
@@ -57,6 +63,16 @@ total loop_cnt 80000000 in 8896298 micros, 8.9925e+06/s
 可以明显观察到atomic对并发的影响，四个线程的性能相对三个线程还有下滑。
 */
 
+/*
+new_handle改为只读global_epoch之后(每64次new_handle尝试一次CAS推进，或者由ticker推进)，
+scaling_test按1, 2, 4, ..., 64个线程各跑一遍，每个线程2000000次。
+下面是在单核机器上测的总吞吐量(ops/s)，只说明线程变多时不会因为争抢global_epoch而变慢，
+多核上的扩展性没有测过:
+    线程数      1      2      4      8      16     32     64
+    ticker关    6.98M  6.62M  6.72M  7.30M  6.58M  4.77M  4.61M
+    ticker开    7.36M  4.75M  5.63M  5.54M  5.16M  4.96M  4.58M
+*/
+
 struct Ctx
 {
     uint64_t begin;
@@ -95,9 +111,12 @@ void single_thread_test(Ctx *ctx)
             (double)(ctx->loop_cnt) / d);
 }
 
-void multi_thread_test(int thd_no)
+void multi_thread_test(int thd_no, int64_t loop_cnt = 20000000, bool ticker = false)
 {
     lf::g_all_threads = new std::vector<lf::ThreadInfo>(thd_no);
+    // ticker会遍历g_all_threads, 只在它存在期间运行
+    if (ticker)
+        lf::start_epoch_ticker(1000);
     Ctx *ctx = new Ctx[thd_no];
     uint64_t min_begin = 0xffffffffffffffffUL;
     uint64_t max_end = 0;
@@ -106,7 +125,7 @@ void multi_thread_test(int thd_no)
     for (int i = 0; i < thd_no; i++)
     {
         ctx[i].i = i;
-        ctx[i].loop_cnt = 2e7;
+        ctx[i].loop_cnt = loop_cnt;
         ctx[i].ti = &((*lf::g_all_threads)[i]);
         ctx[i].thd = new std::thread(single_thread_test, ctx + i);
     }
@@ -129,6 +148,346 @@ void multi_thread_test(int thd_no)
             (double)total_loop / d);
 
     delete[] ctx;
+    if (ticker)
+        lf::stop_epoch_ticker();
+    for (int i = 0; i < thd_no; i++)
+        (*lf::g_all_threads)[i].destroy();
+    delete lf::g_all_threads;
+    lf::g_all_threads = nullptr;
+}
+
+void scaling_test(bool ticker)
+{
+    lf::log("scaling test, epoch ticker %s", ticker ? "on" : "off");
+    for (int n = 1; n <= 64; n *= 2)
+        multi_thread_test(n, 2000000, ticker);
+}
+
+/*
+一个工作线程每次请求打开handle, 释放16个对象后关闭handle, 统计每次请求的延迟分布。
+inline模式下delete_handle中的hard_free一次释放大批对象，造成延迟尖刺；
+后台回收模式下工作线程只追加limbo, 释放都在回收线程(用第二个ThreadInfo)上。
+*/
+void latency_test(bool background)
+{
+    lf::g_all_threads = new std::vector<lf::ThreadInfo>(2);
+    lf::ThreadInfo *ti = &(*lf::g_all_threads)[0];
+    if (background)
+        lf::start_background_reclaimer(&(*lf::g_all_threads)[1], 100);
+
+    const int loop_cnt = 2000000;
+    std::vector<uint32_t> lat(loop_cnt);
+    for (int i = 0; i < loop_cnt; i++)
+    {
+        auto begin = std::chrono::steady_clock::now();
+        lf::LimboHandle *handle = ti->new_handle();
+        for (int k = 0; k < 16; k++)
+            handle->dealloc(handle->alloc(64));
+        ti->delete_handle(handle);
+        auto end = std::chrono::steady_clock::now();
+        lat[i] = uint32_t(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+    }
+
+    if (background)
+        lf::stop_background_reclaimer();
+    std::sort(lat.begin(), lat.end());
+    lf::log("%s reclaim: p50 %u ns, p99 %u ns, p99.9 %u ns, max %u ns",
+            background ? "background" : "inline",
+            lat[loop_cnt / 2], lat[loop_cnt * 99 / 100], lat[loop_cnt * 999 / 1000], lat[loop_cnt - 1]);
+
+    for (size_t i = 0; i < lf::g_all_threads->size(); i++)
+        (*lf::g_all_threads)[i].destroy();
+    delete lf::g_all_threads;
+    lf::g_all_threads = nullptr;
+}
+
+/*
+可迁移的handle: 每个线程打开一个handle, 读出共享对象后连同handle放进公共队列，
+再从队列里取出一个(多半是别的线程打开的)，在本线程上继续用它替换共享对象并关闭。
+handle关闭之前它读到的对象不能被释放。
+*/
+struct MigrateItem
+{
+    lf::LimboHandle *handle;
+    uint64_t *obj;
+};
+
+static uint64_t *volatile g_shared_obj = nullptr;
+static std::mutex g_migrate_mutex;
+static std::deque<MigrateItem> g_migrate_queue;
+
+static bool migrate_step(lf::ThreadInfo *ti)
+{
+    MigrateItem item;
+    {
+        std::lock_guard<std::mutex> guard(g_migrate_mutex);
+        if (g_migrate_queue.empty())
+            return false;
+        item = g_migrate_queue.front();
+        g_migrate_queue.pop_front();
+    }
+    ti->resume_handle(item.handle);
+    assert(*item.obj == 0x5a5a5a5a5a5a5a5aUL);
+    uint64_t *obj = (uint64_t *)item.handle->alloc(64);
+    *obj = 0x5a5a5a5a5a5a5a5aUL;
+    uint64_t *old = (uint64_t *)lf::atomic_xchgptr((void *volatile *)&g_shared_obj, obj);
+    item.handle->dealloc(old);
+    ti->delete_handle(item.handle);
+    return true;
+}
+
+static void migrate_thread(lf::ThreadInfo *ti, int64_t loop_cnt)
+{
+    for (int64_t i = 0; i < loop_cnt; i++)
+    {
+        MigrateItem item;
+        item.handle = ti->new_migratable_handle();
+        item.obj = (uint64_t *)lf::atomic_loadptr((void *volatile *)&g_shared_obj);
+        {
+            std::lock_guard<std::mutex> guard(g_migrate_mutex);
+            g_migrate_queue.push_back(item);
+        }
+        migrate_step(ti);
+    }
+    while (migrate_step(ti))
+        ;
+}
+
+void migrate_test(int thd_no, int64_t loop_cnt)
+{
+    lf::g_all_threads = new std::vector<lf::ThreadInfo>(thd_no);
+    // 之后会被dealloc, 所以也要用带块头的alloc_block分配
+    g_shared_obj = (uint64_t *)lf::ThreadInfo::alloc_block(64);
+    *g_shared_obj = 0x5a5a5a5a5a5a5a5aUL;
+
+    uint64_t begin = lf::now_micros();
+    std::vector<std::thread> thds;
+    for (int i = 0; i < thd_no; i++)
+        thds.push_back(std::thread(migrate_thread, &(*lf::g_all_threads)[i], loop_cnt));
+    for (int i = 0; i < thd_no; i++)
+        thds[i].join();
+    assert(g_migrate_queue.empty());
+    assert(lf::min_bucket_epoch() == 1UL << 63);
+    lf::log("migrate %d threads loop_cnt %lld in %lld micros",
+            thd_no, (long long)loop_cnt, (long long)(lf::now_micros() - begin));
+
+    lf::ThreadInfo::free_block(g_shared_obj);
+    g_shared_obj = nullptr;
+    for (int i = 0; i < thd_no; i++)
+        (*lf::g_all_threads)[i].destroy();
+    delete lf::g_all_threads;
+    lf::g_all_threads = nullptr;
+}
+
+/*
+线程0打开一个handle后长时间不关闭(停住的scan), 线程1不断分配释放，limbo只增不减。
+超过水位后报告指向线程0; 打开re-pin策略后线程0在安全点换到新epoch, limbo降回去。
+*/
+/*
+可迁移handle首尾相接：每个handle关闭之前下一个已经打开，global_epoch每次前进一圈(epoch_bucket_count)，
+新handle都会落在同一个桶上。计入的epoch不能一直停在第一个handle的epoch上。
+*/
+void bucket_lag_test()
+{
+    lf::g_all_threads = new std::vector<lf::ThreadInfo>(1);
+    lf::ThreadInfo *ti = &(*lf::g_all_threads)[0];
+    lf::LimboHandle *prev = ti->new_migratable_handle();
+    for (int i = 0; i < 100; i++)
+    {
+        for (int k = 0; k < lf::epoch_bucket_count; k++)
+            lf::try_advance_epoch(lf::atomic_load_relaxed(&lf::global_epoch));
+        lf::LimboHandle *cur = ti->new_migratable_handle();
+        ti->delete_handle(prev);
+        prev = cur;
+        lf::Epoch now = lf::atomic_load_relaxed(&lf::global_epoch);
+        assert(now - lf::min_bucket_epoch() <= 2 * lf::epoch_bucket_count);
+        (void)now;
+    }
+    ti->delete_handle(prev);
+    assert(lf::min_bucket_epoch() == 1UL << 63);
+    ti->destroy();
+    delete lf::g_all_threads;
+    lf::g_all_threads = nullptr;
+}
+
+void stall_test()
+{
+    lf::g_all_threads = new std::vector<lf::ThreadInfo>(2);
+    lf::ThreadInfo *reader = &(*lf::g_all_threads)[0];
+    lf::ThreadInfo *writer = &(*lf::g_all_threads)[1];
+    lf::set_limbo_policy(1 << 20, 0);
+
+    lf::LimboHandle *scan = reader->new_handle();
+    for (int i = 0; i < 100000 && !lf::limbo_pressure; i++)
+    {
+        lf::LimboHandle *handle = writer->new_handle();
+        handle->dealloc(handle->alloc(64));
+        writer->delete_handle(handle);
+    }
+    assert(lf::limbo_pressure);
+    lf::LimboReport r = lf::limbo_report();
+    r.print();
+    assert(r.oldest_thread == 0 && r.oldest_epoch == scan->epoch());
+    assert(!scan->should_repin());
+
+    lf::set_limbo_policy(1 << 20, 1000);
+    assert(scan->should_repin());
+    reader->repin(scan);
+    for (int i = 0; i < 100000 && lf::limbo_pressure; i++)
+    {
+        lf::LimboHandle *handle = writer->new_handle();
+        handle->dealloc(handle->alloc(64));
+        writer->delete_handle(handle);
+    }
+    assert(!lf::limbo_pressure);
+    lf::limbo_report().print();
+
+    reader->delete_handle(scan);
+    lf::set_limbo_policy(0, 0);
+    for (size_t i = 0; i < lf::g_all_threads->size(); i++)
+        (*lf::g_all_threads)[i].destroy();
+    assert(lf::limbo_report().objects == 0);
+    delete lf::g_all_threads;
+    lf::g_all_threads = nullptr;
+}
+
+/*
+epoch回收与区间回收的比较。线程1的每次请求打开区间handle, protect读共享对象，
+换上新对象后释放旧的。stall时线程0先打开一个区间handle读一次共享对象后就不再前进：
+epoch回收时limbo一直增长，区间回收时它只挡住出生不晚于它读到的epoch的对象。
+没有stall时比较两者的吞吐量，即protect和出生epoch的开销。
+单核上测得epoch回收4.69M ops/s, 区间回收4.19M ops/s, 区间回收约慢11%。
+*/
+static uint64_t *volatile g_era_obj = nullptr;
+static const uint64_t era_magic = 0x5a5a5a5a5a5a5a5aUL;
+
+void reclaim_benchmark(lf::ReclaimMode mode, bool stall)
+{
+    lf::reclaim_mode = mode;
+    lf::g_all_threads = new std::vector<lf::ThreadInfo>(2);
+    lf::ThreadInfo *reader = &(*lf::g_all_threads)[0];
+    lf::ThreadInfo *writer = &(*lf::g_all_threads)[1];
+    g_era_obj = (uint64_t *)writer->alloc(64);
+    *g_era_obj = era_magic;
+
+    lf::LimboHandle *stalled = nullptr;
+    uint64_t *stalled_obj = nullptr;
+    if (stall)
+    {
+        stalled = reader->new_interval_handle();
+        stalled_obj = stalled->protect(&g_era_obj);
+    }
+
+    const int64_t loop_cnt = 1000000;
+    int64_t peak = 0;
+    uint64_t begin = lf::now_micros();
+    for (int64_t i = 0; i < loop_cnt; i++)
+    {
+        lf::LimboHandle *handle = writer->new_interval_handle();
+        uint64_t *cur = handle->protect(&g_era_obj);
+        assert(*cur == era_magic);
+        uint64_t *obj = (uint64_t *)handle->alloc(64);
+        *obj = era_magic;
+        uint64_t *old = (uint64_t *)lf::atomic_xchgptr((void *volatile *)&g_era_obj, obj);
+        handle->dealloc(old);
+        writer->delete_handle(handle);
+        if (i % 4096 == 0)
+            peak = std::max(peak, lf::limbo_report().bytes);
+    }
+    uint64_t micros = lf::now_micros() - begin;
+
+    if (stalled)
+    {
+        assert(*stalled_obj == era_magic);
+        reader->delete_handle(stalled);
+    }
+    lf::log("%s reclaim%s: %g ops/s, peak limbo %lld bytes",
+            mode == lf::reclaim_interval ? "interval" : "epoch", stall ? " with stalled reader" : "",
+            loop_cnt / (micros * 1e-6), (long long)peak);
+
+    lf::ThreadInfo::free_block(g_era_obj);
+    g_era_obj = nullptr;
+    for (size_t i = 0; i < lf::g_all_threads->size(); i++)
+        (*lf::g_all_threads)[i].destroy();
+    delete lf::g_all_threads;
+    lf::g_all_threads = nullptr;
+    lf::reclaim_mode = lf::reclaim_epoch;
+}
+
+/*
+线程0打开handle不关闭，线程1每次请求defer一项工作(arg从内存池分配，执行时还回去)，
+handle关闭之前一项都不能执行，关闭之后全部执行。再和每项一个MrcuCallback比较开销,
+先跑的一轮受前面的堆状态影响，交替跑两轮。
+*/
+static int64_t g_deferred_runs = 0;
+
+static void deferred_work(void *arg, lf::ThreadInfo *ti)
+{
+    ++g_deferred_runs;
+    ti->release(arg, lf::ThreadInfo::pool_tag(64));
+}
+
+// 关闭空的handle推进epoch, 直到执行完expected项
+static void drain_deferred(lf::ThreadInfo *ti, int64_t expected)
+{
+    for (int i = 0; i < 100000 && g_deferred_runs < expected; i++)
+        ti->delete_handle(ti->new_handle());
+    assert(g_deferred_runs == expected);
+}
+
+struct CountingCallback : public lf::MrcuCallback
+{
+    void operator()(lf::ThreadInfo *ti)
+    {
+        ++g_deferred_runs;
+        lf::ThreadInfo::free_block(this);
+    }
+};
+
+void defer_test()
+{
+    lf::g_all_threads = new std::vector<lf::ThreadInfo>(2);
+    lf::ThreadInfo *reader = &(*lf::g_all_threads)[0];
+    lf::ThreadInfo *writer = &(*lf::g_all_threads)[1];
+    const int64_t loop_cnt = 1000000;
+
+    g_deferred_runs = 0;
+    lf::LimboHandle *scan = reader->new_handle();
+    for (int64_t i = 0; i < loop_cnt; i++)
+    {
+        lf::LimboHandle *handle = writer->new_handle();
+        writer->defer(&deferred_work, writer->alloc(64, lf::ThreadInfo::pool_tag(64)));
+        writer->delete_handle(handle);
+    }
+    assert(g_deferred_runs == 0);
+    reader->delete_handle(scan);
+    drain_deferred(writer, loop_cnt);
+
+    for (int pass = 0; pass < 4; pass++)
+    {
+        bool batched = pass % 2;
+        g_deferred_runs = 0;
+        uint64_t begin = lf::now_micros();
+        for (int64_t i = 0; i < loop_cnt; i++)
+        {
+            lf::LimboHandle *handle = writer->new_handle();
+            if (batched)
+                writer->defer(&deferred_work, writer->alloc(64, lf::ThreadInfo::pool_tag(64)));
+            else
+                writer->register_rcu(new (writer->alloc(sizeof(CountingCallback))) CountingCallback());
+            writer->delete_handle(handle);
+        }
+        drain_deferred(writer, loop_cnt);
+        uint64_t micros = lf::now_micros() - begin;
+        lf::log("%s: %g ops/s", batched ? "defer" : "register_rcu", loop_cnt / (micros * 1e-6));
+    }
+
+    for (size_t i = 0; i < lf::g_all_threads->size(); i++)
+        (*lf::g_all_threads)[i].destroy();
+    assert(g_deferred_runs == loop_cnt);
+    assert(lf::limbo_report().objects == 0);
+    delete lf::g_all_threads;
+    lf::g_all_threads = nullptr;
 }
 
 int main(int argc, char *argv[])
@@ -138,6 +497,18 @@ int main(int argc, char *argv[])
     multi_thread_test(2);
     multi_thread_test(3); 
     multi_thread_test(4);    
+    scaling_test(false);
+    scaling_test(true);
+    latency_test(false);
+    latency_test(true);
+    migrate_test(4, 1000000);
+    bucket_lag_test();
+    stall_test();
+    defer_test();
+    reclaim_benchmark(lf::reclaim_epoch, false);
+    reclaim_benchmark(lf::reclaim_interval, false);
+    reclaim_benchmark(lf::reclaim_epoch, true);
+    reclaim_benchmark(lf::reclaim_interval, true);
 
     return 0;
 }
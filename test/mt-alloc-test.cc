@@ -0,0 +1,246 @@
+#include "lf/logger.hh"
+#include "lf/masstree.hh"
+#include "lf/lf.hh"
+#include "lf/wfmcas.hh"
+#include <stdlib.h>
+
+using namespace lf;
+
+/*
+    统计get/update/scan过程中的堆分配次数，这些操作都应该是0次。
+    插入新key只为新的节点和外部ksuf分配，TCursor本身不分配: 分配次数不超过
+    新表的节点数加上外部ksuf的分配次数，ksuf每次至少一行、按2倍增长，总共不超过2*ksuf_bytes/64次。
+    mcas(vector和MCasDescriptor两种接口)预热之后helper和CasRow都来自回收池，也应该是0次。
+    通过替换malloc/calloc/realloc计数，operator new最终也会走到malloc。
+    destroy_parallel在多个线程上释放，这部分用所有线程共享的计数，也替换free:
+    释放减去分配必须正好等于树里的Leaf、InterNode和外部ksuf块数(包括下层layer里的)，
+    再加上挂在表上的过滤器和热点索引。
+*/
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+extern "C" void __libc_free(void *p);
+
+static __thread bool g_counting = false;
+static __thread uint64_t g_allocs = 0;
+// 所有线程的释放次数减去分配次数
+static volatile int32_t g_counting_frees = 0;
+static volatile int64_t g_net_frees = 0;
+
+extern "C" void *malloc(size_t size)
+{
+    if (g_counting)
+        ++g_allocs;
+    if (g_counting_frees)
+        atomic_add64(&g_net_frees, -1);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+    if (g_counting)
+        ++g_allocs;
+    if (g_counting_frees)
+        atomic_add64(&g_net_frees, -1);
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size)
+{
+    if (g_counting)
+        ++g_allocs;
+    if (g_counting_frees && !p)
+        atomic_add64(&g_net_frees, -1);
+    return __libc_realloc(p, size);
+}
+
+extern "C" void free(void *p)
+{
+    if (g_counting_frees && p)
+        atomic_add64(&g_net_frees, 1);
+    __libc_free(p);
+}
+
+struct NopScanner
+{
+    int n_;
+
+    void visit_leaf(const ScanStackElt &, const MtKey &, ThreadInfo *)
+    {
+    }
+
+    bool visit_value(Slice, LeafValue &, ThreadInfo *)
+    {
+        return ++n_ < 100;
+    }
+};
+
+static int make_key(int i, char *buf, size_t len)
+{
+    if (i % 3 == 0)
+        return snprintf(buf, len, "%d", i);
+    else if (i % 3 == 1)
+        return snprintf(buf, len, "user/%08d/profile", i);
+    return snprintf(buf, len, "http://www.example.com/a/very/long/path/%d", i);
+}
+
+template <typename F>
+static uint64_t count_allocs(F f)
+{
+    g_allocs = 0;
+    g_counting = true;
+    f();
+    g_counting = false;
+    return g_allocs;
+}
+
+template <typename F>
+static int64_t count_net_frees(F f)
+{
+    atomic_store_relaxed(&g_net_frees, int64_t(0));
+    atomic_store_release(&g_counting_frees, 1);
+    f();
+    atomic_store_release(&g_counting_frees, 0);
+    return atomic_load_acquire(&g_net_frees);
+}
+
+int main(int argc, char *argv[])
+{
+    const int nkeys = 20000;
+    lf::g_stdout_logger_on = true;
+    lf::init_lf_library(1);
+    ThreadInfo *ti = &((*lf::g_all_threads)[0]);
+
+    BasicTable table;
+    table.initialize(ti);
+    LimboHandle *handle = ti->new_handle();
+    char buf[128];
+    for (int i = 0; i < nkeys; i++)
+    {
+        TCursor lp(table, Slice(buf, make_key(i, buf, sizeof(buf))));
+        lp.find_insert(ti);
+        lp.value() = i;
+        lp.finish(1, ti);
+    }
+
+    uint64_t get_allocs = count_allocs([&]() {
+        for (int i = 0; i < 2 * nkeys; i++)
+        {
+            Slice key(buf, make_key(i, buf, sizeof(buf)));
+            LeafValue v;
+            table.get(key, v, ti);
+        }
+    });
+
+    uint64_t update_allocs = count_allocs([&]() {
+        for (int i = 0; i < nkeys; i++)
+        {
+            TCursor lp(table, Slice(buf, make_key(i, buf, sizeof(buf))));
+            lp.find_insert(ti);
+            lp.value() = i + 1;
+            lp.finish(1, ti);
+        }
+    });
+
+    uint64_t scan_allocs = count_allocs([&]() {
+        for (int i = 0; i < nkeys; i += 100)
+        {
+            NopScanner s = {0};
+            table.scan(Slice(buf, make_key(i, buf, sizeof(buf))), true, s, ti);
+        }
+    });
+
+    BasicTable fresh;
+    fresh.initialize(ti);
+    uint64_t insert_allocs = count_allocs([&]() {
+        for (int i = 0; i < nkeys; i++)
+        {
+            TCursor lp(fresh, Slice(buf, make_key(i, buf, sizeof(buf))));
+            lp.find_insert(ti);
+            lp.value() = i;
+            lp.finish(1, ti);
+        }
+    });
+    TableStats fs = fresh.stats(ti);
+    uint64_t insert_bound = fs.leaves + fs.internodes + 2 * fs.ksuf_bytes / 64;
+    lf::log("fresh insert: %llu allocations for %llu keys, %llu leaves, %llu internodes, %llu ksuf bytes",
+            (unsigned long long)insert_allocs, (unsigned long long)fs.keys,
+            (unsigned long long)fs.leaves, (unsigned long long)fs.internodes,
+            (unsigned long long)fs.ksuf_bytes);
+
+    ti->delete_handle(handle);
+    table.destroy(ti);
+
+    // 先用一个小表跑一次, 让工作线程的栈和TLS进入glibc的缓存
+    BasicTable warm;
+    warm.initialize(ti);
+    handle = ti->new_handle();
+    for (int i = 0; i < 100; i++)
+    {
+        TCursor lp(warm, Slice(buf, make_key(i, buf, sizeof(buf))));
+        lp.find_insert(ti);
+        lp.value() = i;
+        lp.finish(1, ti);
+    }
+    ti->delete_handle(handle);
+    warm.destroy_parallel(4);
+    // make_key的后两种key有超过8字节的公共前缀，会形成下层layer
+    handle = ti->new_handle();
+    fs = fresh.stats(ti);
+    ti->delete_handle(handle);
+    fresh.rebuild_filter(nkeys, ti);
+    fresh.enable_hot_index(1024, ti);
+    uint64_t destroy_blocks = fs.leaves + fs.internodes + fs.ksufs + 2;
+    int64_t destroy_frees = count_net_frees([&]() { fresh.destroy_parallel(4); });
+    lf::log("destroy_parallel: %lld net frees, %llu layers, %llu leaves, %llu internodes, %llu ksufs",
+            (long long)destroy_frees, (unsigned long long)fs.layers, (unsigned long long)fs.leaves,
+            (unsigned long long)fs.internodes, (unsigned long long)fs.ksufs);
+
+    intptr_t words[2] = {0, 0};
+    MCasThreadCtx *mcas_ctx = init_mcas_thread_ctx(0);
+    std::vector<CasRow> desc(2);
+    auto mcas_loop = [&](int n) {
+        for (int i = 0; i < n; i++)
+        {
+            LimboHandle *h = ti->new_handle();
+            MCasDescriptor *d = new_mcas_descriptor(mcas_ctx, h);
+            for (int k = 0; k < 2; k++)
+            {
+                intptr_t v = mcas_read(mcas_ctx, h, words + k);
+                desc[k] = CasRow(words + k, v, v + 1);
+                d->add(words + k, v + 1, v + 2);
+            }
+            mcas(mcas_ctx, h, desc);
+            mcas(mcas_ctx, h, d);
+            ti->delete_handle(h);
+        }
+    };
+    mcas_loop(nkeys);
+    uint64_t mcas_allocs = count_allocs([&]() { mcas_loop(nkeys); });
+
+    lf::log("heap allocations: get %llu, update %llu, scan %llu, mcas %llu",
+            (unsigned long long)get_allocs, (unsigned long long)update_allocs,
+            (unsigned long long)scan_allocs, (unsigned long long)mcas_allocs);
+    lf::deinit_lf_library();
+
+    if (get_allocs || update_allocs || scan_allocs || mcas_allocs)
+    {
+        lf::log("FAILED: point operations must not allocate");
+        return 1;
+    }
+    if (fs.layers < 2 || destroy_frees != int64_t(destroy_blocks) || fresh.root() != nullptr ||
+        fresh.filter() != nullptr || fresh.hot_index() != nullptr)
+    {
+        lf::log("FAILED: destroy_parallel freed %lld blocks, expected %llu",
+                (long long)destroy_frees, (unsigned long long)destroy_blocks);
+        return 1;
+    }
+    if (fs.keys != uint64_t(nkeys) || insert_allocs > insert_bound)
+    {
+        lf::log("FAILED: fresh inserts allocated %llu times, bound %llu",
+                (unsigned long long)insert_allocs, (unsigned long long)insert_bound);
+        return 1;
+    }
+    return 0;
+}
@@ -246,10 +246,255 @@ void multi_thread_test(int thd_no)
     lf::deinit_lf_library();
 }
 
+// 所有线程写同一小组key, 对比普通写入和FlatCombiner
+void hot_keys_test(int thd_no, bool combining)
+{
+    const int hot_keys = 16;
+    const int loop_cnt = 200000;
+    BasicTable table;
+
+    lf::g_all_threads = new std::vector<lf::ThreadInfo>(thd_no);
+    for (int i = 0; i < thd_no; i++)
+        (*lf::g_all_threads)[i].set_index(i);
+    lf::ThreadInfo *ti0 = &((*lf::g_all_threads)[0]);
+    table.initialize(ti0);
+    FlatCombiner fc(table, thd_no);
+
+    std::vector<std::thread> thds;
+    uint64_t begin = lf::now_micros();
+    for (int t = 0; t < thd_no; t++)
+    {
+        thds.push_back(std::thread([&, t]() {
+            lf::ThreadInfo *ti = &((*lf::g_all_threads)[t]);
+            char buf[32];
+            for (int i = 0; i < loop_cnt; i++)
+            {
+                lf::LimboHandle *handle = ti->new_handle();
+                int n = snprintf(buf, sizeof(buf), "hot-%02d", (i * 7 + t) % hot_keys);
+                Slice key(buf, n);
+                // 高32位是线程号, 用来检查最终值
+                uint64_t value = (uint64_t(t) << 32) | uint32_t(i);
+                if (combining)
+                {
+                    fc.put(key, value, ti);
+                }
+                else
+                {
+                    TCursor lp(table, key);
+                    lp.find_insert(ti);
+                    lp.value() = value;
+                    lp.finish(1, ti);
+                }
+                ti->delete_handle(handle);
+            }
+        }));
+    }
+    for (int t = 0; t < thd_no; t++)
+        thds[t].join();
+    uint64_t end = lf::now_micros();
+
+    // 每个key的最终值必须是某个线程对它的最后一次写入
+    struct Checker
+    {
+        int n_;
+        int hot_keys_;
+        int loop_cnt_;
+        void visit_leaf(const ScanStackElt &, const MtKey &, ThreadInfo *) {}
+        bool visit_value(Slice key, LeafValue &lv, ThreadInfo *)
+        {
+            int k = (key.data()[4] - '0') * 10 + (key.data()[5] - '0');
+            int t = int(lv.value() >> 32);
+            int last = -1;
+            for (int i = 0; i < loop_cnt_; i++)
+            {
+                if ((i * 7 + t) % hot_keys_ == k)
+                    last = i;
+            }
+            assert(uint32_t(lv.value()) == uint32_t(last));
+            (void)last;
+            ++n_;
+            return true;
+        }
+    } checker = {0, hot_keys, loop_cnt};
+    lf::LimboHandle *handle = ti0->new_handle();
+    table.scan(Slice(), true, checker, ti0);
+    ti0->delete_handle(handle);
+    assert(checker.n_ == hot_keys);
+
+    lf::log("%s %d threads: %g puts/s, %llu batches, %llu combined",
+            combining ? "combining" : "plain", thd_no,
+            double(loop_cnt) * thd_no / ((end - begin) * 1e-6),
+            (unsigned long long)fc.batches(), (unsigned long long)fc.combined());
+
+    table.destroy(ti0);
+    for (int i = 0; i < thd_no; i++)
+        (*lf::g_all_threads)[i].destroy();
+    delete lf::g_all_threads;
+    lf::g_all_threads = nullptr;
+}
+
+// 大表上的随机点查，对比逐个get和MtExecutor交错执行
+void interleaved_get_test(int nkeys, int inflight)
+{
+    BasicTable table;
+    lf::g_all_threads = new std::vector<lf::ThreadInfo>(1);
+    lf::ThreadInfo *ti = &((*lf::g_all_threads)[0]);
+    table.initialize(ti);
+
+    std::vector<uint64_t> keys(nkeys);
+    lf::LimboHandle *handle = ti->new_handle();
+    for (int i = 0; i < nkeys; i++)
+    {
+        keys[i] = (uint64_t(i) * 0x9e3779b97f4a7c15ULL) >> 8;
+        TCursor lp(table, Slice(reinterpret_cast<const char *>(&keys[i]), sizeof(uint64_t)));
+        lp.find_insert(ti);
+        lp.value() = i;
+        lp.finish(1, ti);
+    }
+    ti->delete_handle(handle);
+
+    const int lookups = 1000000;
+    uint64_t sum = 0;
+    uint64_t begin = lf::now_micros();
+    handle = ti->new_handle();
+    for (int i = 0; i < lookups; i++)
+    {
+        Slice key(reinterpret_cast<const char *>(&keys[(i * 7919ULL) % nkeys]), sizeof(uint64_t));
+        LeafValue v;
+        if (table.get(key, v, ti))
+            sum += v.value();
+    }
+    ti->delete_handle(handle);
+    uint64_t mid = lf::now_micros();
+
+    struct Sum
+    {
+        static void done(void *arg, bool found, uint64_t value)
+        {
+            if (found)
+                *static_cast<uint64_t *>(arg) += value;
+        }
+    };
+    uint64_t asum = 0;
+    {
+        MtExecutor ex(table, ti, inflight);
+        for (int i = 0; i < lookups; i++)
+        {
+            Slice key(reinterpret_cast<const char *>(&keys[(i * 7919ULL) % nkeys]), sizeof(uint64_t));
+            ex.get(key, Sum::done, &asum);
+        }
+        ex.drain();
+    }
+    uint64_t end = lf::now_micros();
+    assert(sum == asum);
+
+    lf::log("%d keys: get %g ops/s, interleaved(%d) %g ops/s",
+            nkeys, lookups / ((mid - begin) * 1e-6),
+            inflight, lookups / ((end - mid) * 1e-6));
+
+    table.destroy(ti);
+    ti->destroy();
+    delete lf::g_all_threads;
+    lf::g_all_threads = nullptr;
+}
+
+// 环的个数少于线程数, 环很小; 读者线程也写同一个Leaf, 写者在锁内等环会死锁。
+// combining时所有写入都经过FlatCombiner, 持锁线程等自己的环也会死锁
+void change_feed_test(int thd_no, bool combining)
+{
+    const int loop_cnt = 200000;
+    BasicTable table;
+
+    lf::g_all_threads = new std::vector<lf::ThreadInfo>(thd_no + 1);
+    for (int i = 0; i <= thd_no; i++)
+        (*lf::g_all_threads)[i].set_index(i);
+    lf::ThreadInfo *ti0 = &((*lf::g_all_threads)[0]);
+    table.initialize(ti0);
+    ChangeFeed feed(1, ChangeFeed::min_ring_bytes);
+    table.set_change_feed(&feed);
+    FlatCombiner fc(table, thd_no + 1);
+    auto put = [&](Slice key, uint64_t value, lf::ThreadInfo *ti) {
+        if (combining)
+        {
+            fc.put(key, value, ti);
+        }
+        else
+        {
+            TCursor lp(table, key);
+            lp.find_insert(ti);
+            lp.value() = value;
+            lp.finish(1, ti);
+        }
+    };
+
+    struct Reader
+    {
+        uint64_t n_;
+        lf::Epoch last_epoch_;
+        bool ordered_;
+        void operator()(const ChangeRecord &rec)
+        {
+            ++n_;
+            ordered_ = ordered_ && rec.epoch >= last_epoch_;
+            last_epoch_ = rec.epoch;
+        }
+    } reader = {0, 0, true};
+
+    volatile int32_t done = 0;
+    std::vector<std::thread> thds;
+    for (int t = 1; t <= thd_no; t++)
+    {
+        thds.push_back(std::thread([&, t]() {
+            lf::ThreadInfo *ti = &((*lf::g_all_threads)[t]);
+            char buf[32];
+            for (int i = 0; i < loop_cnt; i++)
+            {
+                lf::LimboHandle *handle = ti->new_handle();
+                int n = snprintf(buf, sizeof(buf), "cdc-%d", i % 8);
+                put(Slice(buf, n), i, ti);
+                ti->delete_handle(handle);
+            }
+            atomic_add32(&done, 1);
+        }));
+    }
+
+    uint64_t puts = 0;
+    while (atomic_load_acquire(&done) != thd_no)
+    {
+        lf::LimboHandle *handle = ti0->new_handle();
+        put(Slice("cdc-0"), puts, ti0);
+        ti0->delete_handle(handle);
+        ++puts;
+        feed.poll(reader);
+    }
+    for (int t = 0; t < thd_no; t++)
+        thds[t].join();
+    feed.poll(reader);
+    table.set_change_feed(nullptr);
+    assert(reader.n_ == puts + uint64_t(thd_no) * loop_cnt);
+    assert(feed.read_lsn() == reader.n_);
+    assert(reader.ordered_);
+
+    lf::log("change feed %s %d threads: %llu records, %llu stalls",
+            combining ? "combining" : "plain", thd_no,
+            (unsigned long long)reader.n_, (unsigned long long)feed.stalls());
+
+    lf::LimboHandle *handle = ti0->new_handle();
+    table.destroy(ti0);
+    ti0->delete_handle(handle);
+    delete lf::g_all_threads;
+    lf::g_all_threads = nullptr;
+}
+
 int main(int argc, char *argv[])
 {
     lf::g_stdout_logger_on = true;
     multi_thread_test(1);
+    hot_keys_test(8, false);
+    hot_keys_test(8, true);
+    interleaved_get_test(2000000, 8);
+    change_feed_test(4, false);
+    change_feed_test(4, true);
 
     return 0;
 }
\ No newline at end of file
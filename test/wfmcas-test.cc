@@ -4,6 +4,7 @@
 #include "lf/time_util.hh"
 #include "lf/random.hh"
 #include <thread>
+#include <assert.h>
 
 intptr_t g_array[2] = {0};
 
@@ -90,13 +91,122 @@ void multi_thread_test(int thd_no)
     delete[] ctx;
 }
 
+// 线程反复注册、做一批mcas、注销，槽位和留下的limbo被后来的线程接手
+void churn_thread(int loop_cnt, int64_t *success)
+{
+    lf::ThreadInfo *ti = lf::register_thread();
+    assert(ti != nullptr);
+    lf::MCasThreadCtx *mcas_ctx = lf::init_mcas_thread_ctx(ti->index());
+    for (int i = 0; i < loop_cnt; i++)
+    {
+        lf::LimboHandle *handle = ti->new_handle();
+        std::vector<lf::CasRow> desc;
+        intptr_t g1 = lf::mcas_read(mcas_ctx, handle, g_array);
+        intptr_t g2 = lf::mcas_read(mcas_ctx, handle, g_array + 1);
+        desc.push_back(lf::CasRow(g_array, g1, g1 + 1));
+        desc.push_back(lf::CasRow(g_array + 1, g2, g2 + 1));
+        if (lf::mcas(mcas_ctx, handle, desc))
+            (*success)++;
+        ti->delete_handle(handle);
+    }
+    lf::unregister_thread(ti);
+}
+
+void churn_test(int thd_no, int rounds)
+{
+    g_array[0] = 0;
+    g_array[1] = 0;
+    std::vector<int64_t> success(thd_no, 0);
+    uint64_t begin = lf::now_micros();
+    for (int r = 0; r < rounds; r++)
+    {
+        std::vector<std::thread> thds;
+        for (int i = 0; i < thd_no; i++)
+            thds.push_back(std::thread(churn_thread, 10000, &success[i]));
+        for (int i = 0; i < thd_no; i++)
+            thds[i].join();
+    }
+    int64_t total = 0;
+    for (int i = 0; i < thd_no; i++)
+        total += success[i];
+
+    lf::log("churn %d threads x %d rounds in %lld micros, %lld success, g_array(%ld, %ld)",
+            thd_no, rounds, lf::now_micros() - begin, total, g_array[0], g_array[1]);
+    assert(g_array[0] == total && g_array[1] == total);
+}
+
+// MCasDescriptor: 每8次有一次故意用过期的expected, 应该在预检时失败，不改变g_array
+struct DescriptorStats
+{
+    int64_t results[4];
+};
+
+void descriptor_thread(int idx, int loop_cnt, DescriptorStats *stats)
+{
+    lf::ThreadInfo *ti = &((*lf::g_all_threads)[idx]);
+    lf::MCasThreadCtx *mcas_ctx = lf::init_mcas_thread_ctx(idx);
+    for (int i = 0; i < loop_cnt; i++)
+    {
+        lf::LimboHandle *handle = ti->new_handle();
+        intptr_t g1 = lf::mcas_read(mcas_ctx, handle, g_array);
+        intptr_t g2 = lf::mcas_read(mcas_ctx, handle, g_array + 1);
+        if (i % 8 == 7)
+            g1--;
+        lf::MCasDescriptor *desc = lf::new_mcas_descriptor(mcas_ctx, handle);
+        desc->add(g_array, g1, g1 + 1);
+        desc->add(g_array + 1, g2, g2 + 1);
+        stats->results[lf::mcas(mcas_ctx, handle, desc)]++;
+        ti->delete_handle(handle);
+    }
+}
+
+void descriptor_test(int thd_no, int loop_cnt)
+{
+    g_array[0] = 0;
+    g_array[1] = 0;
+    {
+        lf::ThreadInfo *ti = &((*lf::g_all_threads)[0]);
+        lf::MCasThreadCtx *mcas_ctx = lf::init_mcas_thread_ctx(0);
+        lf::LimboHandle *handle = ti->new_handle();
+        lf::MCasDescriptor *desc = lf::new_mcas_descriptor(mcas_ctx, handle);
+        desc->add(g_array, 0, 1);
+        desc->add(g_array + 1, 0, 1);
+        desc->add(g_array, 0, 2);
+        lf::MCasResult res = lf::mcas(mcas_ctx, handle, desc);
+        assert(res == lf::mcas_duplicate_address && g_array[0] == 0 && g_array[1] == 0);
+        (void)res;
+        ti->delete_handle(handle);
+    }
+
+    std::vector<DescriptorStats> stats(thd_no, DescriptorStats());
+    std::vector<std::thread> thds;
+    uint64_t begin = lf::now_micros();
+    for (int i = 0; i < thd_no; i++)
+        thds.push_back(std::thread(descriptor_thread, i, loop_cnt, &stats[i]));
+    for (int i = 0; i < thd_no; i++)
+        thds[i].join();
+    int64_t sum[4] = {0};
+    for (int i = 0; i < thd_no; i++)
+        for (int k = 0; k < 4; k++)
+            sum[k] += stats[i].results[k];
+
+    lf::log("descriptor %d threads x %d in %lld micros, %lld succeeded, %lld failed, %lld doomed",
+            thd_no, loop_cnt, lf::now_micros() - begin, sum[lf::mcas_succeeded],
+            sum[lf::mcas_failed], sum[lf::mcas_doomed]);
+    assert(sum[lf::mcas_doomed] >= int64_t(thd_no) * (loop_cnt / 8));
+    assert(sum[lf::mcas_duplicate_address] == 0);
+    assert(g_array[0] == sum[lf::mcas_succeeded] && g_array[1] == sum[lf::mcas_succeeded]);
+}
+
 int main(int argc, char **argv)
 {
     int work_thread_no = 4;
-    lf::Status sts = lf::init_lf_library(work_thread_no);
+    lf::Status sts = lf::init_lf_library(work_thread_no, work_thread_no + 4);
 
     lf::g_stdout_logger_on = true;
     multi_thread_test(work_thread_no);
+    churn_test(4, 50);
+    descriptor_test(work_thread_no, 1000000);
 
     lf::deinit_lf_library();
     return 0;